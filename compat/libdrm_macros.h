@@ -0,0 +1,21 @@
+/*
+ * Fallback for libdrm_macros.h, which is private to the libdrm source
+ * tree and not installed with libdrm. Only used by builds against an
+ * installed libdrm.
+ */
+#ifndef LIBDRM_LIBDRM_H
+#define LIBDRM_LIBDRM_H
+
+#include <sys/mman.h>
+
+#define drm_public __attribute__((visibility("default")))
+
+static inline void *drm_mmap(void *addr, size_t length, int prot, int flags,
+	int fd, off_t offset)
+{
+	return mmap(addr, length, prot, flags, fd, offset);
+}
+
+#define drm_munmap(addr, length) munmap(addr, length)
+
+#endif
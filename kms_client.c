@@ -0,0 +1,1957 @@
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "libdrm_macros.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+#include "kms_trace.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define KMS_ARENA_CHUNK_SIZE (16 * 1024)
+
+/* Alignment and granule of kms_alloc_huge() memory */
+#define KMS_HUGE_PAGE_SIZE (2 << 20)
+
+/* Cache line size assumed by streaming copy */
+#define KMS_CACHE_LINE 64
+
+/* Bytes of a mapping read by kms_mapping_is_wc() */
+#define KMS_WC_PROBE_SIZE (1 << 20)
+
+/* Linux 5.14 uapi, missing from older headers */
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* Upper bound of devices enumerated and waited on at once */
+#define KMS_MAX_DEVICES 16
+
+struct kms_arena_chunk {
+	struct kms_arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+/* Return zeroed memory, 8 byte aligned */
+void *kms_arena_alloc(struct kms_arena *arena, size_t size)
+{
+	struct kms_arena_chunk *chunk = arena->chunk;
+	void *ptr;
+
+	size = (size + 7) & ~(size_t)7;
+
+	if (!chunk || chunk->used + size > chunk->size) {
+		size_t chunk_size = size > KMS_ARENA_CHUNK_SIZE ?
+			size : KMS_ARENA_CHUNK_SIZE;
+
+		chunk = malloc(sizeof(struct kms_arena_chunk) + chunk_size);
+		if (!chunk)
+			return NULL;
+
+		chunk->next = arena->chunk;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		arena->chunk = chunk;
+		arena->reserved += chunk_size;
+		arena->n_chunks++;
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	arena->used += size;
+	arena->n_allocs++;
+	memset(ptr, 0, size);
+
+	return ptr;
+}
+
+void *kms_arena_dup(struct kms_arena *arena, const void *src, size_t size)
+{
+	void *ptr = kms_arena_alloc(arena, size);
+
+	if (ptr && size)
+		memcpy(ptr, src, size);
+
+	return ptr;
+}
+
+void kms_arena_release(struct kms_arena *arena)
+{
+	struct kms_arena_chunk *chunk = arena->chunk;
+
+	while (chunk) {
+		struct kms_arena_chunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+
+	memset(arena, 0, sizeof(struct kms_arena));
+}
+
+void kms_arena_report(struct kms_arena *arena)
+{
+	printf("metadata arena: %zu bytes in %u allocations, "
+		"%zu bytes reserved in %u chunks\n",
+		arena->used, arena->n_allocs, arena->reserved, arena->n_chunks);
+}
+
+/* FNV-1a */
+static uint64_t blob_hash(const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	while (size--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+static void blob_destroy(int fd, struct kms_blob_manager *blobs,
+	struct kms_blob_entry *entry)
+{
+	drmModeDestroyPropertyBlob(fd, entry->blob_id);
+	free(entry->data);
+	blobs->destroyed++;
+}
+
+/*
+ * Return id of a blob holding data and take a reference to it, 0 on
+ * error. An interned blob with the same content is reused.
+ */
+uint32_t
+kms_blob_get(int fd, struct kms_blob_manager *blobs, const void *data,
+	uint32_t size)
+{
+	struct kms_blob_entry *entry = NULL;
+	uint64_t hash = blob_hash(data, size);
+	uint32_t blob_id;
+	void *copy;
+	int i;
+
+	for (i = 0; i < blobs->n_entries; i++) {
+		entry = &blobs->entry[i];
+		if (entry->hash == hash && entry->size == size &&
+			!memcmp(entry->data, data, size)) {
+			entry->refcount++;
+			entry->last_use = ++blobs->clock;
+			blobs->hits++;
+			return entry->blob_id;
+		}
+	}
+
+	/* Take a free slot, else the least recently used unreferenced one */
+	entry = NULL;
+	if (blobs->n_entries == blobs->size) {
+		for (i = 0; i < blobs->n_entries; i++) {
+			if (blobs->entry[i].refcount)
+				continue;
+			if (!entry || blobs->entry[i].last_use < entry->last_use)
+				entry = &blobs->entry[i];
+		}
+	}
+
+	/* Every slot is referenced, grow rather than fail */
+	if (!entry && blobs->n_entries == blobs->size) {
+		int n = blobs->size ? 2 * blobs->size :
+			KMS_BLOB_MANAGER_SIZE;
+		struct kms_blob_entry *grown = realloc(blobs->entry,
+			n * sizeof(struct kms_blob_entry));
+
+		if (!grown)
+			return 0;
+		blobs->entry = grown;
+		blobs->size = n;
+	}
+
+	copy = malloc(size);
+	if (!copy)
+		return 0;
+	if (drmModeCreatePropertyBlob(fd, data, size, &blob_id)) {
+		free(copy);
+		return 0;
+	}
+	memcpy(copy, data, size);
+	blobs->created++;
+
+	if (entry)
+		blob_destroy(fd, blobs, entry);
+	else
+		entry = &blobs->entry[blobs->n_entries++];
+
+	entry->hash = hash;
+	entry->size = size;
+	entry->blob_id = blob_id;
+	entry->refcount = 1;
+	entry->last_use = ++blobs->clock;
+	entry->data = copy;
+
+	return blob_id;
+}
+
+/* Drop a reference taken by kms_blob_get(), 0 is ignored */
+void kms_blob_put(struct kms_blob_manager *blobs, uint32_t blob_id)
+{
+	int i;
+
+	if (!blob_id)
+		return;
+
+	for (i = 0; i < blobs->n_entries; i++) {
+		if (blobs->entry[i].blob_id == blob_id) {
+			if (blobs->entry[i].refcount > 0)
+				blobs->entry[i].refcount--;
+			return;
+		}
+	}
+}
+
+/*
+ * Destroy all interned blobs. Blobs still used by committed state stay
+ * alive in kernel until that state is replaced.
+ */
+void kms_blob_release_all(int fd, struct kms_blob_manager *blobs)
+{
+	int i;
+
+	for (i = 0; i < blobs->n_entries; i++)
+		blob_destroy(fd, blobs, &blobs->entry[i]);
+	free(blobs->entry);
+	blobs->entry = NULL;
+	blobs->n_entries = 0;
+	blobs->size = 0;
+}
+
+void kms_blob_report(struct kms_blob_manager *blobs)
+{
+	printf("property blobs: %u created, %u reused, %u destroyed\n",
+		blobs->created, blobs->hits, blobs->destroyed);
+}
+
+/* Copy crtc, encoder and connector resources into arena */
+drmModeResPtr kms_get_resources(int fd, struct kms_arena *arena)
+{
+	drmModeResPtr drm_res_ptr = drmModeGetResources(fd);
+	drmModeResPtr res_ptr;
+
+	if (!drm_res_ptr)
+		return NULL;
+
+	res_ptr = kms_arena_dup(arena, drm_res_ptr, sizeof(drmModeRes));
+	res_ptr->fbs = kms_arena_dup(arena, drm_res_ptr->fbs,
+		drm_res_ptr->count_fbs * sizeof(uint32_t));
+	res_ptr->crtcs = kms_arena_dup(arena, drm_res_ptr->crtcs,
+		drm_res_ptr->count_crtcs * sizeof(uint32_t));
+	res_ptr->connectors = kms_arena_dup(arena, drm_res_ptr->connectors,
+		drm_res_ptr->count_connectors * sizeof(uint32_t));
+	res_ptr->encoders = kms_arena_dup(arena, drm_res_ptr->encoders,
+		drm_res_ptr->count_encoders * sizeof(uint32_t));
+	drmModeFreeResources(drm_res_ptr);
+
+	return res_ptr;
+}
+
+/* Copy plane resources into arena */
+drmModePlaneResPtr
+kms_get_plane_resources(int fd, struct kms_arena *arena)
+{
+	drmModePlaneResPtr drm_plane_res_ptr = drmModeGetPlaneResources(fd);
+	drmModePlaneResPtr plane_res_ptr;
+
+	if (!drm_plane_res_ptr)
+		return NULL;
+
+	plane_res_ptr = kms_arena_dup(arena, drm_plane_res_ptr,
+		sizeof(drmModePlaneRes));
+	plane_res_ptr->planes = kms_arena_dup(arena, drm_plane_res_ptr->planes,
+		drm_plane_res_ptr->count_planes * sizeof(uint32_t));
+	drmModeFreePlaneResources(drm_plane_res_ptr);
+
+	return plane_res_ptr;
+}
+
+static int prop_obj_type_index(uint32_t obj_type)
+{
+	switch (obj_type) {
+		case DRM_MODE_OBJECT_CRTC:
+			return KMS_OBJ_CRTC;
+		case DRM_MODE_OBJECT_ENCODER:
+			return KMS_OBJ_ENCODER;
+		case DRM_MODE_OBJECT_CONNECTOR:
+			return KMS_OBJ_CONNECTOR;
+		case DRM_MODE_OBJECT_PLANE:
+			return KMS_OBJ_PLANE;
+	}
+
+	return -1;
+}
+
+/* Return interned id of a property name, -1 if no object has it */
+static int
+get_name_id(struct kms_properties *t_prop, const char *prop_name)
+{
+	int i;
+
+	for (i = 0; i < t_prop->n_names; i++) {
+		if (!strcmp(prop_name, t_prop->name[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+static const uint32_t prop_obj_types[KMS_N_OBJ_TYPES] = {
+	DRM_MODE_OBJECT_CRTC, DRM_MODE_OBJECT_ENCODER,
+	DRM_MODE_OBJECT_CONNECTOR, DRM_MODE_OBJECT_PLANE,
+};
+
+struct kms_properties *
+kms_get_properties(int fd, struct kms_arena *arena, drmModeResPtr res_ptr,
+	drmModePlaneResPtr plane_res_ptr)
+{
+	uint32_t *objs[KMS_N_OBJ_TYPES] = {
+		res_ptr->crtcs, res_ptr->encoders,
+		res_ptr->connectors, plane_res_ptr ? plane_res_ptr->planes : NULL,
+	};
+	int n_objs[KMS_N_OBJ_TYPES] = {
+		res_ptr->count_crtcs, res_ptr->count_encoders,
+		res_ptr->count_connectors,
+		plane_res_ptr ? plane_res_ptr->count_planes : 0,
+	};
+	drmModeObjectPropertiesPtr *obj_prop_ptr;
+	struct kms_properties *t_prop;
+	struct kms_properties names;
+	uint32_t *seen_prop_id;
+	uint16_t *seen_name_id;
+	uint32_t *seen_flags;
+	uint32_t n_seen = 0;
+	uint32_t count = 0;
+	uint32_t row = 0;
+	char *mem;
+	int n_total = 0;
+	int t, i, j, k, n;
+
+	for (t = 0; t < KMS_N_OBJ_TYPES; t++)
+		n_total += n_objs[t];
+
+	/* Fetch property lists of all objects to size the store */
+	obj_prop_ptr = drmMalloc(n_total * sizeof(drmModeObjectPropertiesPtr));
+	for (t = 0, n = 0; t < KMS_N_OBJ_TYPES; t++) {
+		for (i = 0; i < n_objs[t]; i++, n++) {
+			obj_prop_ptr[n] = drmModeObjectGetProperties(fd,
+				objs[t][i], prop_obj_types[t]);
+			if (obj_prop_ptr[n])
+				count += obj_prop_ptr[n]->count_props;
+		}
+	}
+
+	/*
+	 * Objects of a type share property ids, so each distinct property is
+	 * queried once, and its name interned in a scratch table sized for
+	 * the worst case. Its enum and blob payloads aren't kept.
+	 */
+	seen_prop_id = drmMalloc(count * sizeof(uint32_t));
+	seen_name_id = drmMalloc(count * sizeof(uint16_t));
+	seen_flags = drmMalloc(count * sizeof(uint32_t));
+	memset(&names, 0, sizeof(names));
+	names.name = drmMalloc(count * DRM_PROP_NAME_LEN);
+
+	for (n = 0; n < n_total; n++) {
+		for (j = 0; obj_prop_ptr[n] &&
+			j < obj_prop_ptr[n]->count_props; j++) {
+			uint32_t prop_id = obj_prop_ptr[n]->props[j];
+			drmModePropertyPtr prop_ptr;
+			int name_id = -1;
+
+			for (k = 0; k < n_seen; k++) {
+				if (seen_prop_id[k] == prop_id)
+					break;
+			}
+			if (k < n_seen)
+				continue;
+
+			prop_ptr = drmModeGetProperty(fd, prop_id);
+			if (prop_ptr)
+				name_id = get_name_id(&names, prop_ptr->name);
+			if (prop_ptr && name_id < 0) {
+				name_id = names.n_names++;
+				strcpy(names.name[name_id], prop_ptr->name);
+			}
+
+			seen_prop_id[k] = prop_id;
+			seen_name_id[k] = name_id;
+			seen_flags[k] = prop_ptr ? prop_ptr->flags : 0;
+			n_seen++;
+			drmModeFreeProperty(prop_ptr);
+		}
+	}
+
+	/*
+	 * Single allocation, widest arrays first to keep them aligned. The
+	 * name table holds distinct names only, a few dozen however many
+	 * objects there are.
+	 */
+	mem = kms_arena_alloc(arena, sizeof(struct kms_properties) +
+		count * (sizeof(uint64_t) + 3 * sizeof(uint32_t) +
+		sizeof(uint16_t)) + names.n_names * DRM_PROP_NAME_LEN);
+	t_prop = (struct kms_properties *)mem;
+	mem += sizeof(struct kms_properties);
+	t_prop->count = count;
+	t_prop->value = (uint64_t *)mem;
+	mem += count * sizeof(uint64_t);
+	t_prop->obj_id = (uint32_t *)mem;
+	mem += count * sizeof(uint32_t);
+	t_prop->prop_id = (uint32_t *)mem;
+	mem += count * sizeof(uint32_t);
+	t_prop->flags = (uint32_t *)mem;
+	mem += count * sizeof(uint32_t);
+	t_prop->name_id = (uint16_t *)mem;
+	mem += count * sizeof(uint16_t);
+	t_prop->name = (char (*)[DRM_PROP_NAME_LEN])mem;
+	t_prop->n_names = names.n_names;
+	memcpy(t_prop->name, names.name, names.n_names * DRM_PROP_NAME_LEN);
+
+	for (t = 0, n = 0; t < KMS_N_OBJ_TYPES; t++) {
+		t_prop->type_start[t] = row;
+
+		for (i = 0; i < n_objs[t]; i++, n++) {
+			for (j = 0; obj_prop_ptr[n] &&
+				j < obj_prop_ptr[n]->count_props; j++, row++) {
+				uint32_t prop_id = obj_prop_ptr[n]->props[j];
+
+				for (k = 0; k < n_seen; k++) {
+					if (seen_prop_id[k] == prop_id)
+						break;
+				}
+
+				t_prop->obj_id[row] = objs[t][i];
+				t_prop->prop_id[row] = prop_id;
+				t_prop->name_id[row] = seen_name_id[k];
+				t_prop->flags[row] = seen_flags[k];
+				t_prop->value[row] =
+					obj_prop_ptr[n]->prop_values[j];
+			}
+			drmModeFreeObjectProperties(obj_prop_ptr[n]);
+		}
+	}
+	t_prop->type_start[KMS_N_OBJ_TYPES] = row;
+
+	drmFree(names.name);
+	drmFree(seen_flags);
+	drmFree(seen_name_id);
+	drmFree(seen_prop_id);
+	drmFree(obj_prop_ptr);
+
+	return t_prop;
+}
+
+/*
+ * Return row of prop_id in rows [row, end) of one object, end if missing.
+ * Kernel lists properties in the same order as before, so nth is tried
+ * first.
+ */
+static uint32_t
+find_obj_row(struct kms_properties *props, uint32_t row, uint32_t end,
+	uint32_t nth, uint32_t prop_id)
+{
+	uint32_t r;
+
+	if (row + nth < end && props->prop_id[row + nth] == prop_id)
+		return row + nth;
+
+	for (r = row; r < end; r++) {
+		if (props->prop_id[r] == prop_id)
+			break;
+	}
+
+	return r;
+}
+
+/*
+ * Re-read current values of all properties in place. Rows, ids and names
+ * stay, so the store isn't reallocated. Return 0 if every object was read.
+ */
+int kms_refresh_properties(int fd, struct kms_properties *props)
+{
+	drmModeObjectPropertiesPtr obj_prop_ptr;
+	uint32_t row, end, r;
+	int ret = 0;
+	int t, j;
+
+	for (t = 0; t < KMS_N_OBJ_TYPES; t++) {
+		/* Rows of one object are contiguous */
+		for (row = props->type_start[t];
+			row < props->type_start[t + 1]; row = end) {
+			for (end = row + 1; end < props->type_start[t + 1] &&
+				props->obj_id[end] == props->obj_id[row]; end++)
+				;
+
+			obj_prop_ptr = drmModeObjectGetProperties(fd,
+				props->obj_id[row], prop_obj_types[t]);
+			if (!obj_prop_ptr) {
+				ret = -1;
+				continue;
+			}
+
+			for (j = 0; j < obj_prop_ptr->count_props; j++) {
+				r = find_obj_row(props, row, end, j,
+					obj_prop_ptr->props[j]);
+				if (r < end)
+					props->value[r] =
+						obj_prop_ptr->prop_values[j];
+			}
+			drmModeFreeObjectProperties(obj_prop_ptr);
+		}
+	}
+
+	return ret;
+}
+
+/* Return row of a property of an object, -1 if it has none */
+static int
+get_prop_row(struct kms_properties *t_prop, uint32_t obj_type, uint32_t obj_id,
+	const char *prop_name)
+{
+	int type = prop_obj_type_index(obj_type);
+	int name_id = get_name_id(t_prop, prop_name);
+	uint32_t start = 0, end = t_prop->count;
+	uint32_t i;
+
+	if (name_id < 0)
+		return -1;
+
+	if (obj_type != DRM_MODE_OBJECT_ANY) {
+		if (type < 0)
+			return -1;
+		start = t_prop->type_start[type];
+		end = t_prop->type_start[type + 1];
+	}
+
+	for (i = start; i < end; i++) {
+		if (t_prop->obj_id[i] == obj_id && t_prop->name_id[i] == name_id)
+			return i;
+	}
+
+	return -1;
+}
+
+uint32_t kms_get_prop_id(struct kms_properties *props, uint32_t obj_type,
+	uint32_t obj_id, const char *prop_name)
+{
+	int row = get_prop_row(props, obj_type, obj_id, prop_name);
+
+	return row < 0 ? 0 : props->prop_id[row];
+}
+
+uint64_t kms_get_prop_value(struct kms_properties *props, uint32_t obj_type,
+	uint32_t obj_id, const char *prop_name, uint64_t def)
+{
+	int row = get_prop_row(props, obj_type, obj_id, prop_name);
+
+	return row < 0 ? def : props->value[row];
+}
+
+/* Get 1st connector with a valid mode */
+drmModeConnectorPtr
+kms_get_connector(int fd, struct kms_arena *arena, uint32_t *con_id, int con_cnt)
+{
+	drmModeConnectorPtr con_ptr = NULL;
+	int i;
+
+	for (i = 0; i < con_cnt && !con_ptr; i++) {
+		drmModeConnectorPtr drm_con_ptr =
+			drmModeGetConnector(fd, con_id[i]);
+
+		if (!drm_con_ptr)
+			continue;
+
+		/* Properties are kept in property store, not here */
+		if (drm_con_ptr->count_modes) {
+			con_ptr = kms_arena_dup(arena, drm_con_ptr,
+				sizeof(drmModeConnector));
+			con_ptr->modes = kms_arena_dup(arena, drm_con_ptr->modes,
+				drm_con_ptr->count_modes *
+				sizeof(drmModeModeInfo));
+			con_ptr->encoders = kms_arena_dup(arena,
+				drm_con_ptr->encoders,
+				drm_con_ptr->count_encoders * sizeof(uint32_t));
+			con_ptr->count_props = 0;
+			con_ptr->props = NULL;
+			con_ptr->prop_values = NULL;
+		}
+		drmModeFreeConnector(drm_con_ptr);
+	}
+
+	return con_ptr;
+}
+
+/* Get 1st encoder out of all possible encoders for selected connector */
+drmModeEncoderPtr
+kms_get_encoder(int fd, struct kms_arena *arena, drmModeConnectorPtr con_ptr)
+{
+	drmModeEncoderPtr drm_enc_ptr;
+	drmModeEncoderPtr enc_ptr;
+
+	if (!con_ptr->count_encoders)
+		return NULL;
+
+	drm_enc_ptr = drmModeGetEncoder(fd, con_ptr->encoders[0]);
+	if (!drm_enc_ptr)
+		return NULL;
+
+	enc_ptr = kms_arena_dup(arena, drm_enc_ptr, sizeof(drmModeEncoder));
+	drmModeFreeEncoder(drm_enc_ptr);
+
+	return enc_ptr;
+}
+
+/* Get 1st crtc out of all possible crtcs for selected encoder */
+drmModeCrtcPtr
+kms_get_crtc(int fd, struct kms_arena *arena, drmModeResPtr res_ptr,
+	drmModeEncoderPtr enc_ptr)
+{
+	int crtc_idx = ffs(enc_ptr->possible_crtcs);
+	drmModeCrtcPtr drm_crtc_ptr;
+	drmModeCrtcPtr crtc_ptr;
+
+	if (!crtc_idx)
+		return NULL;
+
+	drm_crtc_ptr = drmModeGetCrtc(fd, res_ptr->crtcs[crtc_idx - 1]);
+	if (!drm_crtc_ptr)
+		return NULL;
+
+	crtc_ptr = kms_arena_dup(arena, drm_crtc_ptr, sizeof(drmModeCrtc));
+	drmModeFreeCrtc(drm_crtc_ptr);
+
+	return crtc_ptr;
+}
+
+/* Get 1st plane out of all planes possible for selected crtc */
+drmModePlanePtr
+kms_get_plane(int fd, struct kms_arena *arena, drmModePlaneResPtr plane_res_ptr,
+	drmModeResPtr res_ptr, drmModeCrtcPtr crtc_ptr)
+{
+	int i;
+	uint32_t active_crtc_bitmask = 0;
+	drmModePlanePtr plane_ptr = NULL;
+
+	for (i = 0; i < res_ptr->count_crtcs; i++) {
+		if (crtc_ptr->crtc_id == res_ptr->crtcs[i])
+			active_crtc_bitmask = 1 << i;
+	}
+
+	for (i = 0; i < plane_res_ptr->count_planes && !plane_ptr; i++) {
+		drmModePlanePtr drm_plane_ptr =
+			drmModeGetPlane(fd, plane_res_ptr->planes[i]);
+
+		if (!drm_plane_ptr)
+			continue;
+
+		if (drm_plane_ptr->possible_crtcs & active_crtc_bitmask) {
+			plane_ptr = kms_arena_dup(arena, drm_plane_ptr,
+				sizeof(drmModePlane));
+			plane_ptr->formats = kms_arena_dup(arena,
+				drm_plane_ptr->formats,
+				drm_plane_ptr->count_formats * sizeof(uint32_t));
+		}
+		drmModeFreePlane(drm_plane_ptr);
+	}
+
+	return plane_ptr;
+}
+
+/* Pack 8 bit components into a pixel of each supported format */
+#define PACK_XRGB8888(r, g, b, a) (((r) << 16) | ((g) << 8) | (b))
+#define PACK_ARGB8888(r, g, b, a) (((a) << 24) | ((r) << 16) | ((g) << 8) | (b))
+#define PACK_XBGR8888(r, g, b, a) (((b) << 16) | ((g) << 8) | (r))
+#define PACK_RGB565(r, g, b, a) \
+	((((r) >> 3) << 11) | (((g) >> 2) << 5) | ((b) >> 3))
+
+/* format, bits per pixel, pixel type, pack macro */
+#define FILL_FORMATS(X) \
+	X(XRGB8888, 32, uint32_t, PACK_XRGB8888) \
+	X(ARGB8888, 32, uint32_t, PACK_ARGB8888) \
+	X(XBGR8888, 32, uint32_t, PACK_XBGR8888) \
+	X(RGB565, 16, uint16_t, PACK_RGB565)
+
+/*
+ * Tiles pattern specialized for one format. Same image as the generic
+ * per pixel loop: color only changes every 64 pixels of (x + y) % width,
+ * so per row the wrap point and alpha split are computed once and each
+ * run of equal pixels is packed once.
+ */
+#define DEFINE_FILL_TILES(fmt, pixel_t, pack) \
+static void fill_tiles_##fmt(void *mem_base, \
+			     unsigned int width, unsigned int height, \
+			     unsigned int stride, unsigned int frame) \
+{ \
+	unsigned int x, y, end; \
+	\
+	for (y = 0; y < height; ++y) { \
+		pixel_t *row = mem_base; \
+		unsigned int quot0 = (y + frame * 8) / width; \
+		unsigned int rem0 = (y + frame * 8) % width; \
+		unsigned int alpha_end = y < height / 2 ? width / 2 : 0; \
+		\
+		for (x = 0; x < width; x = end) { \
+			unsigned int wrap = rem0 + x >= width; \
+			unsigned int quot = quot0 + wrap; \
+			unsigned int rem = rem0 + x - (wrap ? width : 0); \
+			uint32_t rgb32 = 0x00130502 * (quot >> 6) \
+				       + 0x000a1120 * (rem >> 6); \
+			pixel_t color = pack((rgb32 >> 16) & 0xff, \
+					     (rgb32 >> 8) & 0xff, rgb32 & 0xff, \
+					     x < alpha_end ? 127u : 255u); \
+			\
+			/* Run ends at next color step, wrap or alpha split */ \
+			end = x + 64 - (rem & 63); \
+			if (!wrap && end > width - rem0) \
+				end = width - rem0; \
+			if (x < alpha_end && end > alpha_end) \
+				end = alpha_end; \
+			if (end > width) \
+				end = width; \
+			\
+			for (; x < end; x++) \
+				row[x] = color; \
+		} \
+		mem_base += stride; \
+	} \
+}
+
+/* Plain pattern, every byte 0x77 */
+#define DEFINE_FILL_PLAIN(fmt, pixel_t) \
+static void fill_plain_##fmt(void *mem_base, \
+			     unsigned int width, unsigned int height, \
+			     unsigned int stride, unsigned int frame) \
+{ \
+	unsigned int y; \
+	\
+	for (y = 0; y < height; ++y) { \
+		memset(mem_base, 0x77, width * sizeof(pixel_t)); \
+		mem_base += stride; \
+	} \
+}
+
+#define X(fmt, bpp, pixel_t, pack) \
+	DEFINE_FILL_TILES(fmt, pixel_t, pack) \
+	DEFINE_FILL_PLAIN(fmt, pixel_t)
+FILL_FORMATS(X)
+#undef X
+
+#define X(fmt, bpp, pixel_t, pack) \
+	{ DRM_FORMAT_##fmt, KMS_FILL_TILES, bpp, #fmt " tiles", fill_tiles_##fmt }, \
+	{ DRM_FORMAT_##fmt, KMS_FILL_PLAIN, bpp, #fmt " plain", fill_plain_##fmt },
+const struct kms_fill_kernel kms_fill_kernels[] = {
+	FILL_FORMATS(X)
+};
+#undef X
+
+const unsigned int kms_n_fill_kernels =
+	sizeof(kms_fill_kernels) / sizeof(kms_fill_kernels[0]);
+
+/* Return kernel for a format and pattern, NULL if there is none */
+const struct kms_fill_kernel *
+kms_get_fill_kernel(uint32_t format, int pattern)
+{
+	int i;
+
+	for (i = 0; i < kms_n_fill_kernels; i++) {
+		if (kms_fill_kernels[i].format == format &&
+			kms_fill_kernels[i].pattern == pattern)
+			return &kms_fill_kernels[i];
+	}
+
+	return NULL;
+}
+
+
+int kms_get_dumb_buffer(int fd, struct kms_buffer *buffer)
+{
+	struct drm_mode_create_dumb *dumb_buf = &buffer->dumb_buf;
+	struct drm_mode_map_dumb *map_dumb_buf = &buffer->map_dumb_buf;
+	int pattern;
+
+	if (!buffer->format)
+		buffer->format = DRM_FORMAT_XRGB8888;
+
+	/* Fill kernels are looked up once, not per frame */
+	for (pattern = KMS_FILL_TILES; pattern <= KMS_FILL_PLAIN; pattern++)
+		buffer->fill[pattern] = kms_get_fill_kernel(buffer->format,
+			pattern);
+
+	/* Create dumb buffer */
+	memset(dumb_buf, 0, sizeof(struct drm_mode_create_dumb));
+	dumb_buf->bpp = buffer->fill[KMS_FILL_PLAIN] ?
+		buffer->fill[KMS_FILL_PLAIN]->bpp : 32;
+	dumb_buf->width = buffer->hsize;
+	dumb_buf->height =  buffer->vsize;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, dumb_buf))
+		return -1;
+
+	/* map dumb buffer */
+	memset(map_dumb_buf, 0, sizeof(struct drm_mode_map_dumb));
+	map_dumb_buf->handle = dumb_buf->handle;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, map_dumb_buf))
+		return -1;
+	buffer->buf_ptr = drm_mmap(0, dumb_buf->size,
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, map_dumb_buf->offset);
+	if (buffer->buf_ptr == MAP_FAILED) {
+		buffer->buf_ptr = NULL;
+		return -1;
+	}
+
+	/* Without a shadow, drawing goes straight to the mapping */
+	buffer->shadow = NULL;
+	buffer->damage_y1 = dumb_buf->height;
+	buffer->damage_y2 = 0;
+	if (buffer->flags & KMS_BUFFER_SHADOW_ALWAYS ||
+		(buffer->flags & KMS_BUFFER_SHADOW &&
+		kms_mapping_is_wc(buffer)))
+		buffer->shadow = kms_alloc_huge((size_t)dumb_buf->pitch *
+			dumb_buf->height, &buffer->shadow_pages);
+
+	return 0;
+}
+
+int kms_add_buffer(int fd, struct kms_buffer *buffer, uint16_t hsize,
+	uint16_t vsize, uint32_t format)
+{
+	uint32_t bo_handles[4] = {0, 0, 0, 0};
+	uint32_t pitches[4] = {0, 0, 0, 0};
+	uint32_t offsets[4] = {0, 0, 0, 0};
+
+	buffer->hsize = hsize;
+	buffer->vsize = vsize;
+	buffer->format = format;
+	if (kms_get_dumb_buffer(fd, buffer))
+		return -1;
+
+	bo_handles[0] = buffer->dumb_buf.handle;
+	pitches[0] = buffer->dumb_buf.pitch;
+	offsets[0] = 0;
+	return drmModeAddFB2(fd, buffer->dumb_buf.width,
+		buffer->dumb_buf.height, buffer->format, bo_handles, pitches,
+		offsets, &buffer->buf_id, 0);
+}
+
+/* Release a frame buffer acquired through kms_add_buffer() */
+void kms_put_buffer(int fd, struct kms_buffer *buffer)
+{
+	struct drm_mode_destroy_dumb destroy_dumb_buf;
+
+	if (buffer->buf_id)
+		drmModeRmFB(fd, buffer->buf_id);
+	if (buffer->buf_ptr)
+		drm_munmap(buffer->buf_ptr, buffer->dumb_buf.size);
+	kms_free_huge(buffer->shadow, (size_t)buffer->dumb_buf.pitch *
+		buffer->dumb_buf.height);
+
+	memset(&destroy_dumb_buf, 0, sizeof(struct drm_mode_destroy_dumb));
+	destroy_dumb_buf.handle = buffer->dumb_buf.handle;
+	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_dumb_buf);
+
+	buffer->buf_id = 0;
+	buffer->buf_ptr = NULL;
+	buffer->shadow = NULL;
+}
+
+int kms_import_buffer(struct kms_device *dst, struct kms_buffer *dst_buf,
+	struct kms_device *src, struct kms_buffer *src_buf)
+{
+	struct drm_mode_destroy_dumb destroy_dumb_buf;
+	uint32_t bo_handles[4] = {0, 0, 0, 0};
+	uint32_t pitches[4] = {0, 0, 0, 0};
+	uint32_t offsets[4] = {0, 0, 0, 0};
+	uint64_t cap = 0;
+	uint32_t handle;
+	int prime_fd;
+	int ret;
+
+	if (drmGetCap(src->fd, DRM_CAP_PRIME, &cap) ||
+		!(cap & DRM_PRIME_CAP_EXPORT))
+		return -1;
+	if (drmGetCap(dst->fd, DRM_CAP_PRIME, &cap) ||
+		!(cap & DRM_PRIME_CAP_IMPORT))
+		return -1;
+
+	/* Pass buffer from src to dst as dma-buf fd */
+	if (drmPrimeHandleToFD(src->fd, src_buf->dumb_buf.handle, DRM_CLOEXEC,
+		&prime_fd))
+		return -1;
+	ret = drmPrimeFDToHandle(dst->fd, prime_fd, &handle);
+	close(prime_fd);
+	if (ret)
+		return -1;
+
+	*dst_buf = *src_buf;
+	dst_buf->dumb_buf.handle = handle;
+	memset(&dst_buf->map_dumb_buf, 0, sizeof(struct drm_mode_map_dumb));
+	dst_buf->buf_ptr = NULL;
+	dst_buf->buf_id = 0;
+
+	/* The shadow stays src_buf's, drawing goes through src_buf */
+	dst_buf->flags &= ~(KMS_BUFFER_SHADOW | KMS_BUFFER_SHADOW_ALWAYS);
+	dst_buf->shadow = NULL;
+	dst_buf->damage_y1 = dst_buf->dumb_buf.height;
+	dst_buf->damage_y2 = 0;
+
+	bo_handles[0] = handle;
+	pitches[0] = dst_buf->dumb_buf.pitch;
+	offsets[0] = 0;
+	if (drmModeAddFB2(dst->fd, dst_buf->dumb_buf.width,
+		dst_buf->dumb_buf.height, dst_buf->format, bo_handles, pitches,
+		offsets, &dst_buf->buf_id, 0)) {
+		/* Imported handle is released like a dumb buffer handle */
+		memset(&destroy_dumb_buf, 0, sizeof(struct drm_mode_destroy_dumb));
+		destroy_dumb_buf.handle = handle;
+		drmIoctl(dst->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_dumb_buf);
+		return -1;
+	}
+
+	return 0;
+}
+
+void kms_fill_frame(struct kms_buffer *buffer, int pattern,
+	unsigned int frame)
+{
+	const struct kms_fill_kernel *kernel;
+
+	if (pattern < KMS_FILL_TILES || pattern > KMS_FILL_PLAIN)
+		return;
+	kernel = buffer->fill[pattern];
+	if (!kernel)
+		return;
+
+	KMS_TRACE(fill_start, 0, buffer->buf_id, frame);
+	kernel->fill(kms_buffer_draw_ptr(buffer), buffer->dumb_buf.width,
+		buffer->dumb_buf.height, buffer->dumb_buf.pitch, frame);
+	kms_buffer_damage(buffer, 0, buffer->dumb_buf.height);
+	kms_buffer_flush(buffer);
+	KMS_TRACE(fill_end, 0, buffer->buf_id, frame);
+}
+
+void kms_fill_buffer(struct kms_buffer *buffer, int pattern)
+{
+	kms_fill_frame(buffer, pattern, 0);
+}
+
+/* Keeps reads in read_time_ms() from being optimized away */
+static volatile uint64_t read_sink;
+
+/* Return time in ms to read size bytes of mem */
+static double read_time_ms(const void *mem, size_t size)
+{
+	const uint64_t *p = mem;
+	uint64_t sum = 0;
+	double start = kms_now_ns() / 1e6;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(uint64_t); i++)
+		sum += p[i];
+	read_sink = sum;
+
+	return kms_now_ns() / 1e6 - start;
+}
+
+/*
+ * Return 1 if mapping of buffer is write-combined or uncached, i.e.
+ * reads from it are much slower than reads from cached memory.
+ */
+int kms_mapping_is_wc(struct kms_buffer *buffer)
+{
+	size_t size = (size_t)buffer->dumb_buf.pitch * buffer->dumb_buf.height;
+	double cached_ms, mapped_ms;
+	void *mem;
+
+	if (size > KMS_WC_PROBE_SIZE)
+		size = KMS_WC_PROBE_SIZE;
+	mem = calloc(1, size);
+	if (!mem || !buffer->buf_ptr) {
+		free(mem);
+		return 0;
+	}
+
+	/* Warm up both, then compare */
+	read_time_ms(mem, size);
+	read_time_ms(buffer->buf_ptr, size);
+	cached_ms = read_time_ms(mem, size);
+	mapped_ms = read_time_ms(buffer->buf_ptr, size);
+	free(mem);
+
+	return mapped_ms > 4 * cached_ms;
+}
+
+void *kms_buffer_draw_ptr(struct kms_buffer *buffer)
+{
+	return buffer->shadow ? buffer->shadow : buffer->buf_ptr;
+}
+
+void kms_buffer_damage(struct kms_buffer *buffer, unsigned int y,
+	unsigned int height)
+{
+	if (y < buffer->damage_y1)
+		buffer->damage_y1 = y;
+	if (y + height > buffer->damage_y2)
+		buffer->damage_y2 = y + height;
+}
+
+void kms_buffer_flush(struct kms_buffer *buffer)
+{
+	unsigned int y1 = buffer->damage_y1;
+	unsigned int y2 = buffer->damage_y2;
+	size_t offset = (size_t)y1 * buffer->dumb_buf.pitch;
+
+	buffer->damage_y1 = buffer->dumb_buf.height;
+	buffer->damage_y2 = 0;
+	if (!buffer->shadow || y1 >= y2)
+		return;
+
+	kms_stream_copy_rows((uint8_t *)buffer->buf_ptr + offset,
+		buffer->dumb_buf.pitch, (uint8_t *)buffer->shadow + offset,
+		buffer->dumb_buf.pitch,
+		buffer->dumb_buf.width * buffer->dumb_buf.bpp / 8, y2 - y1);
+}
+
+/*
+ * Whole cache lines are written with non-temporal stores so that
+ * write-combining buffers are flushed as full bursts and the destination
+ * doesn't pollute the cache.
+ */
+void kms_stream_copy_rows(void *dst, unsigned int dst_stride,
+	const void *src, unsigned int src_stride, unsigned int row_bytes,
+	unsigned int rows)
+{
+	unsigned int y;
+
+	for (y = 0; y < rows; y++) {
+		uint8_t *d = (uint8_t *)dst + (size_t)y * dst_stride;
+		const uint8_t *s = (const uint8_t *)src + (size_t)y * src_stride;
+		unsigned int n = row_bytes;
+
+#if defined(__SSE2__)
+		if (!((uintptr_t)d & 15) && !((uintptr_t)s & 15)) {
+			for (; n >= KMS_CACHE_LINE; n -= KMS_CACHE_LINE) {
+				__m128i a = _mm_load_si128((const __m128i *)s);
+				__m128i b = _mm_load_si128((const __m128i *)(s + 16));
+				__m128i c = _mm_load_si128((const __m128i *)(s + 32));
+				__m128i e = _mm_load_si128((const __m128i *)(s + 48));
+
+				_mm_stream_si128((__m128i *)d, a);
+				_mm_stream_si128((__m128i *)(d + 16), b);
+				_mm_stream_si128((__m128i *)(d + 32), c);
+				_mm_stream_si128((__m128i *)(d + 48), e);
+				d += KMS_CACHE_LINE;
+				s += KMS_CACHE_LINE;
+			}
+		}
+#endif
+		memcpy(d, s, n);
+	}
+
+#if defined(__SSE2__)
+	_mm_sfence();
+#endif
+}
+
+int kms_pool_init(int fd, struct kms_buffer_pool *pool, int count,
+	uint16_t hsize, uint16_t vsize, uint32_t format)
+{
+	int i;
+
+	if (count > 32)
+		return -1;
+
+	pool->buffer = calloc(count, sizeof(struct kms_buffer));
+	pool->count = count;
+	pool->busy = 0;
+	if (!pool->buffer)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		if (kms_add_buffer(fd, &pool->buffer[i], hsize, vsize,
+			format)) {
+			pool->count = i + 1;
+			kms_pool_fini(fd, pool);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void kms_pool_fini(int fd, struct kms_buffer_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->count; i++) {
+		if (pool->buffer[i].buf_ptr)
+			kms_put_buffer(fd, &pool->buffer[i]);
+	}
+	free(pool->buffer);
+	pool->buffer = NULL;
+	pool->count = 0;
+}
+
+/* Return a free buffer and mark it busy, NULL if all are busy */
+struct kms_buffer *kms_pool_acquire(struct kms_buffer_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->count; i++) {
+		if (!(pool->busy & (1u << i))) {
+			pool->busy |= 1u << i;
+			return &pool->buffer[i];
+		}
+	}
+
+	return NULL;
+}
+
+void kms_pool_release(struct kms_buffer_pool *pool, struct kms_buffer *buffer)
+{
+	pool->busy &= ~(1u << (buffer - pool->buffer));
+}
+
+void kms_prefault(void *mem, size_t size)
+{
+	volatile uint8_t *ptr = mem;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	if (!madvise(mem, size, MADV_POPULATE_WRITE))
+		return;
+
+	/*
+	 * Older kernel, or a pfn mapping populate doesn't handle: write
+	 * each page back as is, content of a mapped buffer is kept.
+	 */
+	for (i = 0; i < size; i += page)
+		ptr[i] = ptr[i];
+}
+
+long kms_fault_count(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_THREAD, &usage))
+		return 0;
+
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
+static void *warmup_thread(void *arg)
+{
+	struct kms_warmup *warmup = arg;
+	long faults = kms_fault_count();
+	double start = kms_now_ns() / 1e6;
+	int i;
+
+	for (i = 0; i < warmup->count; i++) {
+		struct kms_buffer *buffer = &warmup->buffer[i];
+
+		if (!buffer->buf_ptr)
+			continue;
+		kms_prefault(buffer->buf_ptr, buffer->dumb_buf.size);
+		warmup->bytes += buffer->dumb_buf.size;
+	}
+
+	warmup->ms = kms_now_ns() / 1e6 - start;
+	warmup->faults = kms_fault_count() - faults;
+
+	return NULL;
+}
+
+void kms_warmup_start(struct kms_warmup *warmup, struct kms_buffer *buffer,
+	int count)
+{
+	memset(warmup, 0, sizeof(struct kms_warmup));
+	warmup->buffer = buffer;
+	warmup->count = count;
+
+	/* Without a thread, warm up before returning */
+	if (pthread_create(&warmup->thread, NULL, warmup_thread, warmup))
+		warmup_thread(warmup);
+	else
+		warmup->running = 1;
+}
+
+void kms_warmup_wait(struct kms_warmup *warmup)
+{
+	if (warmup->running)
+		pthread_join(warmup->thread, NULL);
+	warmup->running = 0;
+}
+
+void *kms_alloc_huge(size_t size, enum kms_page_type *type)
+{
+	size_t len = (size + KMS_HUGE_PAGE_SIZE - 1) &
+		~(size_t)(KMS_HUGE_PAGE_SIZE - 1);
+	uint8_t *mem, *aligned;
+
+	/* Reserved hugetlb pages, populated by mmap itself */
+	mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if (mem != MAP_FAILED) {
+		*type = KMS_PAGES_EXPLICIT;
+		return mem;
+	}
+
+	/* Else over-allocate and trim, so THP can back every 2 MiB */
+	mem = mmap(NULL, len + KMS_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	aligned = (uint8_t *)(((uintptr_t)mem + KMS_HUGE_PAGE_SIZE - 1) &
+		~(uintptr_t)(KMS_HUGE_PAGE_SIZE - 1));
+	if (aligned > mem)
+		munmap(mem, aligned - mem);
+	munmap(aligned + len, mem + KMS_HUGE_PAGE_SIZE - aligned);
+
+	*type = madvise(aligned, len, MADV_HUGEPAGE) ?
+		KMS_PAGES_BASE : KMS_PAGES_TRANSPARENT;
+	kms_prefault(aligned, len);
+
+	return aligned;
+}
+
+void kms_free_huge(void *mem, size_t size)
+{
+	size_t len = (size + KMS_HUGE_PAGE_SIZE - 1) &
+		~(size_t)(KMS_HUGE_PAGE_SIZE - 1);
+
+	if (mem)
+		munmap(mem, len);
+}
+
+int kms_open(struct kms_device *dev, const char *name, unsigned int flags)
+{
+	int fd;
+
+	/* A path selects the device node, else the driver name does */
+	if (name[0] == '/')
+		fd = open(name, O_RDWR | O_CLOEXEC);
+	else
+		fd = drmOpen(name, NULL);
+	if (fd < 0) {
+		printf("failed to open %s\n", name);
+		return -1;
+	}
+
+	return kms_open_fd(dev, fd, flags);
+}
+
+int kms_open_fd(struct kms_device *dev, int fd, unsigned int flags)
+{
+	uint64_t cap = 0;
+
+	memset(dev, 0, sizeof(struct kms_device));
+	dev->fd = fd;
+
+	/* Check drm driver dumb buffer capability */
+	if (drmGetCap(dev->fd, DRM_CAP_DUMB_BUFFER, &cap) || !cap) {
+		printf("drm driver doesn't support dumb buffer\n");
+		goto err;
+	}
+
+	/*
+	 * Inform drm drivers that drm client supports atomic commit.
+	 * Thereby, drm drivers would expose atomic properties.
+	 */
+	if (flags & (KMS_OPEN_ATOMIC | KMS_OPEN_TRY_ATOMIC))
+		dev->atomic = !drmSetClientCap(dev->fd, DRM_CLIENT_CAP_ATOMIC, 1);
+	if ((flags & KMS_OPEN_ATOMIC) && !dev->atomic) {
+		printf("drm driver doesn't support atomic commit\n");
+		goto err;
+	}
+
+	if (kms_rediscover(dev))
+		goto err;
+
+	/* trace_marker writes, if asked for in the environment */
+	kms_trace_init();
+
+	return 0;
+
+err:
+	kms_close(dev);
+	return -1;
+}
+
+int kms_rediscover(struct kms_device *dev)
+{
+	/* Release all discovered metadata at once */
+	kms_arena_release(&dev->arena);
+	dev->legacy.enabled = 0;
+
+	/* Discover crtc, encoder, connector and plane resources */
+	dev->res_ptr = kms_get_resources(dev->fd, &dev->arena);
+	if (!dev->res_ptr) {
+		printf("drm driver has no mode setting resources\n");
+		return -1;
+	}
+	dev->plane_res_ptr = kms_get_plane_resources(dev->fd, &dev->arena);
+
+	/* Discover crtc, encoder, connector and plane properties */
+	dev->prop_ptr = kms_get_properties(dev->fd, &dev->arena,
+		dev->res_ptr, dev->plane_res_ptr);
+
+	return 0;
+}
+
+void kms_close(struct kms_device *dev)
+{
+	kms_blob_release_all(dev->fd, &dev->blobs);
+
+	/* Release all discovered metadata at once */
+	kms_arena_release(&dev->arena);
+
+	if (dev->fd >= 0)
+		drmClose(dev->fd);
+	dev->fd = -1;
+}
+
+int kms_open_devices(struct kms_device *dev, int max_devs, unsigned int flags,
+	int min_planes)
+{
+	drmDevicePtr devices[KMS_MAX_DEVICES];
+	drmModePlaneResPtr plane_res_ptr;
+	int n, i;
+	int n_devs = 0;
+
+#ifdef HAVE_DRM_GET_DEVICES2
+	n = drmGetDevices2(0, devices, KMS_MAX_DEVICES);
+#else
+	n = drmGetDevices(devices, KMS_MAX_DEVICES);
+#endif
+	if (n < 0)
+		return 0;
+
+	for (i = 0; i < n && n_devs < max_devs; i++) {
+		if (!(devices[i]->available_nodes & (1 << DRM_NODE_PRIMARY)))
+			continue;
+
+		if (kms_open(&dev[n_devs], devices[i]->nodes[DRM_NODE_PRIMARY],
+			flags))
+			continue;
+
+		plane_res_ptr = dev[n_devs].plane_res_ptr;
+		if ((plane_res_ptr ? (int)plane_res_ptr->count_planes : 0) <
+			min_planes) {
+			printf("%s has fewer than %d planes\n",
+				devices[i]->nodes[DRM_NODE_PRIMARY], min_planes);
+			kms_close(&dev[n_devs]);
+			continue;
+		}
+
+		n_devs++;
+	}
+	drmFreeDevices(devices, n);
+
+	return n_devs;
+}
+
+int kms_get_output(struct kms_device *dev, struct kms_output *output,
+	int need_plane)
+{
+	memset(output, 0, sizeof(struct kms_output));
+
+	/* Find a connector */
+	output->con = kms_get_connector(dev->fd, &dev->arena,
+		dev->res_ptr->connectors, dev->res_ptr->count_connectors);
+	if (!output->con) {
+		printf("no connector with valid mode found\n");
+		return -1;
+	}
+
+	/* Find a valid encoder */
+	output->enc = kms_get_encoder(dev->fd, &dev->arena, output->con);
+	if (!output->enc) {
+		printf("no encoder available for selected connector\n");
+		return -1;
+	}
+
+	/* Find a valid crtc */
+	output->crtc = kms_get_crtc(dev->fd, &dev->arena, dev->res_ptr,
+		output->enc);
+	if (!output->crtc) {
+		printf("no crtc available for selected encoder\n");
+		return -1;
+	}
+
+	if (!need_plane)
+		return 0;
+
+	/* Find a valid plane */
+	if (dev->plane_res_ptr)
+		output->plane = kms_get_plane(dev->fd, &dev->arena,
+			dev->plane_res_ptr, dev->res_ptr, output->crtc);
+	if (!output->plane) {
+		printf("no plane available for selected crtc\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+uint32_t kms_get_rotations(struct kms_device *dev, uint32_t plane_id)
+{
+	drmModePropertyPtr prop_ptr;
+	uint32_t prop_id;
+	uint32_t rotations = 0;
+	int i;
+
+	prop_id = kms_get_prop_id(dev->prop_ptr, DRM_MODE_OBJECT_PLANE,
+		plane_id, "rotation");
+	if (!prop_id)
+		return 0;
+
+	prop_ptr = drmModeGetProperty(dev->fd, prop_id);
+	if (!prop_ptr)
+		return 0;
+
+	/* Values of a bitmask property are bit numbers */
+	for (i = 0; i < prop_ptr->count_enums; i++) {
+		if (prop_ptr->enums[i].value < 32)
+			rotations |= 1u << prop_ptr->enums[i].value;
+	}
+	drmModeFreeProperty(prop_ptr);
+
+	return rotations;
+}
+
+int kms_add_property(struct kms_device *dev, drmModeAtomicReqPtr req,
+	uint32_t obj_type, uint32_t obj_id, const char *prop_name,
+	uint64_t value)
+{
+	uint32_t prop_id = kms_get_prop_id(dev->prop_ptr, obj_type, obj_id,
+		prop_name);
+
+	if (!prop_id)
+		return -1;
+
+	return drmModeAtomicAddProperty(req, obj_id, prop_id, value) < 0 ?
+		-1 : 0;
+}
+
+int kms_add_plane(struct kms_device *dev, drmModeAtomicReqPtr req,
+	uint32_t plane_id, uint32_t crtc_id, uint32_t fb_id,
+	int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h,
+	uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+	int ret = 0;
+
+	/* Add plane property
+	 * src:x,y,w,h
+	 * dst:x,y,w,h
+	 * crtc_id
+	 * fb_id
+	 */
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_PLANE, plane_id,
+		"SRC_X", src_x);
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_PLANE, plane_id,
+		"SRC_Y", src_y);
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_PLANE, plane_id,
+		"SRC_W", src_w);
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_PLANE, plane_id,
+		"SRC_H", src_h);
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_PLANE, plane_id,
+		"CRTC_X", crtc_x);
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_PLANE, plane_id,
+		"CRTC_Y", crtc_y);
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_PLANE, plane_id,
+		"CRTC_W", crtc_w);
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_PLANE, plane_id,
+		"CRTC_H", crtc_h);
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_PLANE, plane_id,
+		"CRTC_ID", crtc_id);
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_PLANE, plane_id,
+		"FB_ID", fb_id);
+
+	return ret;
+}
+
+int kms_add_modeset(struct kms_device *dev, drmModeAtomicReqPtr req,
+	struct kms_output *output, struct kms_buffer *buffer,
+	uint32_t mode_blob_id)
+{
+	drmModeModeInfoPtr mode = &output->con->modes[0];
+	uint32_t crtc_id = output->crtc->crtc_id;
+	int ret;
+
+	ret = kms_add_plane(dev, req, output->plane->plane_id, crtc_id,
+		buffer->buf_id, 0, 0, mode->hdisplay, mode->vdisplay,
+		0 << 16, 0 << 16, buffer->dumb_buf.width << 16,
+		buffer->dumb_buf.height << 16);
+
+	/* Add crtc property
+	 * mode
+	 * active
+	 */
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_CRTC, crtc_id,
+		"MODE_ID", mode_blob_id);
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_CRTC, crtc_id,
+		"ACTIVE", 1);
+
+	/* Add connector property
+	 * crtc_id
+	 */
+	ret |= kms_add_property(dev, req, DRM_MODE_OBJECT_CONNECTOR,
+		output->con->connector_id, "CRTC_ID", crtc_id);
+
+	return ret;
+}
+
+/* Atomic toggles crtc ACTIVE, legacy toggles connector DPMS */
+int kms_set_power(struct kms_device *dev, struct kms_output *output, int on,
+	void *user_data)
+{
+	uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	drmModeAtomicReqPtr req;
+	uint32_t prop_id;
+	int ret;
+
+	if (!dev->atomic) {
+		prop_id = kms_get_prop_id(dev->prop_ptr,
+			DRM_MODE_OBJECT_CONNECTOR, output->con->connector_id,
+			"DPMS");
+		if (!prop_id)
+			return -1;
+
+		return drmModeConnectorSetProperty(dev->fd,
+			output->con->connector_id, prop_id,
+			on ? DRM_MODE_DPMS_ON : DRM_MODE_DPMS_OFF);
+	}
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	/* ACTIVE changes need ALLOW_MODESET, but nothing else is touched */
+	ret = kms_add_property(dev, req, DRM_MODE_OBJECT_CRTC,
+		output->crtc->crtc_id, "ACTIVE", on);
+	if (!ret) {
+		if (on && user_data)
+			flags |= DRM_MODE_PAGE_FLIP_EVENT;
+		ret = drmModeAtomicCommit(dev->fd, req, flags, user_data);
+	}
+	drmModeAtomicFree(req);
+
+	return ret;
+}
+
+/*
+ * Enable legacy call translation if driver supports atomic commit.
+ * Must be called after properties have been discovered.
+ */
+void kms_legacy_init(struct kms_device *dev, drmModeAtomicReqPtr req)
+{
+	struct kms_legacy *legacy = &dev->legacy;
+	drmModeResPtr res_ptr = dev->res_ptr;
+	drmModePlaneResPtr plane_res_ptr = dev->plane_res_ptr;
+	struct {
+		uint32_t plane_id;
+		uint32_t possible_crtcs;
+		uint32_t crtc_id;	/* crtc plane is currently on */
+		int taken;
+	} *primary;
+	int n_primaries = 0;
+	int i, c, pass;
+
+	if (!dev->atomic || !req || !plane_res_ptr)
+		return;
+
+	/* Map each crtc to the primary plane a legacy call would update */
+	legacy->primary_plane = kms_arena_alloc(&dev->arena,
+		res_ptr->count_crtcs * sizeof(uint32_t));
+	legacy->mode_blob = kms_arena_alloc(&dev->arena,
+		res_ptr->count_crtcs * sizeof(uint32_t));
+	legacy->new_mode_blob = kms_arena_alloc(&dev->arena,
+		res_ptr->count_crtcs * sizeof(uint32_t));
+	legacy->mode_changed = kms_arena_alloc(&dev->arena,
+		res_ptr->count_crtcs);
+	legacy->fb_id = kms_arena_alloc(&dev->arena,
+		res_ptr->count_crtcs * sizeof(uint32_t));
+
+	primary = calloc(plane_res_ptr->count_planes, sizeof(*primary));
+	if (!primary)
+		return;
+
+	for (i = 0; i < plane_res_ptr->count_planes; i++) {
+		uint32_t plane_id = plane_res_ptr->planes[i];
+		drmModePlanePtr plane_ptr;
+
+		if (kms_get_prop_value(dev->prop_ptr, DRM_MODE_OBJECT_PLANE,
+			plane_id, "type", DRM_PLANE_TYPE_OVERLAY) !=
+			DRM_PLANE_TYPE_PRIMARY)
+			continue;
+
+		plane_ptr = drmModeGetPlane(dev->fd, plane_id);
+		if (!plane_ptr)
+			continue;
+
+		primary[n_primaries].plane_id = plane_id;
+		primary[n_primaries].possible_crtcs = plane_ptr->possible_crtcs;
+		primary[n_primaries].crtc_id = kms_get_prop_value(dev->prop_ptr,
+			DRM_MODE_OBJECT_PLANE, plane_id, "CRTC_ID", 0);
+		n_primaries++;
+		drmModeFreePlane(plane_ptr);
+	}
+
+	/*
+	 * Primary planes may feed several crtcs. Give each crtc a plane of
+	 * its own: the one already on it, else one that can feed this crtc
+	 * only, else the one that can feed the fewest other crtcs.
+	 */
+	for (pass = 0; pass < 3; pass++) {
+		for (c = 0; c < res_ptr->count_crtcs; c++) {
+			uint32_t crtc_bit = 1u << c;
+			int best = -1;
+
+			if (legacy->primary_plane[c])
+				continue;
+
+			for (i = 0; i < n_primaries; i++) {
+				uint32_t mask = primary[i].possible_crtcs;
+
+				if (primary[i].taken || !(mask & crtc_bit))
+					continue;
+				if (pass == 0 &&
+					primary[i].crtc_id != res_ptr->crtcs[c])
+					continue;
+				if (pass == 1 && mask != crtc_bit)
+					continue;
+				if (best < 0 || __builtin_popcount(mask) <
+					__builtin_popcount(
+					primary[best].possible_crtcs))
+					best = i;
+			}
+
+			if (best >= 0) {
+				legacy->primary_plane[c] =
+					primary[best].plane_id;
+				primary[best].taken = 1;
+			}
+		}
+	}
+	free(primary);
+
+	legacy->req = req;
+	legacy->enabled = 1;
+}
+
+static int legacy_crtc_index(struct kms_device *dev, uint32_t crtc_id)
+{
+	int i;
+
+	for (i = 0; i < dev->res_ptr->count_crtcs; i++) {
+		if (dev->res_ptr->crtcs[i] == crtc_id)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+legacy_add_property(struct kms_device *dev, uint32_t obj_id,
+	const char *prop_name, uint64_t value)
+{
+	drmModeAtomicAddProperty(dev->legacy.req, obj_id,
+		kms_get_prop_id(dev->prop_ptr, DRM_MODE_OBJECT_ANY, obj_id,
+		prop_name), value);
+	dev->legacy.n_updates++;
+}
+
+/*
+ * Same as drmModeSetCrtc(), but takes effect on next kms_legacy_commit().
+ * A NULL mode or 0 fb disables the crtc.
+ */
+int kms_legacy_set_crtc(struct kms_device *dev, uint32_t crtc_id,
+	uint32_t fb_id, uint32_t x, uint32_t y, uint32_t *connectors,
+	int count, drmModeModeInfoPtr mode)
+{
+	struct kms_legacy *legacy = &dev->legacy;
+	uint32_t plane_id;
+	uint32_t mode_blob_id = 0;
+	int active = mode && fb_id;
+	int crtc_idx;
+	int i;
+
+	if (!legacy->enabled)
+		return drmModeSetCrtc(dev->fd, crtc_id, fb_id, x, y,
+			connectors, count, mode);
+
+	crtc_idx = legacy_crtc_index(dev, crtc_id);
+	plane_id = crtc_idx < 0 ? 0 : legacy->primary_plane[crtc_idx];
+	if (!plane_id)
+		return -1;
+
+	if (active) {
+		mode_blob_id = kms_blob_get(dev->fd, &dev->blobs, mode,
+			sizeof(drmModeModeInfo));
+		if (!mode_blob_id)
+			return -1;
+	}
+
+	/* Mode set earlier in this frame is superseded */
+	if (legacy->mode_changed[crtc_idx])
+		kms_blob_put(&dev->blobs, legacy->new_mode_blob[crtc_idx]);
+	legacy->new_mode_blob[crtc_idx] = mode_blob_id;
+	legacy->mode_changed[crtc_idx] = 1;
+	legacy->fb_id[crtc_idx] = active ? fb_id : 0;
+
+	/* Primary plane shows fb from (x, y) at mode size, unscaled */
+	legacy_add_property(dev, plane_id, "FB_ID", active ? fb_id : 0);
+	legacy_add_property(dev, plane_id, "CRTC_ID", active ? crtc_id : 0);
+	if (active) {
+		legacy_add_property(dev, plane_id, "SRC_X", x << 16);
+		legacy_add_property(dev, plane_id, "SRC_Y", y << 16);
+		legacy_add_property(dev, plane_id, "SRC_W",
+			mode->hdisplay << 16);
+		legacy_add_property(dev, plane_id, "SRC_H",
+			mode->vdisplay << 16);
+		legacy_add_property(dev, plane_id, "CRTC_X", 0);
+		legacy_add_property(dev, plane_id, "CRTC_Y", 0);
+		legacy_add_property(dev, plane_id, "CRTC_W", mode->hdisplay);
+		legacy_add_property(dev, plane_id, "CRTC_H", mode->vdisplay);
+	}
+
+	legacy_add_property(dev, crtc_id, "MODE_ID", mode_blob_id);
+	legacy_add_property(dev, crtc_id, "ACTIVE", active);
+
+	for (i = 0; i < count; i++)
+		legacy_add_property(dev, connectors[i], "CRTC_ID",
+			active ? crtc_id : 0);
+
+	legacy->flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+	return 0;
+}
+
+/*
+ * Same as drmModePageFlip(), but takes effect on next kms_legacy_commit().
+ * All flips of a frame complete with one event per crtc, carrying the
+ * user_data of the last flip which requested an event.
+ * DRM_MODE_PAGE_FLIP_ASYNC isn't translated.
+ */
+int kms_legacy_page_flip(struct kms_device *dev, uint32_t crtc_id,
+	uint32_t fb_id, uint32_t flags, void *user_data)
+{
+	struct kms_legacy *legacy = &dev->legacy;
+	uint32_t plane_id;
+	unsigned int sequence;
+	int crtc_idx;
+	int ret;
+
+	if (!legacy->enabled) {
+		/* Worker threads may flip their crtcs on a shared device */
+		sequence = __atomic_add_fetch(&legacy->sequence, 1,
+			__ATOMIC_RELAXED);
+		KMS_TRACE(commit_submit, crtc_id, fb_id, sequence);
+		ret = drmModePageFlip(dev->fd, crtc_id, fb_id, flags,
+			user_data);
+		KMS_TRACE(commit_return, crtc_id, fb_id, sequence);
+		return ret;
+	}
+
+	crtc_idx = legacy_crtc_index(dev, crtc_id);
+	plane_id = crtc_idx < 0 ? 0 : legacy->primary_plane[crtc_idx];
+	if (!plane_id)
+		return -1;
+
+	legacy_add_property(dev, plane_id, "FB_ID", fb_id);
+	legacy->fb_id[crtc_idx] = fb_id;
+
+	legacy->flags |= DRM_MODE_ATOMIC_NONBLOCK;
+	if (flags & DRM_MODE_PAGE_FLIP_EVENT) {
+		legacy->flags |= DRM_MODE_PAGE_FLIP_EVENT;
+		legacy->user_data = user_data;
+	}
+
+	return 0;
+}
+
+/* Submit all updates of this frame with a single atomic commit */
+int kms_legacy_commit(struct kms_device *dev)
+{
+	struct kms_legacy *legacy = &dev->legacy;
+	uint32_t *crtcs = dev->res_ptr->crtcs;
+	uint32_t flags = legacy->flags;
+	unsigned int sequence;
+	int ret;
+	int i;
+
+	if (!legacy->enabled || !legacy->n_updates)
+		return 0;
+
+	/* A modeset blocks until done, like drmModeSetCrtc() */
+	if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET)
+		flags &= ~DRM_MODE_ATOMIC_NONBLOCK;
+
+	/* One probe per crtc showing a new fb, all with the same sequence */
+	sequence = ++legacy->sequence;
+	for (i = 0; i < dev->res_ptr->count_crtcs; i++) {
+		if (legacy->fb_id[i])
+			KMS_TRACE(commit_submit, crtcs[i], legacy->fb_id[i],
+				sequence);
+	}
+
+	ret = drmModeAtomicCommit(dev->fd, legacy->req, flags,
+		legacy->user_data);
+
+	for (i = 0; i < dev->res_ptr->count_crtcs; i++) {
+		if (legacy->fb_id[i])
+			KMS_TRACE(commit_return, crtcs[i], legacy->fb_id[i],
+				sequence);
+		legacy->fb_id[i] = 0;
+	}
+
+	drmModeAtomicSetCursor(legacy->req, 0);
+
+	/* Each crtc references the mode blob of its committed state */
+	for (i = 0; i < dev->res_ptr->count_crtcs; i++) {
+		if (!legacy->mode_changed[i])
+			continue;
+
+		if (ret) {
+			kms_blob_put(&dev->blobs, legacy->new_mode_blob[i]);
+		} else {
+			kms_blob_put(&dev->blobs, legacy->mode_blob[i]);
+			legacy->mode_blob[i] = legacy->new_mode_blob[i];
+		}
+		legacy->new_mode_blob[i] = 0;
+		legacy->mode_changed[i] = 0;
+	}
+	legacy->flags = 0;
+	legacy->user_data = NULL;
+	legacy->n_updates = 0;
+
+	return ret;
+}
+
+/* Event context of the kms_handle_event() call dispatching on this thread */
+static __thread drmEventContext *dispatch_ctx;
+
+static void
+trace_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+	unsigned int tv_usec, unsigned int crtc_id, void *user_data)
+{
+	drmEventContext *evt_ctx = dispatch_ctx;
+
+	KMS_TRACE(flip_event, crtc_id, 0, sequence);
+
+	if (evt_ctx->version >= 3 && evt_ctx->page_flip_handler2)
+		evt_ctx->page_flip_handler2(fd, sequence, tv_sec, tv_usec,
+			crtc_id, user_data);
+	else if (evt_ctx->page_flip_handler)
+		evt_ctx->page_flip_handler(fd, sequence, tv_sec, tv_usec,
+			user_data);
+}
+
+int kms_handle_event(int fd, drmEventContext *evt_ctx)
+{
+	drmEventContext trace_ctx;
+	drmEventContext *prev_ctx = dispatch_ctx;
+	int ret;
+
+	/* Flip events come through trace_flip_handler(), which has crtc_id */
+	memset(&trace_ctx, 0, sizeof(trace_ctx));
+	trace_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	trace_ctx.vblank_handler = evt_ctx->vblank_handler;
+	trace_ctx.page_flip_handler2 = trace_flip_handler;
+#if DRM_EVENT_CONTEXT_VERSION >= 4
+	if (evt_ctx->version >= 4)
+		trace_ctx.sequence_handler = evt_ctx->sequence_handler;
+#endif
+
+	dispatch_ctx = evt_ctx;
+	ret = drmHandleEvent(fd, &trace_ctx);
+	dispatch_ctx = prev_ctx;
+
+	return ret;
+}
+
+/* Wait on fd[0, n_fds), plus stdin if watch_stdin */
+static int
+wait_events(const int *fd, int n_fds, drmEventContext *evt_ctx,
+	int timeout_ms, int watch_stdin)
+{
+	struct pollfd pfd[KMS_MAX_DEVICES + 1];
+	int ret;
+	int i;
+
+	if (n_fds > KMS_MAX_DEVICES)
+		n_fds = KMS_MAX_DEVICES;
+
+	for (i = 0; i < n_fds; i++) {
+		pfd[i].fd = fd[i];
+		pfd[i].events = POLLIN;
+	}
+	pfd[n_fds].fd = 0;
+	pfd[n_fds].events = POLLIN;
+
+	/* A signal handled meanwhile isn't an error, wait on */
+	do {
+		ret = poll(pfd, watch_stdin ? n_fds + 1 : n_fds, timeout_ms);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0)
+		return -1;
+
+	if (watch_stdin && (pfd[n_fds].revents & POLLIN))
+		return 0;
+
+	for (i = 0; i < n_fds; i++) {
+		if (pfd[i].revents & POLLIN)
+			kms_handle_event(fd[i], evt_ctx);
+	}
+
+	return 1;
+}
+
+int kms_wait_events(int fd, drmEventContext *evt_ctx, int timeout_ms,
+	int watch_stdin)
+{
+	return wait_events(&fd, 1, evt_ctx, timeout_ms, watch_stdin);
+}
+
+int kms_wait_devices(struct kms_device *dev, int n_devs,
+	drmEventContext *evt_ctx, int timeout_ms, int watch_stdin)
+{
+	int fd[KMS_MAX_DEVICES];
+	int i;
+
+	if (n_devs > KMS_MAX_DEVICES)
+		n_devs = KMS_MAX_DEVICES;
+
+	for (i = 0; i < n_devs; i++)
+		fd[i] = dev[i].fd;
+
+	return wait_events(fd, n_devs, evt_ctx, timeout_ms, watch_stdin);
+}
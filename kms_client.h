@@ -0,0 +1,431 @@
+#ifndef KMS_CLIENT_H
+#define KMS_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+
+/*
+ * Core shared by the drm clients: device open, topology and property
+ * discovery, dumb buffers and fill kernels, property blobs, atomic
+ * request helpers, legacy call translation and event waiting.
+ */
+
+/*
+ * Bump allocator for topology and property metadata. Everything allocated
+ * from an arena is released at once by kms_arena_release(), e.g. before
+ * rediscovering after a hotplug.
+ */
+struct kms_arena {
+	struct kms_arena_chunk *chunk;
+	size_t used;
+	size_t reserved;
+	unsigned int n_allocs;
+	unsigned int n_chunks;
+};
+
+void *kms_arena_alloc(struct kms_arena *arena, size_t size);
+void *kms_arena_dup(struct kms_arena *arena, const void *src, size_t size);
+void kms_arena_release(struct kms_arena *arena);
+void kms_arena_report(struct kms_arena *arena);
+
+/* Object types with properties, in the order they are stored */
+enum kms_obj_type {
+	KMS_OBJ_CRTC,
+	KMS_OBJ_ENCODER,
+	KMS_OBJ_CONNECTOR,
+	KMS_OBJ_PLANE,
+	KMS_N_OBJ_TYPES,
+};
+
+/*
+ * Properties of all crtc, encoder, connector and plane objects, stored as
+ * parallel arrays in a single allocation. Row i describes property
+ * prop_id[i] of object obj_id[i]. Rows of one object type are contiguous:
+ * [type_start[t], type_start[t + 1]). Property names are interned, so a
+ * lookup compares small integers instead of strings.
+ */
+struct kms_properties {
+	uint32_t count;
+	uint64_t *value;
+	uint32_t *obj_id;
+	uint32_t *prop_id;
+	uint32_t *flags;
+	uint16_t *name_id;
+	uint32_t type_start[KMS_N_OBJ_TYPES + 1];
+
+	uint32_t n_names;
+	char (*name)[DRM_PROP_NAME_LEN];
+};
+
+struct kms_properties *
+kms_get_properties(int fd, struct kms_arena *arena, drmModeResPtr res_ptr,
+	drmModePlaneResPtr plane_res_ptr);
+
+/* Re-read property values in place, without reallocating the store */
+int kms_refresh_properties(int fd, struct kms_properties *props);
+
+/* obj_type DRM_MODE_OBJECT_ANY looks at objects of every type */
+uint32_t kms_get_prop_id(struct kms_properties *props, uint32_t obj_type,
+	uint32_t obj_id, const char *prop_name);
+uint64_t kms_get_prop_value(struct kms_properties *props, uint32_t obj_type,
+	uint32_t obj_id, const char *prop_name, uint64_t def);
+
+/* Topology, copied into an arena */
+drmModeResPtr kms_get_resources(int fd, struct kms_arena *arena);
+drmModePlaneResPtr kms_get_plane_resources(int fd, struct kms_arena *arena);
+drmModeConnectorPtr kms_get_connector(int fd, struct kms_arena *arena,
+	uint32_t *con_id, int con_cnt);
+drmModeEncoderPtr kms_get_encoder(int fd, struct kms_arena *arena,
+	drmModeConnectorPtr con_ptr);
+drmModeCrtcPtr kms_get_crtc(int fd, struct kms_arena *arena,
+	drmModeResPtr res_ptr, drmModeEncoderPtr enc_ptr);
+drmModePlanePtr kms_get_plane(int fd, struct kms_arena *arena,
+	drmModePlaneResPtr plane_res_ptr, drmModeResPtr res_ptr,
+	drmModeCrtcPtr crtc_ptr);
+
+#define KMS_BLOB_MANAGER_SIZE 64
+
+struct kms_blob_entry {
+	uint64_t hash;
+	uint32_t size;
+	uint32_t blob_id;
+	int refcount;
+	unsigned int last_use;
+	void *data;
+};
+
+/*
+ * Property blobs interned by content. Each user of a blob, e.g. a crtc
+ * whose state points at it, holds a reference. Unreferenced blobs stay
+ * interned for reuse until their slot is needed or kms_blob_release_all().
+ * The table starts at KMS_BLOB_MANAGER_SIZE slots and only grows when
+ * every slot holds a referenced blob.
+ */
+struct kms_blob_manager {
+	struct kms_blob_entry *entry;
+	int n_entries;
+	int size;		/* slots allocated */
+	unsigned int clock;
+	unsigned int hits;
+	unsigned int created;
+	unsigned int destroyed;
+};
+
+uint32_t kms_blob_get(int fd, struct kms_blob_manager *blobs,
+	const void *data, uint32_t size);
+void kms_blob_put(struct kms_blob_manager *blobs, uint32_t blob_id);
+void kms_blob_release_all(int fd, struct kms_blob_manager *blobs);
+void kms_blob_report(struct kms_blob_manager *blobs);
+
+/*
+ * Translation of legacy drmModeSetCrtc()/drmModePageFlip() calls into
+ * atomic property updates. Updates made within one frame, across crtcs
+ * and planes, are merged into a single atomic commit by
+ * kms_legacy_commit().
+ */
+struct kms_legacy {
+	int enabled;		/* atomic supported, else calls pass through */
+	drmModeAtomicReqPtr req;
+	uint32_t flags;		/* commit flags accumulated for this frame */
+	void *user_data;	/* page flip event data for this frame */
+	int n_updates;
+	uint32_t *primary_plane;	/* primary plane id by crtc index */
+	uint32_t *mode_blob;	/* mode blob of committed state by crtc index */
+	uint32_t *new_mode_blob;	/* mode blob set this frame by crtc index */
+	uint8_t *mode_changed;	/* crtc had a mode set this frame */
+	uint32_t *fb_id;	/* fb flipped or set this frame by crtc index */
+	unsigned int sequence;	/* flips and commits so far, for trace probes */
+};
+
+/* kms_open() flags */
+#define KMS_OPEN_ATOMIC		(1 << 0)	/* fail without atomic commit */
+#define KMS_OPEN_TRY_ATOMIC	(1 << 1)	/* atomic commit if supported */
+
+/* An open device and everything discovered on it */
+struct kms_device {
+	int fd;
+	int atomic;
+	struct kms_arena arena;
+	struct kms_blob_manager blobs;
+	drmModeResPtr res_ptr;
+	drmModePlaneResPtr plane_res_ptr;
+	struct kms_properties *prop_ptr;
+	struct kms_legacy legacy;
+};
+
+/*
+ * Open a device by driver name or device node path, check dumb buffer
+ * support, enable atomic commit as flags ask and discover resources and
+ * properties. Return 0 on success.
+ */
+int kms_open(struct kms_device *dev, const char *name, unsigned int flags);
+void kms_close(struct kms_device *dev);
+
+/* Same as kms_open() on an fd already open, e.g. a lease fd */
+int kms_open_fd(struct kms_device *dev, int fd, unsigned int flags);
+
+/*
+ * Rediscover resources and properties, e.g. after a hotplug. Topology
+ * pointers taken from the arena before are invalid afterwards, legacy
+ * call translation needs kms_legacy_init() again. Return 0 on success.
+ */
+int kms_rediscover(struct kms_device *dev);
+
+/*
+ * Open every device with a primary node which passes kms_open() with flags
+ * and has at least min_planes planes, up to max_devs of them. Devices are
+ * picked by capability rather than by driver name. Return number of
+ * devices opened.
+ */
+int kms_open_devices(struct kms_device *dev, int max_devs, unsigned int flags,
+	int min_planes);
+
+/* Connector, encoder, crtc and plane driving one display */
+struct kms_output {
+	drmModeConnectorPtr con;
+	drmModeEncoderPtr enc;
+	drmModeCrtcPtr crtc;
+	drmModePlanePtr plane;
+};
+
+/*
+ * Pick 1st connector with a valid mode and the 1st encoder, crtc and,
+ * if need_plane, plane which can drive it. Return 0 on success.
+ */
+int kms_get_output(struct kms_device *dev, struct kms_output *output,
+	int need_plane);
+
+/* Fill patterns */
+#define KMS_FILL_TILES 1
+#define KMS_FILL_PLAIN 2
+
+/* Draw pattern, scrolled horizontally by frame where it moves */
+typedef void (*kms_fill_func)(void *mem_base, unsigned int width,
+	unsigned int height, unsigned int stride, unsigned int frame);
+
+/* Fill loop generated for one format and pattern */
+struct kms_fill_kernel {
+	uint32_t format;
+	int pattern;
+	unsigned int bpp;
+	const char *name;
+	kms_fill_func fill;
+};
+
+extern const struct kms_fill_kernel kms_fill_kernels[];
+extern const unsigned int kms_n_fill_kernels;
+
+const struct kms_fill_kernel *kms_get_fill_kernel(uint32_t format,
+	int pattern);
+
+/* Page size backing memory from kms_alloc_huge() */
+enum kms_page_type {
+	KMS_PAGES_BASE,		/* huge pages unavailable */
+	KMS_PAGES_TRANSPARENT,	/* transparent huge pages advised */
+	KMS_PAGES_EXPLICIT,	/* hugetlb pages reserved */
+};
+
+/* kms_buffer flags, set before the buffer is allocated */
+#define KMS_BUFFER_SHADOW	(1 << 0)	/* shadow a write-combined mapping */
+#define KMS_BUFFER_SHADOW_ALWAYS (1 << 1)	/* shadow any mapping */
+
+struct kms_buffer {
+	struct drm_mode_create_dumb dumb_buf;
+	struct drm_mode_map_dumb map_dumb_buf;
+	void *buf_ptr;
+	uint32_t buf_id;
+	uint16_t hsize, vsize;
+	uint32_t format;
+	unsigned int flags;
+
+	/* Kernel by pattern for the buffer's format, NULL if there is none */
+	const struct kms_fill_kernel *fill[KMS_FILL_PLAIN + 1];
+
+	/* Cached copy of the mapping with the same layout, NULL if none */
+	void *shadow;
+	enum kms_page_type shadow_pages;
+	unsigned int damage_y1, damage_y2;	/* damaged rows [y1, y2) */
+};
+
+/*
+ * Create and mmap a dumb buffer of hsize x vsize in format, defaulting
+ * to XRGB8888. kms_add_buffer() also adds it to drm as frame buffer.
+ * Return 0 on success.
+ */
+int kms_get_dumb_buffer(int fd, struct kms_buffer *buffer);
+int kms_add_buffer(int fd, struct kms_buffer *buffer, uint16_t hsize,
+	uint16_t vsize, uint32_t format);
+void kms_put_buffer(int fd, struct kms_buffer *buffer);
+
+/*
+ * Draw pattern with the kernel picked for the buffer's format when it was
+ * allocated. kms_fill_frame() scrolls it by frame.
+ */
+void kms_fill_buffer(struct kms_buffer *buffer, int pattern);
+void kms_fill_frame(struct kms_buffer *buffer, int pattern,
+	unsigned int frame);
+
+/*
+ * Dumb buffer mappings are often write-combined or uncached: reads and
+ * scattered writes are slow. With KMS_BUFFER_SHADOW such a buffer gets a
+ * cached shadow. Drawing goes to kms_buffer_draw_ptr(), at the buffer's
+ * pitch, kms_buffer_flush() streams rows marked by kms_buffer_damage()
+ * out to the mapping. Without a shadow, drawing goes straight to the
+ * mapping and flushing does nothing.
+ */
+int kms_mapping_is_wc(struct kms_buffer *buffer);
+void *kms_buffer_draw_ptr(struct kms_buffer *buffer);
+void kms_buffer_damage(struct kms_buffer *buffer, unsigned int y,
+	unsigned int height);
+void kms_buffer_flush(struct kms_buffer *buffer);
+
+/* Copy rows to write-combined memory with non-temporal stores */
+void kms_stream_copy_rows(void *dst, unsigned int dst_stride,
+	const void *src, unsigned int src_stride, unsigned int row_bytes,
+	unsigned int rows);
+
+/*
+ * Share src_buf of device src with device dst through PRIME, so content
+ * rendered once into src_buf scans out on both. dst_buf is added to dst
+ * as frame buffer; it isn't mapped, drawing goes through src_buf.
+ * Return 0 on success, -1 if either device lacks PRIME support.
+ */
+int kms_import_buffer(struct kms_device *dst, struct kms_buffer *dst_buf,
+	struct kms_device *src, struct kms_buffer *src_buf);
+
+/* Frame buffers of one size and format, handed out while free */
+struct kms_buffer_pool {
+	struct kms_buffer *buffer;
+	int count;
+	uint32_t busy;		/* bit per buffer */
+};
+
+int kms_pool_init(int fd, struct kms_buffer_pool *pool, int count,
+	uint16_t hsize, uint16_t vsize, uint32_t format);
+void kms_pool_fini(int fd, struct kms_buffer_pool *pool);
+struct kms_buffer *kms_pool_acquire(struct kms_buffer_pool *pool);
+void kms_pool_release(struct kms_buffer_pool *pool, struct kms_buffer *buffer);
+
+/*
+ * The 1st write to each page of a fresh mapping takes a page fault, ~8000
+ * of them for a 4K frame buffer. kms_prefault() takes them up front,
+ * kms_warmup_start() does so for count buffers on a background thread,
+ * e.g. while the mode is being set. kms_warmup_wait() joins it and fills
+ * in the cost. Buffers without a mapping are skipped.
+ */
+void kms_prefault(void *mem, size_t size);
+
+struct kms_warmup {
+	struct kms_buffer *buffer;
+	int count;
+	int running;
+	pthread_t thread;
+	size_t bytes;		/* size of mappings prefaulted */
+	double ms;		/* time spent prefaulting */
+	long faults;		/* page faults taken while prefaulting */
+};
+
+void kms_warmup_start(struct kms_warmup *warmup, struct kms_buffer *buffer,
+	int count);
+void kms_warmup_wait(struct kms_warmup *warmup);
+
+/* Page faults taken by calling thread so far */
+long kms_fault_count(void);
+
+/* CLOCK_MONOTONIC in ns, the time base of all clients and recordings */
+static inline uint64_t kms_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Prefaulted memory for shadow and staging buffers, huge page aligned and
+ * backed by huge pages if possible. Return NULL on failure.
+ */
+void *kms_alloc_huge(size_t size, enum kms_page_type *type);
+void kms_free_huge(void *mem, size_t size);
+
+/*
+ * DRM_MODE_ROTATE_* and DRM_MODE_REFLECT_* values plane's "rotation"
+ * property offers, 0 without the property. The driver can still reject
+ * a value for a given fb or mode, probe with a TEST_ONLY commit.
+ */
+uint32_t kms_get_rotations(struct kms_device *dev, uint32_t plane_id);
+
+/* Add a property by name to an atomic request, -1 if object lacks it */
+int kms_add_property(struct kms_device *dev, drmModeAtomicReqPtr req,
+	uint32_t obj_type, uint32_t obj_id, const char *prop_name,
+	uint64_t value);
+
+/*
+ * Add plane state to an atomic request, same arguments as
+ * drmModeSetPlane(): src rect in 16.16 fixed point is scaled to crtc rect.
+ */
+int kms_add_plane(struct kms_device *dev, drmModeAtomicReqPtr req,
+	uint32_t plane_id, uint32_t crtc_id, uint32_t fb_id,
+	int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h,
+	uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h);
+
+/*
+ * Add a full modeset of output to an atomic request: its plane scans out
+ * the whole buffer over the whole 1st mode, scaled if sizes differ, crtc
+ * gets mode blob and ACTIVE, connector gets crtc.
+ */
+int kms_add_modeset(struct kms_device *dev, drmModeAtomicReqPtr req,
+	struct kms_output *output, struct kms_buffer *buffer,
+	uint32_t mode_blob_id);
+
+/*
+ * Blank or unblank output without a full modeset. With atomic commit, crtc
+ * ACTIVE is toggled in a single small commit, while mode blob, frame
+ * buffers and plane state stay resident. With user_data, unblanking
+ * requests a page flip event for the 1st frame shown. Without atomic,
+ * connector DPMS is set, no event is sent; flip to learn the 1st frame.
+ * Return 0 on success.
+ */
+int kms_set_power(struct kms_device *dev, struct kms_output *output, int on,
+	void *user_data);
+
+/*
+ * Legacy call translation. kms_legacy_init() enables it if the device
+ * was opened with atomic commit, otherwise the calls pass through.
+ */
+void kms_legacy_init(struct kms_device *dev, drmModeAtomicReqPtr req);
+int kms_legacy_set_crtc(struct kms_device *dev, uint32_t crtc_id,
+	uint32_t fb_id, uint32_t x, uint32_t y, uint32_t *connectors,
+	int count, drmModeModeInfoPtr mode);
+int kms_legacy_page_flip(struct kms_device *dev, uint32_t crtc_id,
+	uint32_t fb_id, uint32_t flags, void *user_data);
+int kms_legacy_commit(struct kms_device *dev);
+
+/*
+ * Same as drmHandleEvent(), and fires the flip_event trace probe before
+ * the page flip handler of evt_ctx runs.
+ */
+int kms_handle_event(int fd, drmEventContext *evt_ctx);
+
+/*
+ * Wait for events on fd and dispatch them through evt_ctx. With
+ * watch_stdin, a key press ends the wait too. timeout_ms < 0 waits
+ * forever. Signals caught meanwhile restart the wait.
+ * Return:
+ * 1: drm events were dispatched
+ * 0: user pressed a key
+ * -1: timeout or error
+ */
+int kms_wait_events(int fd, drmEventContext *evt_ctx, int timeout_ms,
+	int watch_stdin);
+
+/* Same as kms_wait_events(), across the fds of n_devs devices */
+int kms_wait_devices(struct kms_device *dev, int n_devs,
+	drmEventContext *evt_ctx, int timeout_ms, int watch_stdin);
+
+#endif
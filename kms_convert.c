@@ -0,0 +1,583 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_convert.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Coefficients are Q13 fixed point, summed in 32 bit. Vector and scalar
+ * paths evaluate the same sums, so they produce identical pixels.
+ */
+#define COEF_SHIFT 13
+#define COEF_ROUND (1 << (COEF_SHIFT - 1))
+
+/* Rotation works on square tiles of dst, so src and dst stay in L1 */
+#define ROTATE_TILE 32
+
+/* YUV to RGB: R = y*Y + rv*V, G = y*Y + gu*U + gv*V, B = y*Y + bu*U */
+struct yuv_coefs {
+	int16_t y, rv, gu, gv, bu;
+	int16_t y_offset;
+};
+
+/* RGB to YUV, chroma coefficients are applied to sums of 2x2 blocks */
+struct rgb_coefs {
+	int16_t yr, yg, yb;
+	int16_t ur, ug, ub;
+	int16_t vr, vg, vb;
+	int16_t y_offset;
+};
+
+static void get_luma_weights(enum kms_color_encoding encoding,
+	double *kr, double *kb)
+{
+	if (encoding == KMS_COLOR_BT709) {
+		*kr = 0.2126;
+		*kb = 0.0722;
+	} else {
+		*kr = 0.299;
+		*kb = 0.114;
+	}
+}
+
+static int16_t q13(double v)
+{
+	return (int16_t)(v * (1 << COEF_SHIFT) + (v < 0 ? -0.5 : 0.5));
+}
+
+static void get_yuv_coefs(enum kms_color_encoding encoding,
+	enum kms_color_range range, struct yuv_coefs *c)
+{
+	double kr, kb, kg;
+	double ys = 1.0, cs = 1.0;
+
+	get_luma_weights(encoding, &kr, &kb);
+	kg = 1.0 - kr - kb;
+
+	if (range == KMS_RANGE_LIMITED) {
+		ys = 255.0 / 219.0;
+		cs = 255.0 / 224.0;
+	}
+
+	c->y = q13(ys);
+	c->rv = q13(cs * 2 * (1 - kr));
+	c->gu = q13(-cs * 2 * kb * (1 - kb) / kg);
+	c->gv = q13(-cs * 2 * kr * (1 - kr) / kg);
+	c->bu = q13(cs * 2 * (1 - kb));
+	c->y_offset = range == KMS_RANGE_LIMITED ? 16 : 0;
+}
+
+static void get_rgb_coefs(enum kms_color_encoding encoding,
+	enum kms_color_range range, struct rgb_coefs *c)
+{
+	double kr, kb, kg;
+	double ys = 1.0, cs = 1.0;
+
+	get_luma_weights(encoding, &kr, &kb);
+	kg = 1.0 - kr - kb;
+
+	if (range == KMS_RANGE_LIMITED) {
+		ys = 219.0 / 255.0;
+		cs = 224.0 / 255.0;
+	}
+
+	c->yr = q13(ys * kr);
+	c->yg = q13(ys * kg);
+	c->yb = q13(ys * kb);
+	c->ur = q13(-cs * kr / (2 * (1 - kb)));
+	c->ug = q13(-cs * kg / (2 * (1 - kb)));
+	c->ub = q13(cs * 0.5);
+	c->vr = q13(cs * 0.5);
+	c->vg = q13(-cs * kg / (2 * (1 - kr)));
+	c->vb = q13(-cs * kb / (2 * (1 - kr)));
+	c->y_offset = range == KMS_RANGE_LIMITED ? 16 : 0;
+}
+
+static inline uint8_t clamp_u8(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static inline uint32_t
+yuv_pixel(const struct yuv_coefs *c, int y, int u, int v)
+{
+	int yy = (y - c->y_offset) * c->y + COEF_ROUND;
+
+	return clamp_u8((yy + c->rv * v) >> COEF_SHIFT) << 16 |
+	       clamp_u8((yy + c->gu * u + c->gv * v) >> COEF_SHIFT) << 8 |
+	       clamp_u8((yy + c->bu * u) >> COEF_SHIFT);
+}
+
+#if defined(__SSE2__)
+/*
+ * Convert 8 pixels. y holds 8 luma words, u and v 8 chroma words with
+ * each sample repeated for the pixel pair sharing it.
+ */
+static inline void
+yuv_store8(const struct yuv_coefs *c, uint32_t *out, __m128i y, __m128i u,
+	__m128i v)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(COEF_ROUND);
+	const __m128i c128 = _mm_set1_epi16(128);
+	const __m128i y_rv = _mm_set_epi16(c->rv, c->y, c->rv, c->y,
+		c->rv, c->y, c->rv, c->y);
+	const __m128i y_gu = _mm_set_epi16(c->gu, c->y, c->gu, c->y,
+		c->gu, c->y, c->gu, c->y);
+	const __m128i gv_0 = _mm_set_epi16(0, c->gv, 0, c->gv,
+		0, c->gv, 0, c->gv);
+	const __m128i y_bu = _mm_set_epi16(c->bu, c->y, c->bu, c->y,
+		c->bu, c->y, c->bu, c->y);
+	__m128i r_lo, r_hi, g_lo, g_hi, b_lo, b_hi;
+	__m128i r, g, b, bg, rx;
+
+	y = _mm_sub_epi16(y, _mm_set1_epi16(c->y_offset));
+	u = _mm_sub_epi16(u, c128);
+	v = _mm_sub_epi16(v, c128);
+
+	r_lo = _mm_madd_epi16(_mm_unpacklo_epi16(y, v), y_rv);
+	r_hi = _mm_madd_epi16(_mm_unpackhi_epi16(y, v), y_rv);
+	g_lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(y, u), y_gu),
+		_mm_madd_epi16(_mm_unpacklo_epi16(v, zero), gv_0));
+	g_hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(y, u), y_gu),
+		_mm_madd_epi16(_mm_unpackhi_epi16(v, zero), gv_0));
+	b_lo = _mm_madd_epi16(_mm_unpacklo_epi16(y, u), y_bu);
+	b_hi = _mm_madd_epi16(_mm_unpackhi_epi16(y, u), y_bu);
+
+#define DESCALE(lo, hi) _mm_packs_epi32( \
+	_mm_srai_epi32(_mm_add_epi32(lo, round), COEF_SHIFT), \
+	_mm_srai_epi32(_mm_add_epi32(hi, round), COEF_SHIFT))
+	r = DESCALE(r_lo, r_hi);
+	g = DESCALE(g_lo, g_hi);
+	b = DESCALE(b_lo, b_hi);
+#undef DESCALE
+
+	/* Saturate to bytes and interleave into B G R X byte order */
+	r = _mm_packus_epi16(r, r);
+	g = _mm_packus_epi16(g, g);
+	b = _mm_packus_epi16(b, b);
+	bg = _mm_unpacklo_epi8(b, g);
+	rx = _mm_unpacklo_epi8(r, zero);
+	_mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi16(bg, rx));
+	_mm_storeu_si128((__m128i *)(out + 4), _mm_unpackhi_epi16(bg, rx));
+}
+
+/* Split 8 interleaved Cb Cr words into Cb and Cr, each repeated twice */
+static inline void split_uv(__m128i uv, __m128i *u, __m128i *v)
+{
+	__m128i lo = _mm_and_si128(uv, _mm_set1_epi32(0xffff));
+	__m128i hi = _mm_srli_epi32(uv, 16);
+
+	*u = _mm_or_si128(lo, _mm_slli_epi32(lo, 16));
+	*v = _mm_or_si128(hi, _mm_slli_epi32(hi, 16));
+}
+#endif
+
+static void
+nv12_row(const struct yuv_coefs *c, uint32_t *out, const uint8_t *y_row,
+	const uint8_t *uv_row, unsigned int width)
+{
+	unsigned int x = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i u, v;
+
+	for (; x + 8 <= width; x += 8) {
+		__m128i y = _mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i *)(y_row + x)), zero);
+		__m128i uv = _mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i *)(uv_row + x)), zero);
+
+		split_uv(uv, &u, &v);
+		yuv_store8(c, out + x, y, u, v);
+	}
+#endif
+	for (; x < width; x++)
+		out[x] = yuv_pixel(c, y_row[x], uv_row[x & ~1] - 128,
+			uv_row[x | 1] - 128);
+}
+
+static void
+i420_row(const struct yuv_coefs *c, uint32_t *out, const uint8_t *y_row,
+	const uint8_t *u_row, const uint8_t *v_row, unsigned int width)
+{
+	unsigned int x = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	int32_t u4, v4;
+
+	for (; x + 8 <= width; x += 8) {
+		__m128i y = _mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i *)(y_row + x)), zero);
+		__m128i u, v;
+
+		memcpy(&u4, u_row + x / 2, 4);
+		memcpy(&v4, v_row + x / 2, 4);
+		u = _mm_unpacklo_epi8(_mm_cvtsi32_si128(u4), zero);
+		v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v4), zero);
+		yuv_store8(c, out + x, y, _mm_unpacklo_epi16(u, u),
+			_mm_unpacklo_epi16(v, v));
+	}
+#endif
+	for (; x < width; x++)
+		out[x] = yuv_pixel(c, y_row[x], u_row[x / 2] - 128,
+			v_row[x / 2] - 128);
+}
+
+static void
+yuyv_row(const struct yuv_coefs *c, uint32_t *out, const uint8_t *row,
+	unsigned int width)
+{
+	unsigned int x = 0;
+
+#if defined(__SSE2__)
+	__m128i u, v;
+
+	for (; x + 8 <= width; x += 8) {
+		__m128i yuyv = _mm_loadu_si128((const __m128i *)(row + x * 2));
+		__m128i y = _mm_and_si128(yuyv, _mm_set1_epi16(0xff));
+
+		split_uv(_mm_srli_epi16(yuyv, 8), &u, &v);
+		yuv_store8(c, out + x, y, u, v);
+	}
+#endif
+	for (; x < width; x++)
+		out[x] = yuv_pixel(c, row[x * 2], row[(x & ~1) * 2 + 1] - 128,
+			row[(x & ~1) * 2 + 3] - 128);
+}
+
+void kms_yuv_to_xrgb(const struct kms_yuv_frame *src, void *dst,
+	unsigned int dst_stride, unsigned int y0, unsigned int y1,
+	enum kms_color_encoding encoding, enum kms_color_range range)
+{
+	struct yuv_coefs c;
+	unsigned int y;
+
+	get_yuv_coefs(encoding, range, &c);
+
+	if (y1 > src->height)
+		y1 = src->height;
+
+	for (y = y0; y < y1; y++) {
+		uint32_t *out = (uint32_t *)((uint8_t *)dst +
+			(size_t)y * dst_stride);
+		const uint8_t *y_row = src->plane[0] +
+			(size_t)y * src->stride[0];
+
+		switch (src->format) {
+		case DRM_FORMAT_NV12:
+			nv12_row(&c, out, y_row, src->plane[1] +
+				(size_t)(y / 2) * src->stride[1], src->width);
+			break;
+		case DRM_FORMAT_YUV420:
+			i420_row(&c, out, y_row,
+				src->plane[1] + (size_t)(y / 2) * src->stride[1],
+				src->plane[2] + (size_t)(y / 2) * src->stride[2],
+				src->width);
+			break;
+		case DRM_FORMAT_YUYV:
+			yuyv_row(&c, out, y_row, src->width);
+			break;
+		}
+	}
+}
+
+static inline int
+rgb_sum(int16_t cr, int16_t cg, int16_t cb, int r, int g, int b)
+{
+	return cr * r + cg * g + cb * b;
+}
+
+/* Two rows of luma and one row of chroma from two rows of XRGB8888 */
+static void
+nv12_encode_rows(const struct rgb_coefs *c, uint8_t *y_row0, uint8_t *y_row1,
+	uint8_t *uv_row, const uint32_t *in0, const uint32_t *in1,
+	unsigned int width)
+{
+	unsigned int x = 0;
+
+#if defined(__SSE2__)
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i y_rg = _mm_set_epi16(c->yg, c->yr, c->yg, c->yr,
+		c->yg, c->yr, c->yg, c->yr);
+	const __m128i y_b1 = _mm_set_epi16(COEF_ROUND, c->yb, COEF_ROUND,
+		c->yb, COEF_ROUND, c->yb, COEF_ROUND, c->yb);
+	const __m128i u_rg = _mm_set_epi16(c->ug, c->ur, c->ug, c->ur,
+		c->ug, c->ur, c->ug, c->ur);
+	const __m128i u_b1 = _mm_set_epi16(4 * COEF_ROUND, c->ub,
+		4 * COEF_ROUND, c->ub, 4 * COEF_ROUND, c->ub,
+		4 * COEF_ROUND, c->ub);
+	const __m128i v_rg = _mm_set_epi16(c->vg, c->vr, c->vg, c->vr,
+		c->vg, c->vr, c->vg, c->vr);
+	const __m128i v_b1 = _mm_set_epi16(4 * COEF_ROUND, c->vb,
+		4 * COEF_ROUND, c->vb, 4 * COEF_ROUND, c->vb,
+		4 * COEF_ROUND, c->vb);
+	const __m128i y_off = _mm_set1_epi16(c->y_offset);
+	const __m128i c128 = _mm_set1_epi16(128);
+
+	for (; x + 8 <= width; x += 8) {
+		__m128i r[2], g[2], b[2];
+		__m128i rs, gs, bs, cb, cr, uv;
+		int i;
+
+		for (i = 0; i < 2; i++) {
+			const uint32_t *in = i ? in1 : in0;
+			uint8_t *y_row = i ? y_row1 : y_row0;
+			__m128i p0 = _mm_loadu_si128((const __m128i *)(in + x));
+			__m128i p1 = _mm_loadu_si128((const __m128i *)(in + x + 4));
+			__m128i lo, hi;
+
+			b[i] = _mm_packs_epi32(_mm_and_si128(p0, mask),
+				_mm_and_si128(p1, mask));
+			g[i] = _mm_packs_epi32(
+				_mm_and_si128(_mm_srli_epi32(p0, 8), mask),
+				_mm_and_si128(_mm_srli_epi32(p1, 8), mask));
+			r[i] = _mm_packs_epi32(
+				_mm_and_si128(_mm_srli_epi32(p0, 16), mask),
+				_mm_and_si128(_mm_srli_epi32(p1, 16), mask));
+
+			lo = _mm_add_epi32(
+				_mm_madd_epi16(_mm_unpacklo_epi16(r[i], g[i]), y_rg),
+				_mm_madd_epi16(_mm_unpacklo_epi16(b[i], one), y_b1));
+			hi = _mm_add_epi32(
+				_mm_madd_epi16(_mm_unpackhi_epi16(r[i], g[i]), y_rg),
+				_mm_madd_epi16(_mm_unpackhi_epi16(b[i], one), y_b1));
+			lo = _mm_packs_epi32(_mm_srai_epi32(lo, COEF_SHIFT),
+				_mm_srai_epi32(hi, COEF_SHIFT));
+			lo = _mm_add_epi16(lo, y_off);
+			_mm_storel_epi64((__m128i *)(y_row + x),
+				_mm_packus_epi16(lo, lo));
+		}
+
+		/* Sums of 2x2 blocks, 4 per component */
+		rs = _mm_madd_epi16(_mm_add_epi16(r[0], r[1]), one);
+		gs = _mm_madd_epi16(_mm_add_epi16(g[0], g[1]), one);
+		bs = _mm_madd_epi16(_mm_add_epi16(b[0], b[1]), one);
+		rs = _mm_packs_epi32(rs, rs);
+		gs = _mm_packs_epi32(gs, gs);
+		bs = _mm_packs_epi32(bs, bs);
+
+		/* Block sums are 4x the average, descale by 2 more bits */
+		cb = _mm_add_epi32(
+			_mm_madd_epi16(_mm_unpacklo_epi16(rs, gs), u_rg),
+			_mm_madd_epi16(_mm_unpacklo_epi16(bs, one), u_b1));
+		cr = _mm_add_epi32(
+			_mm_madd_epi16(_mm_unpacklo_epi16(rs, gs), v_rg),
+			_mm_madd_epi16(_mm_unpacklo_epi16(bs, one), v_b1));
+		uv = _mm_packs_epi32(_mm_srai_epi32(cb, COEF_SHIFT + 2),
+			_mm_srai_epi32(cr, COEF_SHIFT + 2));
+		uv = _mm_unpacklo_epi16(uv, _mm_srli_si128(uv, 8));
+		uv = _mm_add_epi16(uv, c128);
+		_mm_storel_epi64((__m128i *)(uv_row + x),
+			_mm_packus_epi16(uv, uv));
+	}
+#endif
+	for (; x < width; x += 2) {
+		/* Odd width: last block repeats the edge column */
+		unsigned int x1 = x + 1 < width ? x + 1 : x;
+		uint32_t p[4] = { in0[x], in0[x1], in1[x], in1[x1] };
+		uint8_t yv[4];
+		int rs = 0, gs = 0, bs = 0;
+		int i;
+
+		for (i = 0; i < 4; i++) {
+			int r = (p[i] >> 16) & 0xff;
+			int g = (p[i] >> 8) & 0xff;
+			int b = p[i] & 0xff;
+
+			yv[i] = clamp_u8(((rgb_sum(c->yr, c->yg, c->yb, r, g, b) +
+				COEF_ROUND) >> COEF_SHIFT) + c->y_offset);
+			rs += r;
+			gs += g;
+			bs += b;
+		}
+
+		y_row0[x] = yv[0];
+		y_row1[x] = yv[2];
+		if (x1 != x) {
+			y_row0[x1] = yv[1];
+			y_row1[x1] = yv[3];
+		}
+		uv_row[x] = clamp_u8(((rgb_sum(c->ur, c->ug, c->ub, rs, gs, bs) +
+			4 * COEF_ROUND) >> (COEF_SHIFT + 2)) + 128);
+		uv_row[x + 1] = clamp_u8(((rgb_sum(c->vr, c->vg, c->vb,
+			rs, gs, bs) + 4 * COEF_ROUND) >> (COEF_SHIFT + 2)) + 128);
+	}
+}
+
+void kms_xrgb_to_nv12(struct kms_yuv_frame *dst, const void *src,
+	unsigned int src_stride, unsigned int y0, unsigned int y1,
+	enum kms_color_encoding encoding, enum kms_color_range range)
+{
+	struct rgb_coefs c;
+	unsigned int y;
+
+	get_rgb_coefs(encoding, range, &c);
+
+	if (y1 > dst->height)
+		y1 = dst->height;
+
+	for (y = y0 & ~1u; y < y1; y += 2) {
+		/* Odd height: last row pairs with itself */
+		unsigned int y_1 = y + 1 < dst->height ? y + 1 : y;
+
+		nv12_encode_rows(&c,
+			dst->plane[0] + (size_t)y * dst->stride[0],
+			dst->plane[0] + (size_t)y_1 * dst->stride[0],
+			dst->plane[1] + (size_t)(y / 2) * dst->stride[1],
+			(const uint32_t *)((const uint8_t *)src +
+				(size_t)y * src_stride),
+			(const uint32_t *)((const uint8_t *)src +
+				(size_t)y_1 * src_stride),
+			dst->width);
+	}
+}
+
+#if defined(__SSE2__)
+/* Transpose 4x4 pixels: r[i] is dst column i, out[j] is dst row j */
+static inline void
+transpose4(__m128i r0, __m128i r1, __m128i r2, __m128i r3, uint32_t *out,
+	size_t out_pitch)
+{
+	__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+	__m128i t1 = _mm_unpacklo_epi32(r2, r3);
+	__m128i t2 = _mm_unpackhi_epi32(r0, r1);
+	__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+	_mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)(out + out_pitch),
+		_mm_unpackhi_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)(out + 2 * out_pitch),
+		_mm_unpacklo_epi64(t2, t3));
+	_mm_storeu_si128((__m128i *)(out + 3 * out_pitch),
+		_mm_unpackhi_epi64(t2, t3));
+}
+
+/* 4 pixels from s on, or reversed from s down to s - 3 */
+static inline __m128i load4(const uint32_t *s, ptrdiff_t step)
+{
+	if (step > 0)
+		return _mm_loadu_si128((const __m128i *)s);
+
+	return _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(s - 3)),
+		_MM_SHUFFLE(0, 1, 2, 3));
+}
+#endif
+
+/* Pixel (x, y) of a w x h dst tile is src[x * step_x + y * step_y] */
+static void
+rotate_tile(uint32_t *dst, size_t dst_pitch, const uint32_t *src,
+	ptrdiff_t step_x, ptrdiff_t step_y, unsigned int w, unsigned int h)
+{
+	unsigned int x, y = 0;
+
+#if defined(__SSE2__)
+	/* 90 and 270 degrees: 4 rows of a dst column are adjacent in src */
+	if (step_y == 1 || step_y == -1) {
+		for (; y + 4 <= h; y += 4) {
+			const uint32_t *s = src + (ptrdiff_t)y * step_y;
+			uint32_t *d = dst + y * dst_pitch;
+
+			for (x = 0; x + 4 <= w; x += 4) {
+				const uint32_t *c = s + (ptrdiff_t)x * step_x;
+
+				transpose4(load4(c, step_y),
+					load4(c + step_x, step_y),
+					load4(c + 2 * step_x, step_y),
+					load4(c + 3 * step_x, step_y),
+					d + x, dst_pitch);
+			}
+			for (; x < w; x++) {
+				const uint32_t *c = s + (ptrdiff_t)x * step_x;
+
+				d[x] = c[0];
+				d[dst_pitch + x] = c[step_y];
+				d[2 * dst_pitch + x] = c[2 * step_y];
+				d[3 * dst_pitch + x] = c[3 * step_y];
+			}
+		}
+	}
+#endif
+	for (; y < h; y++) {
+		const uint32_t *s = src + (ptrdiff_t)y * step_y;
+		uint32_t *d = dst + y * dst_pitch;
+
+		for (x = 0; x < w; x++)
+			d[x] = s[(ptrdiff_t)x * step_x];
+	}
+}
+
+void kms_rotate_xrgb(void *dst, unsigned int dst_stride, const void *src,
+	unsigned int src_stride, unsigned int width, unsigned int height,
+	uint32_t rotation)
+{
+	ptrdiff_t pitch = src_stride / 4;
+	size_t dst_pitch = dst_stride / 4;
+	const uint32_t *origin = src;
+	ptrdiff_t ex = 1, ey = pitch;
+	ptrdiff_t step_x, step_y;
+	unsigned int dst_w = width, dst_h = height;
+	unsigned int tx, ty, w, h;
+
+	if (!width || !height)
+		return;
+
+	/* Reflect src first: origin and steps of reflected image */
+	if (rotation & DRM_MODE_REFLECT_X) {
+		origin += width - 1;
+		ex = -1;
+	}
+	if (rotation & DRM_MODE_REFLECT_Y) {
+		origin += (ptrdiff_t)(height - 1) * pitch;
+		ey = -pitch;
+	}
+
+	/* Then rotate it counter-clockwise */
+	switch (rotation & DRM_MODE_ROTATE_MASK) {
+	case DRM_MODE_ROTATE_90:
+		origin += (ptrdiff_t)(width - 1) * ex;
+		step_x = ey;
+		step_y = -ex;
+		dst_w = height;
+		dst_h = width;
+		break;
+	case DRM_MODE_ROTATE_180:
+		origin += (ptrdiff_t)(width - 1) * ex +
+			(ptrdiff_t)(height - 1) * ey;
+		step_x = -ex;
+		step_y = -ey;
+		break;
+	case DRM_MODE_ROTATE_270:
+		origin += (ptrdiff_t)(height - 1) * ey;
+		step_x = -ey;
+		step_y = ex;
+		dst_w = height;
+		dst_h = width;
+		break;
+	default:
+		step_x = ex;
+		step_y = ey;
+		break;
+	}
+
+	for (ty = 0; ty < dst_h; ty += ROTATE_TILE) {
+		h = dst_h - ty < ROTATE_TILE ? dst_h - ty : ROTATE_TILE;
+
+		for (tx = 0; tx < dst_w; tx += ROTATE_TILE) {
+			w = dst_w - tx < ROTATE_TILE ? dst_w - tx : ROTATE_TILE;
+
+			rotate_tile((uint32_t *)dst + ty * dst_pitch + tx,
+				dst_pitch, origin + (ptrdiff_t)tx * step_x +
+				(ptrdiff_t)ty * step_y, step_x, step_y, w, h);
+		}
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef KMS_CONVERT_H
+#define KMS_CONVERT_H
+
+#include <stdint.h>
+
+/*
+ * Color space conversion between YUV content and XRGB8888 scanout
+ * buffers, and rotation of XRGB8888 content. Conversion kernels work on a
+ * band of rows [y0, y1), so a frame can be split across threads. Bands of
+ * subsampled formats start and end on even rows, except for the last one.
+ */
+
+enum kms_color_encoding {
+	KMS_COLOR_BT601,
+	KMS_COLOR_BT709,
+};
+
+enum kms_color_range {
+	KMS_RANGE_LIMITED,	/* Y 16..235, CbCr 16..240 */
+	KMS_RANGE_FULL,		/* 0..255 */
+};
+
+/*
+ * Planes of a YUV frame:
+ * DRM_FORMAT_NV12: plane[0] Y, plane[1] interleaved CbCr, 2x2 subsampled
+ * DRM_FORMAT_YUV420: plane[0] Y, plane[1] Cb, plane[2] Cr, 2x2 subsampled
+ * DRM_FORMAT_YUYV: plane[0] Y0 Cb Y1 Cr, 2x1 subsampled
+ * Chroma rows hold (width + 1) / 2 samples, strides are in bytes.
+ */
+struct kms_yuv_frame {
+	uint32_t format;
+	unsigned int width, height;
+	uint8_t *plane[3];
+	unsigned int stride[3];
+};
+
+/* Convert rows [y0, y1) of src into XRGB8888 at dst, pitch dst_stride */
+void kms_yuv_to_xrgb(const struct kms_yuv_frame *src, void *dst,
+	unsigned int dst_stride, unsigned int y0, unsigned int y1,
+	enum kms_color_encoding encoding, enum kms_color_range range);
+
+/*
+ * Convert rows [y0, y1) of XRGB8888 at src, pitch src_stride, into NV12
+ * frame dst. Chroma is the average of each 2x2 block.
+ */
+void kms_xrgb_to_nv12(struct kms_yuv_frame *dst, const void *src,
+	unsigned int src_stride, unsigned int y0, unsigned int y1,
+	enum kms_color_encoding encoding, enum kms_color_range range);
+
+/*
+ * Rotate XRGB8888 content counter-clockwise and reflect it like the
+ * plane "rotation" property does, for planes which can't. rotation is a
+ * DRM_MODE_ROTATE_* value or'ed with DRM_MODE_REFLECT_* flags, reflections
+ * apply first. src is width x height, dst is height x width for 90 and
+ * 270 degrees. Strides are in bytes, dst and src don't overlap.
+ */
+void kms_rotate_xrgb(void *dst, unsigned int dst_stride, const void *src,
+	unsigned int src_stride, unsigned int width, unsigned int height,
+	uint32_t rotation);
+
+#endif
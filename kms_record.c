@@ -0,0 +1,550 @@
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+#include "kms_record.h"
+
+/*
+ * Recorder of display calls, loaded with LD_PRELOAD into an unmodified
+ * application:
+ *
+ *   KMS_RECORD=app.kmsrec LD_PRELOAD=libkms_record.so app
+ *
+ * libdrm entry points are interposed, recorded and passed on. Atomic
+ * requests are opaque, so properties added to each one are shadowed
+ * here until it's committed.
+ */
+
+/* Look up next definition of a libdrm function, i.e. the real one */
+#define REAL(func) \
+	static __typeof__(func) *real_##func; \
+	if (!real_##func) \
+		real_##func = (__typeof__(func) *)dlsym(RTLD_NEXT, #func)
+
+/* Properties added to an atomic request, up to its cursor */
+struct shadow_req {
+	drmModeAtomicReqPtr req;
+	struct kms_rec_value *value;
+	int count;
+	int size;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace;
+static int trace_failed;
+
+static struct shadow_req *shadow;
+static int n_shadows;
+
+/* Property ids already described in the trace */
+static uint32_t *seen_prop;
+static int n_seen_props;
+
+/* Handlers of the event context being dispatched on this thread */
+static __thread drmEventContextPtr dispatch_ctx;
+
+/* Return trace file, opened on 1st use. Call with lock held. */
+static FILE *get_trace(void)
+{
+	const char *path;
+
+	if (trace || trace_failed)
+		return trace;
+
+	path = getenv("KMS_RECORD");
+	trace_failed = 1;
+	if (!path)
+		return NULL;
+
+	trace = fopen(path, "wbe");
+	if (!trace) {
+		fprintf(stderr, "kms_record: can't open %s\n", path);
+		return NULL;
+	}
+	fwrite(KMS_RECORD_MAGIC, 1, 8, trace);
+	trace_failed = 0;
+
+	return trace;
+}
+
+__attribute__((destructor)) static void close_trace(void)
+{
+	pthread_mutex_lock(&lock);
+	if (trace)
+		fclose(trace);
+	trace = NULL;
+	trace_failed = 1;
+	pthread_mutex_unlock(&lock);
+}
+
+/* Write one record of 2 payload parts. Call with lock held. */
+static void write_record(uint32_t type, uint64_t time_ns, const void *a,
+	size_t a_size, const void *b, size_t b_size)
+{
+	static const uint8_t zero[8];
+	struct kms_rec_header header;
+	FILE *file = get_trace();
+	size_t pad = (8 - (a_size + b_size) % 8) % 8;
+
+	if (!file)
+		return;
+
+	header.type = type;
+	header.size = a_size + b_size + pad;
+	header.time_ns = time_ns;
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(a, 1, a_size, file);
+	if (b_size)
+		fwrite(b, 1, b_size, file);
+	if (pad)
+		fwrite(zero, 1, pad, file);
+}
+
+/* Describe prop_id the 1st time it's used. Call with lock held. */
+static void record_property(int fd, uint32_t prop_id)
+{
+	struct kms_rec_property rec;
+	drmModePropertyPtr prop_ptr;
+	uint32_t *seen;
+	int i;
+
+	for (i = 0; i < n_seen_props; i++) {
+		if (seen_prop[i] == prop_id)
+			return;
+	}
+
+	seen = realloc(seen_prop, (n_seen_props + 1) * sizeof(uint32_t));
+	if (!seen)
+		return;
+	seen_prop = seen;
+	seen_prop[n_seen_props++] = prop_id;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.prop_id = prop_id;
+	prop_ptr = drmModeGetProperty(fd, prop_id);
+	if (prop_ptr) {
+		rec.flags = prop_ptr->flags;
+		memcpy(rec.name, prop_ptr->name, DRM_PROP_NAME_LEN);
+		rec.name[DRM_PROP_NAME_LEN - 1] = 0;
+		drmModeFreeProperty(prop_ptr);
+	}
+	write_record(KMS_REC_PROPERTY, kms_now_ns(), &rec, sizeof(rec), NULL,
+		0);
+}
+
+/* Return shadow of req, added if create. Call with lock held. */
+static struct shadow_req *get_shadow(drmModeAtomicReqPtr req, int create)
+{
+	struct shadow_req *s;
+	int i;
+
+	for (i = 0; i < n_shadows; i++) {
+		if (shadow[i].req == req)
+			return &shadow[i];
+	}
+	if (!create)
+		return NULL;
+
+	s = realloc(shadow, (n_shadows + 1) * sizeof(struct shadow_req));
+	if (!s)
+		return NULL;
+	shadow = s;
+	s = &shadow[n_shadows++];
+	memset(s, 0, sizeof(struct shadow_req));
+	s->req = req;
+
+	return s;
+}
+
+/* Return 0 if s can hold count values. Call with lock held. */
+static int reserve(struct shadow_req *s, int count)
+{
+	struct kms_rec_value *value;
+	int size = s->size ? s->size : 32;
+
+	while (size < count)
+		size *= 2;
+	if (size == s->size)
+		return 0;
+
+	value = realloc(s->value, size * sizeof(struct kms_rec_value));
+	if (!value)
+		return -1;
+	s->value = value;
+	s->size = size;
+
+	return 0;
+}
+
+int drmModeAtomicAddProperty(drmModeAtomicReqPtr req, uint32_t object_id,
+	uint32_t property_id, uint64_t value)
+{
+	struct shadow_req *s;
+	int ret;
+	REAL(drmModeAtomicAddProperty);
+
+	ret = real_drmModeAtomicAddProperty(req, object_id, property_id, value);
+	if (ret <= 0)
+		return ret;
+
+	/* ret is the new cursor, the value sits just before it */
+	pthread_mutex_lock(&lock);
+	s = get_shadow(req, 1);
+	if (s && !reserve(s, ret)) {
+		s->value[ret - 1].obj_id = object_id;
+		s->value[ret - 1].prop_id = property_id;
+		s->value[ret - 1].value = value;
+		s->count = ret;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+void drmModeAtomicSetCursor(drmModeAtomicReqPtr req, int cursor)
+{
+	struct shadow_req *s;
+	REAL(drmModeAtomicSetCursor);
+
+	real_drmModeAtomicSetCursor(req, cursor);
+
+	pthread_mutex_lock(&lock);
+	s = get_shadow(req, 0);
+	if (s && cursor < s->count)
+		s->count = cursor;
+	pthread_mutex_unlock(&lock);
+}
+
+drmModeAtomicReqPtr drmModeAtomicDuplicate(drmModeAtomicReqPtr old)
+{
+	struct shadow_req *s, *copy;
+	drmModeAtomicReqPtr req;
+	REAL(drmModeAtomicDuplicate);
+
+	req = real_drmModeAtomicDuplicate(old);
+	if (!req)
+		return NULL;
+
+	pthread_mutex_lock(&lock);
+	copy = get_shadow(req, 1);
+	s = get_shadow(old, 0);
+	if (s && copy && !reserve(copy, s->count)) {
+		memcpy(copy->value, s->value,
+			s->count * sizeof(struct kms_rec_value));
+		copy->count = s->count;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return req;
+}
+
+int drmModeAtomicMerge(drmModeAtomicReqPtr base,
+	drmModeAtomicReqPtr augment)
+{
+	struct shadow_req *s, *a;
+	int ret;
+	REAL(drmModeAtomicMerge);
+
+	ret = real_drmModeAtomicMerge(base, augment);
+	if (ret)
+		return ret;
+
+	pthread_mutex_lock(&lock);
+	a = get_shadow(augment, 0);
+	s = get_shadow(base, 1);
+	if (a && s && !reserve(s, s->count + a->count)) {
+		memcpy(s->value + s->count, a->value,
+			a->count * sizeof(struct kms_rec_value));
+		s->count += a->count;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+void drmModeAtomicFree(drmModeAtomicReqPtr req)
+{
+	struct shadow_req *s;
+	REAL(drmModeAtomicFree);
+
+	pthread_mutex_lock(&lock);
+	s = get_shadow(req, 0);
+	if (s) {
+		free(s->value);
+		*s = shadow[--n_shadows];
+	}
+	pthread_mutex_unlock(&lock);
+
+	real_drmModeAtomicFree(req);
+}
+
+int drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
+	void *user_data)
+{
+	struct kms_rec_commit rec;
+	struct shadow_req *s;
+	uint64_t time_ns = kms_now_ns();
+	int i;
+	REAL(drmModeAtomicCommit);
+
+	rec.ret = real_drmModeAtomicCommit(fd, req, flags, user_data);
+	rec.flags = flags;
+	rec.pad = 0;
+
+	pthread_mutex_lock(&lock);
+	s = get_shadow(req, 0);
+	rec.count = s ? s->count : 0;
+	for (i = 0; i < rec.count; i++)
+		record_property(fd, s->value[i].prop_id);
+	write_record(KMS_REC_COMMIT, time_ns, &rec, sizeof(rec),
+		s ? s->value : NULL, rec.count * sizeof(struct kms_rec_value));
+	pthread_mutex_unlock(&lock);
+
+	return rec.ret;
+}
+
+int drmModeCreatePropertyBlob(int fd, const void *data, size_t size,
+	uint32_t *id)
+{
+	struct kms_rec_blob rec;
+	uint64_t time_ns = kms_now_ns();
+	int ret;
+	REAL(drmModeCreatePropertyBlob);
+
+	ret = real_drmModeCreatePropertyBlob(fd, data, size, id);
+	if (ret)
+		return ret;
+
+	rec.blob_id = *id;
+	rec.length = size;
+	pthread_mutex_lock(&lock);
+	write_record(KMS_REC_BLOB, time_ns, &rec, sizeof(rec), data, size);
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+int drmModeDestroyPropertyBlob(int fd, uint32_t id)
+{
+	struct kms_rec_id rec = { id, 0 };
+	uint64_t time_ns = kms_now_ns();
+	REAL(drmModeDestroyPropertyBlob);
+
+	pthread_mutex_lock(&lock);
+	write_record(KMS_REC_DESTROY_BLOB, time_ns, &rec, sizeof(rec), NULL, 0);
+	pthread_mutex_unlock(&lock);
+
+	return real_drmModeDestroyPropertyBlob(fd, id);
+}
+
+static void record_fb(uint64_t time_ns, uint32_t fb_id, uint32_t width,
+	uint32_t height, uint32_t format, const uint32_t pitches[4],
+	const uint32_t offsets[4])
+{
+	struct kms_rec_fb rec;
+
+	rec.fb_id = fb_id;
+	rec.width = width;
+	rec.height = height;
+	rec.format = format;
+	memcpy(rec.pitches, pitches, sizeof(rec.pitches));
+	memcpy(rec.offsets, offsets, sizeof(rec.offsets));
+
+	pthread_mutex_lock(&lock);
+	write_record(KMS_REC_ADD_FB, time_ns, &rec, sizeof(rec), NULL, 0);
+	pthread_mutex_unlock(&lock);
+}
+
+int drmModeAddFB(int fd, uint32_t width, uint32_t height, uint8_t depth,
+	uint8_t bpp, uint32_t pitch, uint32_t bo_handle, uint32_t *buf_id)
+{
+	uint32_t pitches[4] = { pitch, 0, 0, 0 };
+	uint32_t offsets[4] = { 0, 0, 0, 0 };
+	uint64_t time_ns = kms_now_ns();
+	int ret;
+	REAL(drmModeAddFB);
+
+	ret = real_drmModeAddFB(fd, width, height, depth, bpp, pitch,
+		bo_handle, buf_id);
+	if (!ret)
+		record_fb(time_ns, *buf_id, width, height, bpp == 16 ?
+			DRM_FORMAT_RGB565 : depth == 32 ?
+			DRM_FORMAT_ARGB8888 : DRM_FORMAT_XRGB8888,
+			pitches, offsets);
+
+	return ret;
+}
+
+int drmModeAddFB2(int fd, uint32_t width, uint32_t height,
+	uint32_t pixel_format, const uint32_t bo_handles[4],
+	const uint32_t pitches[4], const uint32_t offsets[4],
+	uint32_t *buf_id, uint32_t flags)
+{
+	uint64_t time_ns = kms_now_ns();
+	int ret;
+	REAL(drmModeAddFB2);
+
+	ret = real_drmModeAddFB2(fd, width, height, pixel_format, bo_handles,
+		pitches, offsets, buf_id, flags);
+	if (!ret)
+		record_fb(time_ns, *buf_id, width, height, pixel_format,
+			pitches, offsets);
+
+	return ret;
+}
+
+int drmModeAddFB2WithModifiers(int fd, uint32_t width, uint32_t height,
+	uint32_t pixel_format, const uint32_t bo_handles[4],
+	const uint32_t pitches[4], const uint32_t offsets[4],
+	const uint64_t modifier[4], uint32_t *buf_id, uint32_t flags)
+{
+	uint64_t time_ns = kms_now_ns();
+	int ret;
+	REAL(drmModeAddFB2WithModifiers);
+
+	ret = real_drmModeAddFB2WithModifiers(fd, width, height, pixel_format,
+		bo_handles, pitches, offsets, modifier, buf_id, flags);
+	if (!ret)
+		record_fb(time_ns, *buf_id, width, height, pixel_format,
+			pitches, offsets);
+
+	return ret;
+}
+
+int drmModeRmFB(int fd, uint32_t bufferId)
+{
+	struct kms_rec_id rec = { bufferId, 0 };
+	uint64_t time_ns = kms_now_ns();
+	REAL(drmModeRmFB);
+
+	pthread_mutex_lock(&lock);
+	write_record(KMS_REC_RM_FB, time_ns, &rec, sizeof(rec), NULL, 0);
+	pthread_mutex_unlock(&lock);
+
+	return real_drmModeRmFB(fd, bufferId);
+}
+
+int drmModeSetCrtc(int fd, uint32_t crtcId, uint32_t bufferId, uint32_t x,
+	uint32_t y, uint32_t *connectors, int count, drmModeModeInfoPtr mode)
+{
+	struct kms_rec_set_crtc rec;
+	uint64_t time_ns = kms_now_ns();
+	REAL(drmModeSetCrtc);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.ret = real_drmModeSetCrtc(fd, crtcId, bufferId, x, y, connectors,
+		count, mode);
+	rec.crtc_id = crtcId;
+	rec.fb_id = bufferId;
+	rec.x = x;
+	rec.y = y;
+	rec.count = count > 0 ? count : 0;
+	rec.has_mode = mode != NULL;
+	if (mode)
+		rec.mode = *mode;
+
+	pthread_mutex_lock(&lock);
+	write_record(KMS_REC_SET_CRTC, time_ns, &rec, sizeof(rec), connectors,
+		rec.count * sizeof(uint32_t));
+	pthread_mutex_unlock(&lock);
+
+	return rec.ret;
+}
+
+int drmModePageFlip(int fd, uint32_t crtc_id, uint32_t fb_id, uint32_t flags,
+	void *user_data)
+{
+	struct kms_rec_page_flip rec;
+	uint64_t time_ns = kms_now_ns();
+	REAL(drmModePageFlip);
+
+	rec.ret = real_drmModePageFlip(fd, crtc_id, fb_id, flags, user_data);
+	rec.crtc_id = crtc_id;
+	rec.fb_id = fb_id;
+	rec.flags = flags;
+
+	pthread_mutex_lock(&lock);
+	write_record(KMS_REC_PAGE_FLIP, time_ns, &rec, sizeof(rec), NULL, 0);
+	pthread_mutex_unlock(&lock);
+
+	return rec.ret;
+}
+
+static void record_event(uint32_t crtc_id, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec)
+{
+	struct kms_rec_event rec;
+
+	rec.crtc_id = crtc_id;
+	rec.sequence = sequence;
+	rec.vblank_ns = tv_sec * 1000000000ull + tv_usec * 1000ull;
+
+	pthread_mutex_lock(&lock);
+	write_record(KMS_REC_EVENT, kms_now_ns(), &rec, sizeof(rec), NULL, 0);
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+record_page_flip(int fd, unsigned int sequence, unsigned int tv_sec,
+	unsigned int tv_usec, void *user_data)
+{
+	record_event(0, sequence, tv_sec, tv_usec);
+	dispatch_ctx->page_flip_handler(fd, sequence, tv_sec, tv_usec,
+		user_data);
+}
+
+static void
+record_page_flip2(int fd, unsigned int sequence, unsigned int tv_sec,
+	unsigned int tv_usec, unsigned int crtc_id, void *user_data)
+{
+	record_event(crtc_id, sequence, tv_sec, tv_usec);
+	dispatch_ctx->page_flip_handler2(fd, sequence, tv_sec, tv_usec,
+		crtc_id, user_data);
+}
+
+/* Dispatch through a copy of evctx with recording page flip handlers */
+int drmHandleEvent(int fd, drmEventContextPtr evctx)
+{
+	drmEventContextPtr outer = dispatch_ctx;
+	drmEventContext ctx;
+	size_t size;
+	int ret;
+	REAL(drmHandleEvent);
+
+	/* Copy only the members evctx->version has */
+	if (evctx->version >= DRM_EVENT_CONTEXT_VERSION)
+		size = sizeof(drmEventContext);
+#if DRM_EVENT_CONTEXT_VERSION >= 4
+	else if (evctx->version >= 3)
+		size = offsetof(drmEventContext, sequence_handler);
+#endif
+	else
+		size = offsetof(drmEventContext, page_flip_handler2);
+	memset(&ctx, 0, sizeof(ctx));
+	memcpy(&ctx, evctx, size);
+
+	if (ctx.page_flip_handler)
+		ctx.page_flip_handler = record_page_flip;
+	if (ctx.page_flip_handler2)
+		ctx.page_flip_handler2 = record_page_flip2;
+
+	dispatch_ctx = evctx;
+	ret = real_drmHandleEvent(fd, &ctx);
+	dispatch_ctx = outer;
+
+	return ret;
+}
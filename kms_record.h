@@ -0,0 +1,97 @@
+#ifndef KMS_RECORD_H
+#define KMS_RECORD_H
+
+#include <stdint.h>
+
+#include "xf86drmMode.h"
+
+/*
+ * Binary trace of display calls, written by the kms_record LD_PRELOAD
+ * recorder and re-issued by test_replay. A trace is KMS_RECORD_MAGIC
+ * followed by records: a header, then size bytes of payload padded to 8.
+ * Times are CLOCK_MONOTONIC in ns. Ids are those of the recorded process;
+ * a replay maps property ids by name, frame buffer and blob ids to the
+ * ones it creates.
+ */
+
+#define KMS_RECORD_MAGIC "KMSREC01"
+
+enum kms_record_type {
+	KMS_REC_PROPERTY = 1,	/* struct kms_rec_property, 1st use of prop_id */
+	KMS_REC_BLOB,		/* struct kms_rec_blob, then length bytes */
+	KMS_REC_DESTROY_BLOB,	/* struct kms_rec_id */
+	KMS_REC_ADD_FB,		/* struct kms_rec_fb */
+	KMS_REC_RM_FB,		/* struct kms_rec_id */
+	KMS_REC_COMMIT,		/* struct kms_rec_commit, then count values */
+	KMS_REC_SET_CRTC,	/* struct kms_rec_set_crtc, then count ids */
+	KMS_REC_PAGE_FLIP,	/* struct kms_rec_page_flip */
+	KMS_REC_EVENT,		/* struct kms_rec_event */
+};
+
+struct kms_rec_header {
+	uint32_t type;
+	uint32_t size;
+	uint64_t time_ns;	/* call, or event dispatch */
+};
+
+struct kms_rec_property {
+	uint32_t prop_id;
+	uint32_t flags;		/* DRM_MODE_PROP_* */
+	char name[DRM_PROP_NAME_LEN];
+};
+
+struct kms_rec_blob {
+	uint32_t blob_id;
+	uint32_t length;
+};
+
+struct kms_rec_id {
+	uint32_t id;
+	uint32_t pad;
+};
+
+struct kms_rec_fb {
+	uint32_t fb_id;
+	uint32_t width, height;
+	uint32_t format;
+	uint32_t pitches[4];
+	uint32_t offsets[4];
+};
+
+struct kms_rec_value {
+	uint32_t obj_id;
+	uint32_t prop_id;
+	uint64_t value;
+};
+
+struct kms_rec_commit {
+	uint32_t flags;		/* DRM_MODE_ATOMIC_* and PAGE_FLIP_* */
+	int32_t ret;
+	uint32_t count;
+	uint32_t pad;
+};
+
+struct kms_rec_set_crtc {
+	uint32_t crtc_id;
+	uint32_t fb_id;
+	uint32_t x, y;
+	int32_t ret;
+	uint32_t count;		/* connectors */
+	uint32_t has_mode;
+	drmModeModeInfo mode;
+};
+
+struct kms_rec_page_flip {
+	uint32_t crtc_id;
+	uint32_t fb_id;
+	uint32_t flags;
+	int32_t ret;
+};
+
+struct kms_rec_event {
+	uint32_t crtc_id;	/* 0 unless delivered to page_flip_handler2 */
+	uint32_t sequence;
+	uint64_t vblank_ns;	/* kernel timestamp of the flip */
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "kms_trace.h"
+
+int kms_trace_fd = -1;
+
+int kms_trace_init(void)
+{
+	static const char *const paths[] = {
+		"/sys/kernel/tracing/trace_marker",
+		"/sys/kernel/debug/tracing/trace_marker",
+	};
+	static int done;
+	int i;
+
+	if (done)
+		return kms_trace_fd >= 0 ? 0 : -1;
+	done = 1;
+
+	if (!getenv("KMS_TRACE_MARKER"))
+		return -1;
+
+	for (i = 0; i < 2 && kms_trace_fd < 0; i++)
+		kms_trace_fd = open(paths[i], O_WRONLY | O_CLOEXEC);
+	if (kms_trace_fd < 0) {
+		printf("can't open trace_marker, is tracefs mounted?\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* One write per line, so lines from several threads don't interleave */
+void kms_trace_marker(const char *name, uint32_t crtc_id, uint32_t fb_id,
+	uint32_t sequence)
+{
+	char line[96];
+	int len;
+
+	len = snprintf(line, sizeof(line),
+		"drm_clients: %s crtc_id=%u fb_id=%u sequence=%u\n",
+		name, crtc_id, fb_id, sequence);
+	if (len > 0 && len < (int)sizeof(line))
+		write(kms_trace_fd, line, len);
+}
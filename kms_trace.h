@@ -0,0 +1,55 @@
+#ifndef KMS_TRACE_H
+#define KMS_TRACE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+
+/*
+ * Probes on the present path, to line up client and kernel timing in a
+ * perf or trace-cmd capture with the drm_vblank_event tracepoints:
+ *
+ * fill_start, fill_end		rendering into fb_id, crtc_id 0
+ * commit_submit, commit_return	flip or commit ioctl of fb_id on crtc_id
+ * flip_event			page flip event of crtc_id, fb_id 0
+ *
+ * sequence is the frame passed to kms_fill_frame() for fills, the count
+ * of flips and commits on the device for commits, and the vblank sequence
+ * reported by the kernel for flip_event.
+ *
+ * Each probe is a USDT probe of provider drm_clients, a nop unless a
+ * tracer attaches, if built with <sys/sdt.h>. If KMS_TRACE_MARKER is set
+ * in the environment, kms_open() also opens ftrace's trace_marker and
+ * every probe writes a line there. Otherwise that costs a predicted
+ * branch.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define KMS_USDT(name, crtc_id, fb_id, sequence) \
+	DTRACE_PROBE3(drm_clients, name, crtc_id, fb_id, sequence)
+#else
+#define KMS_USDT(name, crtc_id, fb_id, sequence) do { } while (0)
+#endif
+
+/* trace_marker fd, -1 while trace_marker writes are off */
+extern int kms_trace_fd;
+
+#define KMS_TRACE(name, crtc_id, fb_id, sequence) \
+	do { \
+		KMS_USDT(name, crtc_id, fb_id, sequence); \
+		if (__builtin_expect(kms_trace_fd >= 0, 0)) \
+			kms_trace_marker(#name, crtc_id, fb_id, sequence); \
+	} while (0)
+
+/*
+ * Open trace_marker if KMS_TRACE_MARKER is set, once per process.
+ * Return 0 if trace_marker writes are on.
+ */
+int kms_trace_init(void);
+void kms_trace_marker(const char *name, uint32_t crtc_id, uint32_t fb_id,
+	uint32_t sequence);
+
+#endif
@@ -0,0 +1,334 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+
+/*
+ * Beam racing into a single, front buffer. The vblank timestamp is when
+ * scanout of line 0 starts, line time is htotal / clock of the mode, so
+ * the scanline at any time follows. The screen is split into bands, each
+ * rendered while the beam is still in the band above it: the band was
+ * scanned out a frame ago and is about to be again, so the update shows
+ * within a band's time rather than a whole frame. The margin is the time
+ * left between the end of rendering a band and the beam reaching it,
+ * negative when the beam overtook the write and the band tore.
+ */
+
+#define BAR_WIDTH 16
+
+/* main data structure to store info retrieved from drm drivers */
+struct test_data {
+	struct kms_device dev;
+	struct kms_output output;
+	struct kms_buffer buffer;
+	drmModeAtomicReqPtr atomic_ptr;
+	unsigned int pipe;	/* crtc index, for drmWaitVBlank() */
+
+	unsigned int bands;
+	unsigned int band_lines;
+	uint64_t clock;		/* pixel clock in kHz */
+	uint64_t htotal;
+	uint64_t frame_ns;	/* vtotal lines */
+
+	/* Samples, in us */
+	double *margin;
+	double *latency;	/* render start to beam reaching band */
+	double *drift;		/* vblank timestamp off its prediction */
+	unsigned int n_margins, n_drifts;
+	unsigned int tears, missed;
+};
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+		;
+}
+
+/*
+ * Wait for next vblank of the crtc. Return 0 and the time scanout of
+ * line 0 starts in *ns, and the vblank counter in *sequence.
+ */
+static int wait_vblank(struct test_data *t_data, uint64_t *ns,
+	unsigned int *sequence)
+{
+	drmVBlank vbl;
+
+	memset(&vbl, 0, sizeof(drmVBlank));
+	vbl.request.type = DRM_VBLANK_RELATIVE;
+	if (t_data->pipe == 1)
+		vbl.request.type |= DRM_VBLANK_SECONDARY;
+	else if (t_data->pipe > 1)
+		vbl.request.type |= (t_data->pipe <<
+			DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+	vbl.request.sequence = 1;
+
+	if (drmWaitVBlank(t_data->dev.fd, &vbl))
+		return -1;
+
+	*ns = vbl.reply.tval_sec * 1000000000ull +
+		vbl.reply.tval_usec * 1000ull;
+	*sequence = vbl.reply.sequence;
+
+	return 0;
+}
+
+/*
+ * Time from scanout of line 0 to scanout of line, rounded up so that
+ * scanline() of it is line. Computed from the pixel clock each time
+ * rather than as line times a rounded line time, which would be off by
+ * up to a ns per line.
+ */
+static uint64_t line_to_ns(struct test_data *t_data, uint64_t line)
+{
+	return (line * t_data->htotal * 1000000ull + t_data->clock - 1) /
+		t_data->clock;
+}
+
+/* Predicted scanline at time ns, >= vdisplay while in vertical blanking */
+static unsigned int scanline(struct test_data *t_data, uint64_t vblank_ns,
+	uint64_t ns)
+{
+	if (ns < vblank_ns)
+		ns += t_data->frame_ns;
+
+	return ((ns - vblank_ns) % t_data->frame_ns) * t_data->clock /
+		(t_data->htotal * 1000000ull);
+}
+
+/*
+ * Draw rows [start, end) of frame: a vertical bar moving across the
+ * screen, straight unless a band tore.
+ */
+static void draw_band(struct kms_buffer *buffer, unsigned int start,
+	unsigned int end, unsigned int frame)
+{
+	unsigned int width = buffer->dumb_buf.width;
+	unsigned int bar = (frame * 8) % (width - BAR_WIDTH);
+	uint32_t color = 0x00202020 + (frame & 0x3f) * 0x00010203;
+	unsigned int x, y;
+
+	for (y = start; y < end; y++) {
+		uint32_t *pixel = (uint32_t *)((uint8_t *)buffer->buf_ptr +
+			(size_t)y * buffer->dumb_buf.pitch);
+
+		for (x = 0; x < width; x++)
+			pixel[x] = color;
+		for (x = bar; x < bar + BAR_WIDTH; x++)
+			pixel[x] = 0x00ffffff;
+	}
+}
+
+/*
+ * Race the beam through one frame whose line 0 is scanned out at
+ * vblank_ns. Band 0 is rendered right away, in vertical blanking; band b
+ * once the beam enters band b - 1.
+ */
+static void race_frame(struct test_data *t_data, uint64_t vblank_ns,
+	unsigned int frame)
+{
+	unsigned int vdisplay = t_data->output.con->modes[0].vdisplay;
+	unsigned int b;
+
+	for (b = 0; b < t_data->bands; b++) {
+		unsigned int start = b * t_data->band_lines;
+		unsigned int end = b == t_data->bands - 1 ? vdisplay :
+			start + t_data->band_lines;
+		uint64_t beam_ns = vblank_ns + line_to_ns(t_data, start);
+		uint64_t render_ns, done_ns;
+		double margin;
+
+		if (b)
+			sleep_until(vblank_ns + line_to_ns(t_data,
+				start - t_data->band_lines));
+
+		render_ns = kms_now_ns();
+		draw_band(&t_data->buffer, start, end, frame);
+		done_ns = kms_now_ns();
+
+		margin = ((double)beam_ns - done_ns) / 1e3;
+		if (margin < 0)
+			t_data->tears++;
+		t_data->margin[t_data->n_margins] = margin;
+		t_data->latency[t_data->n_margins++] =
+			((double)beam_ns - render_ns) / 1e3;
+	}
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_samples(const char *name, double *s, unsigned int n)
+{
+	if (!n)
+		return;
+
+	qsort(s, n, sizeof(double), compare_double);
+	printf("  %-16s min %9.1f p1 %9.1f p50 %9.1f p99 %9.1f max %9.1f us\n",
+		name, s[0], s[n / 100], s[n / 2], s[(n * 99) / 100], s[n - 1]);
+}
+
+/* Return crtc index of crtc_id, -1 if not found */
+static int crtc_index(struct kms_device *dev, uint32_t crtc_id)
+{
+	int i;
+
+	for (i = 0; i < dev->res_ptr->count_crtcs; i++) {
+		if (dev->res_ptr->crtcs[i] == crtc_id)
+			return i;
+	}
+
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_data t_data;
+	unsigned int frames = 600;
+	unsigned int i;
+	int fd;
+	drmModeConnectorPtr active_con;
+	drmModeCrtcPtr active_crtc;
+	drmModeModeInfoPtr mode;
+	uint64_t vblank_ns, last_ns = 0;
+	unsigned int sequence, last_sequence = 0;
+	unsigned int line;
+	int pipe;
+
+	/* Check if drm driver name is provided by user */
+	if (argc < 2) {
+		printf("usage: %s <drm driver> [bands] [frames]\n", argv[0]);
+		return -1;
+	}
+
+	memset(&t_data, 0, sizeof(struct test_data));
+	t_data.bands = 8;
+	if (argc > 2)
+		t_data.bands = atoi(argv[2]);
+	if (argc > 3)
+		frames = atoi(argv[3]);
+	if (t_data.bands < 2 || !frames) {
+		printf("need at least 2 bands and 1 frame\n");
+		return -1;
+	}
+
+	/*
+	 * Open drm device node /dev/dri/cardX and discover its resources
+	 * and properties. Atomic commit is enabled if supported, so that
+	 * legacy calls can be translated into batched atomic commits.
+	 */
+	if (kms_open(&t_data.dev, argv[1], KMS_OPEN_TRY_ATOMIC))
+		return -1;
+	fd = t_data.dev.fd;
+	if (t_data.dev.atomic)
+		t_data.atomic_ptr = drmModeAtomicAlloc();
+
+	/* Find a connector, encoder and crtc */
+	if (kms_get_output(&t_data.dev, &t_data.output, 0))
+		return -1;
+	active_con = t_data.output.con;
+	active_crtc = t_data.output.crtc;
+	mode = &active_con->modes[0];
+	pipe = crtc_index(&t_data.dev, active_crtc->crtc_id);
+	if (pipe < 0)
+		return -1;
+	t_data.pipe = pipe;
+
+	/* Scanline timing of the mode, clock is in kHz */
+	if (!mode->clock || mode->flags & DRM_MODE_FLAG_INTERLACE ||
+		t_data.bands > mode->vdisplay) {
+		printf("can't race the beam of mode %s\n", mode->name);
+		return -1;
+	}
+	t_data.clock = mode->clock;
+	t_data.htotal = mode->htotal;
+	t_data.frame_ns = line_to_ns(&t_data, mode->vtotal);
+	t_data.band_lines = mode->vdisplay / t_data.bands;
+
+	t_data.margin = malloc(frames * t_data.bands * sizeof(double));
+	t_data.latency = malloc(frames * t_data.bands * sizeof(double));
+	t_data.drift = malloc(frames * sizeof(double));
+	if (!t_data.margin || !t_data.latency || !t_data.drift)
+		return -1;
+
+	/* Setup legacy to atomic translation */
+	kms_legacy_init(&t_data.dev, t_data.atomic_ptr);
+
+	/* Acquire the one frame buffer, scanned out while it's drawn */
+	if (kms_add_buffer(fd, &t_data.buffer, mode->hdisplay, mode->vdisplay,
+		DRM_FORMAT_XRGB8888) || mode->hdisplay <= BAR_WIDTH) {
+		printf("failed to allocate frame buffer\n");
+		return -1;
+	}
+	kms_prefault(t_data.buffer.buf_ptr, t_data.buffer.dumb_buf.size);
+	draw_band(&t_data.buffer, 0, mode->vdisplay, 0);
+
+	/* Set mode, never to flip again */
+	kms_legacy_set_crtc(&t_data.dev, active_crtc->crtc_id,
+		t_data.buffer.buf_id, 0, 0, &active_con->connector_id, 1, mode);
+	kms_legacy_commit(&t_data.dev);
+
+	/*
+	 * Resynchronize to the vblank timestamp every frame, so that the
+	 * predicted scanline doesn't drift from the real one.
+	 */
+	for (i = 0; i < frames; i++) {
+		if (wait_vblank(&t_data, &vblank_ns, &sequence)) {
+			printf("drmWaitVBlank failed\n");
+			break;
+		}
+
+		if (i) {
+			if (sequence != last_sequence + 1)
+				t_data.missed += sequence - last_sequence - 1;
+			t_data.drift[t_data.n_drifts++] = ((double)vblank_ns -
+				last_ns - (double)line_to_ns(&t_data,
+				(uint64_t)(sequence - last_sequence) *
+				mode->vtotal)) / 1e3;
+		}
+		last_ns = vblank_ns;
+		last_sequence = sequence;
+
+		/* Too late for this frame once the beam is past band 0 */
+		line = scanline(&t_data, vblank_ns, kms_now_ns());
+		if (line < t_data.band_lines || line >= mode->vdisplay)
+			race_frame(&t_data, vblank_ns, i + 1);
+		else
+			t_data.missed++;
+	}
+
+	printf("%s@%u: line %.3f ns, frame %.3f ms, %u bands of %u lines\n",
+		mode->name, mode->vrefresh, mode->htotal * 1e6 / mode->clock,
+		t_data.frame_ns / 1e6, t_data.bands, t_data.band_lines);
+	printf("%u bands raced, %u torn (%.2f%%), %u frames missed\n",
+		t_data.n_margins, t_data.tears, t_data.n_margins ?
+		100.0 * t_data.tears / t_data.n_margins : 0, t_data.missed);
+	print_samples("tearing margin", t_data.margin, t_data.n_margins);
+	print_samples("render to scan", t_data.latency, t_data.n_margins);
+	print_samples("vblank drift", t_data.drift, t_data.n_drifts);
+
+	kms_put_buffer(fd, &t_data.buffer);
+	free(t_data.margin);
+	free(t_data.latency);
+	free(t_data.drift);
+
+	/* Release blobs and all discovered metadata at once */
+	kms_close(&t_data.dev);
+	if (t_data.atomic_ptr)
+		drmModeAtomicFree(t_data.atomic_ptr);
+
+	return 0;
+}
@@ -0,0 +1,372 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+
+/* main data structure to store info retrieved from drm drivers */
+struct test_data {
+	struct kms_device dev;
+	struct kms_output output;
+	struct kms_buffer buffer;
+	drmModeAtomicReqPtr atomic_ptr;
+};
+
+/* Samples of one benchmark, in microseconds per iteration */
+struct bench {
+	const char *name;
+	unsigned int n_samples;
+	double *sample_us;
+	unsigned int ops;	/* operations per iteration */
+	size_t bytes;		/* bytes written per iteration */
+	int failed;
+};
+
+#define MAX_BENCHES 16
+#define LOOKUP_BATCH 1000
+#define FLIP_TIMEOUT_MS 1000
+
+static struct bench benches[MAX_BENCHES];
+static int n_benches;
+
+static struct bench *bench_new(const char *name, unsigned int iterations)
+{
+	struct bench *bench = &benches[n_benches++];
+
+	bench->name = name;
+	bench->sample_us = malloc(iterations * sizeof(double));
+	bench->ops = 1;
+
+	return bench;
+}
+
+static void bench_add(struct bench *bench, double start_us)
+{
+	bench->sample_us[bench->n_samples++] = kms_now_ns() / 1e3 - start_us;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_bench(struct bench *bench, int last)
+{
+	double *s = bench->sample_us;
+	unsigned int n = bench->n_samples;
+	double sum = 0;
+	unsigned int i;
+
+	printf("    {\"name\": \"%s\", \"iterations\": %u, "
+		"\"ops_per_iteration\": %u", bench->name, n, bench->ops);
+
+	if (n) {
+		qsort(s, n, sizeof(double), compare_double);
+		for (i = 0; i < n; i++)
+			sum += s[i];
+
+		printf(", \"min_us\": %.3f, \"mean_us\": %.3f, "
+			"\"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f",
+			s[0], sum / n, s[n / 2], s[(n * 99) / 100], s[n - 1]);
+		if (bench->bytes)
+			printf(", \"mb_per_s\": %.1f",
+				bench->bytes * n / sum);
+	}
+
+	printf(", \"failed\": %s}%s\n", bench->failed ? "true" : "false",
+		last ? "" : ",");
+}
+
+/* Discover resources and properties from scratch, then drop them */
+static void bench_discovery(struct test_data *t_data, unsigned int iterations)
+{
+	struct bench *bench = bench_new("property_discovery", iterations);
+	int fd = t_data->dev.fd;
+	struct kms_arena arena;
+	unsigned int i;
+
+	memset(&arena, 0, sizeof(struct kms_arena));
+
+	for (i = 0; i < iterations; i++) {
+		double start = kms_now_ns() / 1e3;
+		drmModeResPtr res_ptr = kms_get_resources(fd, &arena);
+		drmModePlaneResPtr plane_res_ptr =
+			kms_get_plane_resources(fd, &arena);
+
+		if (!kms_get_properties(fd, &arena, res_ptr, plane_res_ptr))
+			bench->failed = 1;
+		bench_add(bench, start);
+		kms_arena_release(&arena);
+	}
+}
+
+/* Look up every property an atomic modeset needs */
+static void bench_lookup(struct test_data *t_data, unsigned int iterations)
+{
+	static char *plane_props[] = { "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+		"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H", "CRTC_ID", "FB_ID" };
+	struct bench *bench = bench_new("property_lookup", iterations);
+	struct kms_properties *props = t_data->dev.prop_ptr;
+	uint32_t plane_id = t_data->output.plane->plane_id;
+	uint32_t crtc_id = t_data->output.crtc->crtc_id;
+	volatile uint32_t sink = 0;
+	unsigned int i, j, k;
+
+	bench->ops = LOOKUP_BATCH * 12;
+
+	for (i = 0; i < iterations; i++) {
+		double start = kms_now_ns() / 1e3;
+
+		for (j = 0; j < LOOKUP_BATCH; j++) {
+			for (k = 0; k < 10; k++)
+				sink += kms_get_prop_id(props,
+					DRM_MODE_OBJECT_PLANE, plane_id,
+					plane_props[k]);
+			sink += kms_get_prop_id(props,
+				DRM_MODE_OBJECT_CRTC, crtc_id, "MODE_ID");
+			sink += kms_get_prop_id(props,
+				DRM_MODE_OBJECT_CRTC, crtc_id, "ACTIVE");
+		}
+		bench_add(bench, start);
+	}
+}
+
+/* Create, map and add a mode sized frame buffer, then release it */
+static void bench_buffers(struct test_data *t_data, unsigned int iterations)
+{
+	struct bench *alloc = bench_new("buffer_alloc", iterations);
+	struct bench *release = bench_new("buffer_free", iterations);
+	drmModeModeInfoPtr mode = &t_data->output.con->modes[0];
+	int fd = t_data->dev.fd;
+	struct kms_buffer buffer;
+	unsigned int i;
+	double start;
+
+	for (i = 0; i < iterations; i++) {
+		memset(&buffer, 0, sizeof(struct kms_buffer));
+
+		start = kms_now_ns() / 1e3;
+		if (kms_add_buffer(fd, &buffer, mode->hdisplay, mode->vdisplay,
+			DRM_FORMAT_XRGB8888))
+			alloc->failed = 1;
+		bench_add(alloc, start);
+
+		start = kms_now_ns() / 1e3;
+		kms_put_buffer(fd, &buffer);
+		bench_add(release, start);
+	}
+}
+
+/* Draw test pattern into the scanout buffer */
+static void bench_fill(struct test_data *t_data, unsigned int iterations)
+{
+	struct bench *bench = bench_new("fill_pattern", iterations);
+	struct kms_buffer *buffer = &t_data->buffer;
+	unsigned int i;
+
+	bench->bytes = (size_t)buffer->dumb_buf.pitch * buffer->dumb_buf.height;
+
+	for (i = 0; i < iterations; i++) {
+		double start = kms_now_ns() / 1e3;
+
+		kms_fill_buffer(buffer, KMS_FILL_TILES);
+		bench_add(bench, start);
+	}
+}
+
+/* Build the full modeset request */
+static void
+bench_atomic_build(struct test_data *t_data, uint32_t mode_blob_id,
+	unsigned int iterations)
+{
+	struct bench *bench = bench_new("atomic_build", iterations);
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++) {
+		double start = kms_now_ns() / 1e3;
+
+		drmModeAtomicSetCursor(t_data->atomic_ptr, 0);
+		kms_add_modeset(&t_data->dev, t_data->atomic_ptr,
+			&t_data->output, &t_data->buffer, mode_blob_id);
+		bench_add(bench, start);
+	}
+
+	bench->ops = drmModeAtomicGetCursor(t_data->atomic_ptr);
+}
+
+/* Validate the full modeset request in kernel without applying it */
+static void bench_commit_test(struct test_data *t_data, unsigned int iterations)
+{
+	struct bench *bench = bench_new("commit_test_only", iterations);
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++) {
+		double start = kms_now_ns() / 1e3;
+
+		if (drmModeAtomicCommit(t_data->dev.fd, t_data->atomic_ptr,
+			DRM_MODE_ATOMIC_TEST_ONLY |
+			DRM_MODE_ATOMIC_ALLOW_MODESET, NULL))
+			bench->failed = 1;
+		bench_add(bench, start);
+	}
+}
+
+static void
+page_flip_handler(int fd, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+	int *pending = user_data;
+
+	*pending = 0;
+}
+
+/*
+ * Flip between two frame buffers. Submission measures how long a
+ * non-blocking commit takes to return, round-trip how long until its
+ * page flip event arrives.
+ */
+static void
+bench_flip(struct test_data *t_data, struct kms_buffer *back,
+	unsigned int iterations)
+{
+	struct bench *submit = bench_new("commit_submit", iterations);
+	struct bench *roundtrip = bench_new("flip_roundtrip", iterations);
+	struct kms_buffer *buffer[2] = { &t_data->buffer, back };
+	uint32_t plane_id = t_data->output.plane->plane_id;
+	uint32_t fb_prop_id = kms_get_prop_id(t_data->dev.prop_ptr,
+		DRM_MODE_OBJECT_PLANE, plane_id, "FB_ID");
+	struct pollfd pfd = { .fd = t_data->dev.fd, .events = POLLIN };
+	drmEventContext evt_ctx;
+	unsigned int i;
+	int pending;
+
+	memset(&evt_ctx, 0, sizeof(drmEventContext));
+	evt_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evt_ctx.page_flip_handler = page_flip_handler;
+
+	for (i = 0; i < iterations; i++) {
+		double start;
+
+		drmModeAtomicSetCursor(t_data->atomic_ptr, 0);
+		drmModeAtomicAddProperty(t_data->atomic_ptr, plane_id,
+			fb_prop_id, buffer[(i + 1) & 1]->buf_id);
+
+		pending = 1;
+		start = kms_now_ns() / 1e3;
+		if (drmModeAtomicCommit(t_data->dev.fd, t_data->atomic_ptr,
+			DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+			&pending)) {
+			submit->failed = roundtrip->failed = 1;
+			return;
+		}
+		bench_add(submit, start);
+
+		while (pending) {
+			if (poll(&pfd, 1, FLIP_TIMEOUT_MS) <= 0) {
+				roundtrip->failed = 1;
+				return;
+			}
+			drmHandleEvent(t_data->dev.fd, &evt_ctx);
+		}
+		bench_add(roundtrip, start);
+	}
+}
+
+/*
+ * Non-interactive benchmark of the present pipeline. Runs each stage a
+ * fixed number of times and prints results as JSON on stdout.
+ *
+ * usage: test_bench <driver name | device path> [iterations]
+ */
+int main(int argc, char *argv[])
+{
+	struct test_data t_data;
+	struct kms_buffer back;
+	int i;
+	int fd;
+	uint32_t mode_blob_id;
+	drmModeModeInfoPtr mode;
+	unsigned int iterations = 100;
+
+	/* Check if drm driver name or device node is provided by user */
+	if (argc < 2) {
+		fprintf(stderr, "missing drm driver name or device path\n");
+		return -1;
+	}
+
+	if (argc > 2)
+		iterations = atoi(argv[2]);
+	if (!iterations) {
+		fprintf(stderr, "invalid iteration count %s\n", argv[2]);
+		return -1;
+	}
+
+	memset(&t_data, 0, sizeof(struct test_data));
+
+	/*
+	 * A path selects the device node directly, e.g. a vkms instance
+	 * on a machine without display hardware. Benchmark covers the
+	 * atomic path only.
+	 */
+	if (kms_open(&t_data.dev, argv[1], KMS_OPEN_ATOMIC))
+		return -1;
+	fd = t_data.dev.fd;
+
+	/* Allocate drm atomic structure */
+	t_data.atomic_ptr = drmModeAtomicAlloc();
+
+	/* Find connector, encoder, crtc and plane to drive */
+	if (kms_get_output(&t_data.dev, &t_data.output, 1))
+		return -1;
+	mode = &t_data.output.con->modes[0];
+
+	/* Stages which don't touch display state */
+	bench_discovery(&t_data, iterations);
+	bench_lookup(&t_data, iterations);
+	bench_buffers(&t_data, iterations);
+
+	/* Front and back buffers at mode size */
+	memset(&back, 0, sizeof(struct kms_buffer));
+	if (kms_add_buffer(fd, &t_data.buffer, mode->hdisplay, mode->vdisplay,
+		DRM_FORMAT_XRGB8888) || kms_add_buffer(fd, &back,
+		mode->hdisplay, mode->vdisplay, DRM_FORMAT_XRGB8888))
+		return -1;
+	kms_fill_buffer(&t_data.buffer, KMS_FILL_TILES);
+	kms_fill_buffer(&back, KMS_FILL_TILES);
+	bench_fill(&t_data, iterations);
+
+	mode_blob_id = kms_blob_get(fd, &t_data.dev.blobs, mode,
+		sizeof(drmModeModeInfo));
+	bench_atomic_build(&t_data, mode_blob_id, iterations);
+	bench_commit_test(&t_data, iterations);
+
+	/* Mode set, then flip */
+	if (drmModeAtomicCommit(fd, t_data.atomic_ptr,
+		DRM_MODE_ATOMIC_ALLOW_MODESET, NULL))
+		fprintf(stderr, "mode set failed, skipping flips\n");
+	else
+		bench_flip(&t_data, &back, iterations);
+
+	printf("{\n  \"device\": \"%s\",\n", argv[1]);
+	printf("  \"mode\": \"%ux%u@%u\",\n", mode->hdisplay,
+		mode->vdisplay, mode->vrefresh);
+	printf("  \"iterations\": %u,\n  \"benchmarks\": [\n", iterations);
+	for (i = 0; i < n_benches; i++)
+		print_bench(&benches[i], i == n_benches - 1);
+	printf("  ]\n}\n");
+
+	kms_put_buffer(fd, &back);
+	kms_put_buffer(fd, &t_data.buffer);
+	drmModeAtomicFree(t_data.atomic_ptr);
+	kms_close(&t_data.dev);
+
+	return 0;
+}
@@ -0,0 +1,322 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+
+/* main data structure to store info retrieved from drm drivers */
+struct test_data {
+	struct kms_device dev;
+	struct kms_output output;
+	struct kms_buffer buffer;
+	drmModeAtomicReqPtr atomic_ptr;
+};
+
+static double srgb_decode(double x)
+{
+	return x <= 0.04045 ? x / 12.92 : pow((x + 0.055) / 1.055, 2.4);
+}
+
+static double srgb_encode(double x)
+{
+	if (x > 1.0)
+		x = 1.0;
+	return x <= 0.0031308 ? x * 12.92 : 1.055 * pow(x, 1 / 2.4) - 0.055;
+}
+
+static uint16_t lut_value(double x)
+{
+	return (uint16_t)(x * 0xffff + 0.5);
+}
+
+/* Degamma LUT decoding sRGB into linear light */
+static void fill_degamma_lut(struct drm_color_lut *lut, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		uint16_t v = lut_value(srgb_decode((double)i / (size - 1)));
+
+		lut[i].red = lut[i].green = lut[i].blue = v;
+		lut[i].reserved = 0;
+	}
+}
+
+/*
+ * Gamma LUT applying per channel gains in linear light, then encoding
+ * back into sRGB. Without degamma stage, input is still sRGB encoded.
+ */
+static void
+fill_gamma_lut(struct drm_color_lut *lut, int size, int linear_input,
+	double gain_r, double gain_g, double gain_b)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		double x = (double)i / (size - 1);
+
+		if (!linear_input)
+			x = srgb_decode(x);
+
+		lut[i].red = lut_value(srgb_encode(x * gain_r));
+		lut[i].green = lut_value(srgb_encode(x * gain_g));
+		lut[i].blue = lut_value(srgb_encode(x * gain_b));
+		lut[i].reserved = 0;
+	}
+}
+
+/* CTM coefficients are S31.32 sign-magnitude fixed point */
+static uint64_t ctm_value(double v)
+{
+	uint64_t mag = (uint64_t)(fabs(v) * 4294967296.0 + 0.5);
+
+	return v < 0 ? mag | (1ull << 63) : mag;
+}
+
+/* Matrix blending between identity (1.0) and luminance only (0.0) */
+static void fill_saturation_ctm(struct drm_color_ctm *ctm, double saturation)
+{
+	static const double luma[3] = { 0.2126, 0.7152, 0.0722 };
+	int row, col;
+
+	for (row = 0; row < 3; row++) {
+		for (col = 0; col < 3; col++) {
+			double v = (1 - saturation) * luma[col];
+
+			if (row == col)
+				v += saturation;
+			ctm->matrix[row * 3 + col] = ctm_value(v);
+		}
+	}
+}
+
+/* Color correction parameters, quantized so that transitions repeat */
+struct color_state {
+	double brightness;	/* 0..1 */
+	double warmth;		/* 0: 6500K, 1: ~3000K */
+	double saturation;	/* 0..1 */
+};
+
+#define COLOR_STEPS 32
+#define PHASE_FRAMES (2 * COLOR_STEPS)
+
+/*
+ * Triangle wave through brightness, then warmth, then saturation. Every
+ * value is visited going down and back up, so the second half of each
+ * phase is served from blob cache.
+ */
+static void get_color_state(struct color_state *state, unsigned int frame)
+{
+	unsigned int phase = (frame / PHASE_FRAMES) % 3;
+	unsigned int pos = frame % PHASE_FRAMES;
+	double level = (double)(pos < COLOR_STEPS ?
+		pos : PHASE_FRAMES - pos) / COLOR_STEPS;
+
+	state->brightness = 1.0;
+	state->warmth = 0.0;
+	state->saturation = 1.0;
+
+	if (phase == 0)
+		state->brightness = 1.0 - 0.75 * level;
+	else if (phase == 1)
+		state->warmth = level;
+	else
+		state->saturation = 1.0 - level;
+}
+
+/* Blobs referenced by crtc color state */
+struct color_blobs {
+	uint32_t degamma;
+	uint32_t ctm;
+	uint32_t gamma;
+};
+
+static void put_color_blobs(struct test_data *t_data, struct color_blobs *blobs)
+{
+	kms_blob_put(&t_data->dev.blobs, blobs->degamma);
+	kms_blob_put(&t_data->dev.blobs, blobs->ctm);
+	kms_blob_put(&t_data->dev.blobs, blobs->gamma);
+	memset(blobs, 0, sizeof(struct color_blobs));
+}
+
+/*
+ * Add color properties of a state to atomic request. Blobs it uses are
+ * returned referenced in blobs.
+ */
+static void
+add_color_properties(struct test_data *t_data, struct color_state *state,
+	int gamma_size, int degamma_size, int has_ctm,
+	struct color_blobs *blobs)
+{
+	struct kms_device *dev = &t_data->dev;
+	uint32_t crtc_id = t_data->output.crtc->crtc_id;
+	struct drm_color_lut *lut;
+	struct drm_color_ctm ctm;
+	int size = gamma_size > degamma_size ? gamma_size : degamma_size;
+
+	memset(blobs, 0, sizeof(struct color_blobs));
+	lut = malloc(size * sizeof(struct drm_color_lut));
+
+	if (degamma_size) {
+		fill_degamma_lut(lut, degamma_size);
+		blobs->degamma = kms_blob_get(dev->fd, &dev->blobs, lut,
+			degamma_size * sizeof(struct drm_color_lut));
+		kms_add_property(dev, t_data->atomic_ptr, DRM_MODE_OBJECT_CRTC,
+			crtc_id, "DEGAMMA_LUT", blobs->degamma);
+	}
+
+	if (has_ctm) {
+		fill_saturation_ctm(&ctm, state->saturation);
+		blobs->ctm = kms_blob_get(dev->fd, &dev->blobs, &ctm,
+			sizeof(ctm));
+		kms_add_property(dev, t_data->atomic_ptr, DRM_MODE_OBJECT_CRTC,
+			crtc_id, "CTM", blobs->ctm);
+	}
+
+	if (gamma_size) {
+		/* 3000K white point is roughly (1.0, 0.71, 0.42) */
+		fill_gamma_lut(lut, gamma_size, degamma_size != 0,
+			state->brightness,
+			state->brightness * (1.0 - 0.29 * state->warmth),
+			state->brightness * (1.0 - 0.58 * state->warmth));
+		blobs->gamma = kms_blob_get(dev->fd, &dev->blobs, lut,
+			gamma_size * sizeof(struct drm_color_lut));
+		kms_add_property(dev, t_data->atomic_ptr, DRM_MODE_OBJECT_CRTC,
+			crtc_id, "GAMMA_LUT", blobs->gamma);
+	}
+
+	free(lut);
+}
+
+static void
+page_flip_handler(int fd, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+	int *pending = user_data;
+
+	*pending = 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_data t_data;
+	int fd;
+	uint32_t mode_blob_id;
+	drmModeAtomicReqPtr atomic_ptr;
+	drmModeConnectorPtr active_con;
+	drmModeCrtcPtr active_crtc;
+	drmEventContext evt_ctx;
+	struct color_state state;
+	struct color_blobs cur_blobs, new_blobs;
+	struct kms_properties *props;
+	unsigned int frame;
+	int gamma_size, degamma_size, has_ctm;
+	int pending = 0;
+
+	/* Check if drm driver name is provided by user */
+	if (argc < 2) {
+		printf("missing drm driver name\n");
+		return -1;
+	}
+
+	memset(&t_data, 0, sizeof(struct test_data));
+
+	/*
+	 * Open drm device node /dev/dri/cardX with atomic commit enabled,
+	 * and discover its resources and properties.
+	 */
+	if (kms_open(&t_data.dev, argv[1], KMS_OPEN_ATOMIC))
+		return -1;
+	fd = t_data.dev.fd;
+	props = t_data.dev.prop_ptr;
+
+	/* Allocate drm atomic structure */
+	atomic_ptr = drmModeAtomicAlloc();
+	t_data.atomic_ptr = atomic_ptr;
+
+	/* Find a connector, encoder, crtc and plane */
+	if (kms_get_output(&t_data.dev, &t_data.output, 1))
+		return -1;
+	active_con = t_data.output.con;
+	active_crtc = t_data.output.crtc;
+
+	/* Report footprint of discovered metadata */
+	kms_arena_report(&t_data.dev.arena);
+
+	/* Find out which color management stages crtc has */
+	gamma_size = kms_get_prop_value(props, DRM_MODE_OBJECT_CRTC,
+		active_crtc->crtc_id, "GAMMA_LUT_SIZE", 0);
+	degamma_size = kms_get_prop_value(props, DRM_MODE_OBJECT_CRTC,
+		active_crtc->crtc_id, "DEGAMMA_LUT_SIZE", 0);
+	has_ctm = kms_get_prop_id(props, DRM_MODE_OBJECT_CRTC,
+		active_crtc->crtc_id, "CTM") != 0;
+	printf("gamma lut %d, degamma lut %d, ctm %s\n",
+		gamma_size, degamma_size, has_ctm ? "yes" : "no");
+	if (!gamma_size && !has_ctm) {
+		printf("crtc has no color management\n");
+		return -1;
+	}
+
+	/* Acquire a frame buffer and add it to drm */
+	if (kms_add_buffer(fd, &t_data.buffer, active_con->modes[0].hdisplay,
+		active_con->modes[0].vdisplay, DRM_FORMAT_XRGB8888))
+		return -1;
+	kms_fill_buffer(&t_data.buffer, KMS_FILL_TILES);
+
+	/* Atomic commit and mode set, starting with neutral color state */
+	mode_blob_id = kms_blob_get(fd, &t_data.dev.blobs, active_con->modes,
+		sizeof(drmModeModeInfo));
+	kms_add_modeset(&t_data.dev, atomic_ptr, &t_data.output, &t_data.buffer,
+		mode_blob_id);
+	get_color_state(&state, 0);
+	add_color_properties(&t_data, &state, gamma_size, degamma_size,
+		has_ctm, &cur_blobs);
+	drmModeAtomicCommit(fd, atomic_ptr, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+
+	/* Setup page flip event handler  */
+	memset(&evt_ctx, 0, sizeof(drmEventContext));
+	evt_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evt_ctx.page_flip_handler = page_flip_handler;
+
+	/*
+	 * Step color state once per frame with non-blocking commits which
+	 * only carry color properties. Exit if user presses a key.
+	 */
+	for (frame = 1; ; frame++) {
+		get_color_state(&state, frame);
+
+		drmModeAtomicSetCursor(atomic_ptr, 0);
+		add_color_properties(&t_data, &state, gamma_size, degamma_size,
+			has_ctm, &new_blobs);
+		if (drmModeAtomicCommit(fd, atomic_ptr,
+			DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+			&pending)) {
+			put_color_blobs(&t_data, &new_blobs);
+			break;
+		}
+
+		/* Crtc now references the new blobs instead */
+		put_color_blobs(&t_data, &cur_blobs);
+		cur_blobs = new_blobs;
+
+		pending = 1;
+		while (pending) {
+			if (kms_wait_events(fd, &evt_ctx, -1, 1) <= 0)
+				goto done;
+		}
+	}
+
+done:
+	printf("%u color updates\n", frame);
+	kms_blob_report(&t_data.dev.blobs);
+
+	/* Release blobs and all discovered metadata at once */
+	kms_close(&t_data.dev);
+
+	return 0;
+}
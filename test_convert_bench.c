@@ -0,0 +1,617 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+#include "kms_convert.h"
+
+/* Iterations per benchmark case */
+#define N_ITERATIONS 20
+
+/* Upper bound of row band threads */
+#define MAX_THREADS 16
+
+/* Row pitch alignment, like dumb buffer pitches */
+#define PITCH_ALIGN 64
+
+/* Odd sizes so that vector loop tails and edge blocks are checked too */
+#define CHECK_WIDTH 1283
+#define CHECK_HEIGHT 723
+
+/* One conversion over rows [y0, y1) */
+struct convert_job {
+	int encode;		/* XRGB8888 to NV12, else YUV to XRGB8888 */
+	struct kms_yuv_frame *yuv;
+	uint8_t *rgb;
+	unsigned int rgb_stride;
+	unsigned int y0, y1;
+	enum kms_color_encoding encoding;
+	enum kms_color_range range;
+};
+
+static const char *const page_names[] = {
+	[KMS_PAGES_BASE] = "base pages",
+	[KMS_PAGES_TRANSPARENT] = "transparent huge pages",
+	[KMS_PAGES_EXPLICIT] = "hugetlb pages",
+};
+
+/* Page size backing the last staging allocation */
+static enum kms_page_type page_type;
+
+static const char *format_name(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_NV12:
+		return "NV12";
+	case DRM_FORMAT_YUV420:
+		return "I420";
+	case DRM_FORMAT_YUYV:
+		return "YUYV";
+	}
+
+	return "?";
+}
+
+static unsigned int align_pitch(unsigned int bytes)
+{
+	return (bytes + PITCH_ALIGN - 1) & ~(PITCH_ALIGN - 1);
+}
+
+/* Return 0 on success, -1 if memory can't be allocated */
+static int alloc_yuv(struct kms_yuv_frame *yuv, uint32_t format,
+	unsigned int width, unsigned int height)
+{
+	unsigned int cw = (width + 1) / 2;
+	unsigned int ch = (height + 1) / 2;
+	unsigned int rows[3] = { height, ch, ch };
+	int n_planes;
+	int i;
+
+	memset(yuv, 0, sizeof(struct kms_yuv_frame));
+	yuv->format = format;
+	yuv->width = width;
+	yuv->height = height;
+
+	switch (format) {
+	case DRM_FORMAT_NV12:
+		yuv->stride[0] = align_pitch(width);
+		yuv->stride[1] = align_pitch(cw * 2);
+		n_planes = 2;
+		break;
+	case DRM_FORMAT_YUV420:
+		yuv->stride[0] = align_pitch(width);
+		yuv->stride[1] = align_pitch(cw);
+		yuv->stride[2] = align_pitch(cw);
+		n_planes = 3;
+		break;
+	default:
+		yuv->stride[0] = align_pitch(cw * 4);
+		n_planes = 1;
+		break;
+	}
+
+	/* Staging memory is zeroed and prefaulted, on huge pages if any */
+	for (i = 0; i < n_planes; i++) {
+		yuv->plane[i] = kms_alloc_huge((size_t)yuv->stride[i] * rows[i],
+			&page_type);
+		if (!yuv->plane[i])
+			return -1;
+	}
+
+	return 0;
+}
+
+static void free_yuv(struct kms_yuv_frame *yuv)
+{
+	unsigned int ch = (yuv->height + 1) / 2;
+	unsigned int rows[3] = { yuv->height, ch, ch };
+	int i;
+
+	for (i = 0; i < 3; i++)
+		kms_free_huge(yuv->plane[i], (size_t)yuv->stride[i] * rows[i]);
+}
+
+/* Deterministic noise, so every run checks the same content */
+static void fill_random(uint8_t *mem, size_t size, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		mem[i] = seed >> 16;
+	}
+}
+
+static void fill_random_yuv(struct kms_yuv_frame *yuv)
+{
+	unsigned int ch = (yuv->height + 1) / 2;
+	int i;
+
+	fill_random(yuv->plane[0], (size_t)yuv->stride[0] * yuv->height, 1);
+	for (i = 1; i < 3; i++) {
+		if (yuv->plane[i])
+			fill_random(yuv->plane[i], (size_t)yuv->stride[i] * ch,
+				i + 1);
+	}
+}
+
+static void get_weights(enum kms_color_encoding encoding,
+	enum kms_color_range range, double *kr, double *kb,
+	double *ys, double *cs)
+{
+	*kr = encoding == KMS_COLOR_BT709 ? 0.2126 : 0.299;
+	*kb = encoding == KMS_COLOR_BT709 ? 0.0722 : 0.114;
+	*ys = range == KMS_RANGE_LIMITED ? 219.0 / 255.0 : 1.0;
+	*cs = range == KMS_RANGE_LIMITED ? 224.0 / 255.0 : 1.0;
+}
+
+static int round_clamp(double v)
+{
+	int i = (int)floor(v + 0.5);
+
+	return i < 0 ? 0 : (i > 255 ? 255 : i);
+}
+
+/* Y, Cb and Cr sampled for pixel (x, y), same siting as the kernels */
+static void
+sample_yuv(const struct kms_yuv_frame *yuv, unsigned int x, unsigned int y,
+	int *Y, int *U, int *V)
+{
+	const uint8_t *row = yuv->plane[0] + (size_t)y * yuv->stride[0];
+
+	switch (yuv->format) {
+	case DRM_FORMAT_NV12:
+		row = yuv->plane[1] + (size_t)(y / 2) * yuv->stride[1];
+		*U = row[x / 2 * 2];
+		*V = row[x / 2 * 2 + 1];
+		row = yuv->plane[0] + (size_t)y * yuv->stride[0];
+		*Y = row[x];
+		break;
+	case DRM_FORMAT_YUV420:
+		*Y = row[x];
+		*U = yuv->plane[1][(size_t)(y / 2) * yuv->stride[1] + x / 2];
+		*V = yuv->plane[2][(size_t)(y / 2) * yuv->stride[2] + x / 2];
+		break;
+	default:
+		*Y = row[x * 2];
+		*U = row[x / 2 * 4 + 1];
+		*V = row[x / 2 * 4 + 3];
+		break;
+	}
+}
+
+/*
+ * Compare kernel output against a double precision reference. Return
+ * largest difference of any component.
+ */
+static int check_decode(const struct kms_yuv_frame *yuv, const uint8_t *rgb,
+	unsigned int rgb_stride, enum kms_color_encoding encoding,
+	enum kms_color_range range)
+{
+	double kr, kb, kg, ys, cs;
+	int max_err = 0;
+	unsigned int x, y;
+
+	get_weights(encoding, range, &kr, &kb, &ys, &cs);
+	kg = 1.0 - kr - kb;
+
+	for (y = 0; y < yuv->height; y++) {
+		const uint32_t *row = (const uint32_t *)(rgb +
+			(size_t)y * rgb_stride);
+
+		for (x = 0; x < yuv->width; x++) {
+			int Y, U, V, ref[3], out[3], i;
+			double yf, uf, vf;
+
+			sample_yuv(yuv, x, y, &Y, &U, &V);
+			yf = (Y - (range == KMS_RANGE_LIMITED ? 16 : 0)) / ys;
+			uf = (U - 128) / cs;
+			vf = (V - 128) / cs;
+
+			ref[0] = round_clamp(yf + 2 * (1 - kr) * vf);
+			ref[1] = round_clamp(yf - 2 * kb * (1 - kb) / kg * uf -
+				2 * kr * (1 - kr) / kg * vf);
+			ref[2] = round_clamp(yf + 2 * (1 - kb) * uf);
+			out[0] = (row[x] >> 16) & 0xff;
+			out[1] = (row[x] >> 8) & 0xff;
+			out[2] = row[x] & 0xff;
+
+			for (i = 0; i < 3; i++) {
+				if (abs(out[i] - ref[i]) > max_err)
+					max_err = abs(out[i] - ref[i]);
+			}
+		}
+	}
+
+	return max_err;
+}
+
+static int check_encode(const struct kms_yuv_frame *yuv, const uint8_t *rgb,
+	unsigned int rgb_stride, enum kms_color_encoding encoding,
+	enum kms_color_range range)
+{
+	double kr, kb, kg, ys, cs;
+	int y_offset = range == KMS_RANGE_LIMITED ? 16 : 0;
+	int max_err = 0;
+	unsigned int x, y, i;
+
+	get_weights(encoding, range, &kr, &kb, &ys, &cs);
+	kg = 1.0 - kr - kb;
+
+	for (y = 0; y < yuv->height; y += 2) {
+		for (x = 0; x < yuv->width; x += 2) {
+			unsigned int px[4] = { x, x + 1, x, x + 1 };
+			unsigned int py[4] = { y, y, y + 1, y + 1 };
+			double r = 0, g = 0, b = 0, l;
+			const uint8_t *uv;
+			int ref, err;
+
+			/* Edge blocks repeat the last column or row */
+			for (i = 0; i < 4; i++) {
+				uint32_t p;
+
+				if (px[i] >= yuv->width)
+					px[i] = yuv->width - 1;
+				if (py[i] >= yuv->height)
+					py[i] = yuv->height - 1;
+				p = ((const uint32_t *)(rgb + (size_t)py[i] *
+					rgb_stride))[px[i]];
+
+				l = kr * ((p >> 16) & 0xff) +
+					kg * ((p >> 8) & 0xff) + kb * (p & 0xff);
+				ref = round_clamp(y_offset + ys * l);
+				err = abs(yuv->plane[0][(size_t)py[i] *
+					yuv->stride[0] + px[i]] - ref);
+				if (err > max_err)
+					max_err = err;
+
+				r += ((p >> 16) & 0xff) / 4.0;
+				g += ((p >> 8) & 0xff) / 4.0;
+				b += (p & 0xff) / 4.0;
+			}
+
+			l = kr * r + kg * g + kb * b;
+			uv = yuv->plane[1] + (size_t)(y / 2) * yuv->stride[1] + x;
+			err = abs(uv[0] - round_clamp(128 +
+				cs * (b - l) / (2 * (1 - kb))));
+			if (err > max_err)
+				max_err = err;
+			err = abs(uv[1] - round_clamp(128 +
+				cs * (r - l) / (2 * (1 - kr))));
+			if (err > max_err)
+				max_err = err;
+		}
+	}
+
+	return max_err;
+}
+
+static void run_job(struct convert_job *job)
+{
+	if (job->encode)
+		kms_xrgb_to_nv12(job->yuv, job->rgb, job->rgb_stride,
+			job->y0, job->y1, job->encoding, job->range);
+	else
+		kms_yuv_to_xrgb(job->yuv, job->rgb, job->rgb_stride,
+			job->y0, job->y1, job->encoding, job->range);
+}
+
+static void *band_worker(void *arg)
+{
+	run_job(arg);
+
+	return NULL;
+}
+
+/*
+ * Split job into n_threads bands of even row count, last band runs on
+ * calling thread.
+ */
+static void convert_bands(struct convert_job *job, int n_threads)
+{
+	struct convert_job band[MAX_THREADS];
+	pthread_t thread[MAX_THREADS];
+	unsigned int height = job->yuv->height;
+	unsigned int rows = ((height + n_threads - 1) / n_threads + 1) & ~1u;
+	int i;
+
+	for (i = 0; i < n_threads; i++) {
+		band[i] = *job;
+		band[i].y0 = i * rows < height ? i * rows : height;
+		band[i].y1 = band[i].y0 + rows < height ?
+			band[i].y0 + rows : height;
+		if (i < n_threads - 1)
+			pthread_create(&thread[i], NULL, band_worker, &band[i]);
+	}
+	run_job(&band[n_threads - 1]);
+
+	for (i = 0; i < n_threads - 1; i++)
+		pthread_join(thread[i], NULL);
+}
+
+/* Check every format, encoding and range. Return number of failures. */
+static int run_accuracy(void)
+{
+	static const uint32_t formats[] = {
+		DRM_FORMAT_NV12, DRM_FORMAT_YUV420, DRM_FORMAT_YUYV,
+	};
+	static const char *encodings[] = { "BT.601", "BT.709" };
+	static const char *ranges[] = { "limited", "full" };
+	unsigned int stride = align_pitch(CHECK_WIDTH * 4);
+	struct kms_yuv_frame yuv;
+	struct convert_job job;
+	int failures = 0;
+	uint8_t *rgb;
+	int e, r, f, err;
+
+	rgb = kms_alloc_huge((size_t)stride * CHECK_HEIGHT, &page_type);
+	if (!rgb)
+		return 1;
+
+	memset(&job, 0, sizeof(job));
+	job.rgb = rgb;
+	job.rgb_stride = stride;
+	job.y1 = CHECK_HEIGHT;
+
+	for (e = KMS_COLOR_BT601; e <= KMS_COLOR_BT709; e++) {
+		for (r = KMS_RANGE_LIMITED; r <= KMS_RANGE_FULL; r++) {
+			job.encoding = e;
+			job.range = r;
+
+			for (f = 0; f < 3; f++) {
+				if (alloc_yuv(&yuv, formats[f], CHECK_WIDTH,
+					CHECK_HEIGHT))
+					return failures + 1;
+				fill_random_yuv(&yuv);
+
+				/* Banded output must match the reference too */
+				job.encode = 0;
+				job.yuv = &yuv;
+				convert_bands(&job, 3);
+				err = check_decode(&yuv, rgb, stride, e, r);
+				failures += err > 1;
+				printf("check %s to XRGB8888 %s %s: "
+					"max error %d %s\n",
+					format_name(formats[f]), encodings[e],
+					ranges[r], err, err > 1 ? "FAIL" : "ok");
+				free_yuv(&yuv);
+			}
+
+			if (alloc_yuv(&yuv, DRM_FORMAT_NV12, CHECK_WIDTH,
+				CHECK_HEIGHT))
+				return failures + 1;
+			fill_random(rgb, (size_t)stride * CHECK_HEIGHT, 7);
+			job.encode = 1;
+			job.yuv = &yuv;
+			convert_bands(&job, 3);
+			err = check_encode(&yuv, rgb, stride, e, r);
+			failures += err > 1;
+			printf("check XRGB8888 to NV12 %s %s: max error %d %s\n",
+				encodings[e], ranges[r], err,
+				err > 1 ? "FAIL" : "ok");
+			free_yuv(&yuv);
+		}
+	}
+
+	kms_free_huge(rgb, (size_t)stride * CHECK_HEIGHT);
+
+	return failures;
+}
+
+/* Source pixel shown at (x, y) of dst, per plane rotation semantics */
+static uint32_t rotated_pixel(const uint32_t *src, unsigned int pitch,
+	unsigned int width, unsigned int height, uint32_t rotation,
+	unsigned int x, unsigned int y)
+{
+	unsigned int ix, iy;
+
+	switch (rotation & DRM_MODE_ROTATE_MASK) {
+	case DRM_MODE_ROTATE_90:
+		ix = width - 1 - y;
+		iy = x;
+		break;
+	case DRM_MODE_ROTATE_180:
+		ix = width - 1 - x;
+		iy = height - 1 - y;
+		break;
+	case DRM_MODE_ROTATE_270:
+		ix = y;
+		iy = height - 1 - x;
+		break;
+	default:
+		ix = x;
+		iy = y;
+		break;
+	}
+	if (rotation & DRM_MODE_REFLECT_X)
+		ix = width - 1 - ix;
+	if (rotation & DRM_MODE_REFLECT_Y)
+		iy = height - 1 - iy;
+
+	return src[(size_t)iy * pitch + ix];
+}
+
+/* Per pixel rotation, reference and baseline for the tiled kernel */
+static void rotate_naive(uint32_t *dst, unsigned int dst_pitch,
+	const uint32_t *src, unsigned int src_pitch, unsigned int width,
+	unsigned int height, uint32_t rotation)
+{
+	int transposed = rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270);
+	unsigned int dst_w = transposed ? height : width;
+	unsigned int dst_h = transposed ? width : height;
+	unsigned int x, y;
+
+	for (y = 0; y < dst_h; y++)
+		for (x = 0; x < dst_w; x++)
+			dst[(size_t)y * dst_pitch + x] = rotated_pixel(src,
+				src_pitch, width, height, rotation, x, y);
+}
+
+/* Check every rotation and reflection. Return number of failures. */
+static int run_rotation_accuracy(void)
+{
+	static const uint32_t rotations[] = {
+		DRM_MODE_ROTATE_0, DRM_MODE_ROTATE_90,
+		DRM_MODE_ROTATE_180, DRM_MODE_ROTATE_270,
+	};
+	static const char *const reflections[] = {
+		"", " reflect-x", " reflect-y", " reflect-xy",
+	};
+	unsigned int pitch = align_pitch(CHECK_WIDTH * 4) / 4;
+	size_t size = (size_t)pitch * 4 * CHECK_WIDTH;
+	uint32_t *src, *dst, *ref;
+	int failures = 0;
+	int r, f;
+
+	src = kms_alloc_huge(size, &page_type);
+	dst = kms_alloc_huge(size, &page_type);
+	ref = kms_alloc_huge(size, &page_type);
+	if (!src || !dst || !ref)
+		return 1;
+	fill_random((uint8_t *)src, (size_t)pitch * 4 * CHECK_HEIGHT, 11);
+
+	for (r = 0; r < 4; r++) {
+		for (f = 0; f < 4; f++) {
+			uint32_t rotation = rotations[r] |
+				(f & 1 ? DRM_MODE_REFLECT_X : 0) |
+				(f & 2 ? DRM_MODE_REFLECT_Y : 0);
+			int err;
+
+			rotate_naive(ref, pitch, src, pitch, CHECK_WIDTH,
+				CHECK_HEIGHT, rotation);
+			kms_rotate_xrgb(dst, pitch * 4, src, pitch * 4,
+				CHECK_WIDTH, CHECK_HEIGHT, rotation);
+			err = memcmp(dst, ref, size) != 0;
+			failures += err;
+			printf("check rotate-%d%s: %s\n", r * 90,
+				reflections[f], err ? "FAIL" : "ok");
+		}
+	}
+
+	kms_free_huge(src, size);
+	kms_free_huge(dst, size);
+	kms_free_huge(ref, size);
+
+	return failures;
+}
+
+static void report(const char *name, int n_threads, double total_ms,
+	unsigned int width, unsigned int height)
+{
+	double ms = total_ms / N_ITERATIONS;
+	double mpix = (double)width * height / 1e6;
+
+	printf("%-24s %2d threads %8.3f ms/frame %9.1f Mpix/s\n", name,
+		n_threads, ms, ms > 0 ? mpix * 1e3 / ms : 0);
+}
+
+/* Time every kernel on 1 thread and on n_threads row bands */
+static int run_throughput(unsigned int width, unsigned int height,
+	int n_threads)
+{
+	static const uint32_t formats[] = {
+		DRM_FORMAT_NV12, DRM_FORMAT_YUV420, DRM_FORMAT_YUYV,
+	};
+	unsigned int stride = align_pitch(width * 4);
+	unsigned int rotated_stride = align_pitch(height * 4);
+	struct kms_yuv_frame yuv;
+	struct convert_job job;
+	char name[32];
+	uint8_t *rgb;
+	uint32_t *rotated;
+	double start;
+	int threads[2] = { 1, n_threads };
+	int f, t, i;
+
+	rgb = kms_alloc_huge((size_t)stride * height, &page_type);
+	if (!rgb)
+		return -1;
+	fill_random(rgb, (size_t)stride * height, 7);
+
+	memset(&job, 0, sizeof(job));
+	job.rgb = rgb;
+	job.rgb_stride = stride;
+	job.encoding = KMS_COLOR_BT709;
+	job.range = KMS_RANGE_LIMITED;
+
+	for (f = 0; f <= 3; f++) {
+		if (alloc_yuv(&yuv, f < 3 ? formats[f] : DRM_FORMAT_NV12,
+			width, height))
+			return -1;
+		fill_random_yuv(&yuv);
+
+		job.encode = f == 3;
+		job.yuv = &yuv;
+		if (job.encode)
+			snprintf(name, sizeof(name), "XRGB8888 to NV12");
+		else
+			snprintf(name, sizeof(name), "%s to XRGB8888",
+				format_name(formats[f]));
+
+		for (t = 0; t < (n_threads > 1 ? 2 : 1); t++) {
+			start = kms_now_ns() / 1e6;
+			for (i = 0; i < N_ITERATIONS; i++)
+				convert_bands(&job, threads[t]);
+			report(name, threads[t], kms_now_ns() / 1e6 - start,
+				width, height);
+		}
+		free_yuv(&yuv);
+	}
+
+	/* Portrait panel fallback, tiled kernel against per pixel loop */
+	rotated = kms_alloc_huge((size_t)rotated_stride * width, &page_type);
+	if (!rotated)
+		return -1;
+	start = kms_now_ns() / 1e6;
+	for (i = 0; i < N_ITERATIONS; i++)
+		rotate_naive(rotated, rotated_stride / 4, (uint32_t *)rgb,
+			stride / 4, width, height, DRM_MODE_ROTATE_90);
+	report("rotate-90 per pixel", 1, kms_now_ns() / 1e6 - start, width,
+		height);
+	start = kms_now_ns() / 1e6;
+	for (i = 0; i < N_ITERATIONS; i++)
+		kms_rotate_xrgb(rotated, rotated_stride, rgb, stride, width,
+			height, DRM_MODE_ROTATE_90);
+	report("rotate-90 tiled", 1, kms_now_ns() / 1e6 - start, width,
+		height);
+	kms_free_huge(rotated, (size_t)rotated_stride * width);
+
+	kms_free_huge(rgb, (size_t)stride * height);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int width = 3840, height = 2160;
+	int n_threads = 4;
+	int failures;
+
+	if (argc > 2) {
+		width = atoi(argv[1]);
+		height = atoi(argv[2]);
+	}
+	if (argc > 3)
+		n_threads = atoi(argv[3]);
+	if (!width || !height || n_threads < 1 || n_threads > MAX_THREADS) {
+		printf("usage: %s [width height [threads]]\n", argv[0]);
+		return -1;
+	}
+
+	/* Accuracy against double precision reference, then throughput */
+	failures = run_accuracy();
+	failures += run_rotation_accuracy();
+
+	printf("%ux%u, BT.709 limited range, staging on %s\n", width, height,
+		page_names[page_type]);
+	if (run_throughput(width, height, n_threads))
+		printf("can't allocate benchmark buffers\n");
+
+	return failures ? 1 : 0;
+}
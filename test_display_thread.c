@@ -0,0 +1,312 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+
+/* Number of frame buffers in render pool */
+#define N_BUFFERS 4
+
+/* Queue capacity, power of 2 and at least N_BUFFERS */
+#define QUEUE_SIZE 8
+
+/*
+ * Lock-free single producer single consumer queue of buffer indices.
+ * head is only written by consumer, tail only by producer. They sit on
+ * separate cache lines so both sides don't bounce the same line.
+ */
+struct spsc_queue {
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+	unsigned int slot[QUEUE_SIZE];
+};
+
+/* main data structure to store info retrieved from drm drivers */
+struct test_data {
+	struct kms_device dev;
+	struct kms_output output;
+
+	struct kms_buffer buffer[N_BUFFERS];
+
+	/* Producer to display thread: rendered frames */
+	struct spsc_queue ready_queue;
+	/* Display thread to producer: buffers off screen */
+	struct spsc_queue free_queue;
+	/* Wake ups for the consumer side of each queue */
+	int ready_evt_fd;
+	int free_evt_fd;
+
+	/* Keep only the newest ready frame, drop older ones */
+	int mailbox;
+	atomic_int quit;
+
+	/* Display thread state, only touched by display thread */
+	int scanout;
+	int pending;
+	unsigned int frames_shown;
+	unsigned int frames_dropped;
+
+	/* Producer state, only touched by producer thread */
+	unsigned int frames_rendered;
+};
+
+
+/* Return 0 on success, -1 if queue is full */
+static int spsc_push(struct spsc_queue *queue, unsigned int val)
+{
+	unsigned int tail = atomic_load_explicit(&queue->tail,
+		memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&queue->head,
+		memory_order_acquire);
+
+	if (tail - head == QUEUE_SIZE)
+		return -1;
+
+	queue->slot[tail & (QUEUE_SIZE - 1)] = val;
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+	return 0;
+}
+
+/* Return 0 on success, -1 if queue is empty */
+static int spsc_pop(struct spsc_queue *queue, unsigned int *val)
+{
+	unsigned int head = atomic_load_explicit(&queue->head,
+		memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&queue->tail,
+		memory_order_acquire);
+
+	if (head == tail)
+		return -1;
+
+	*val = queue->slot[head & (QUEUE_SIZE - 1)];
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+	return 0;
+}
+
+/* Signal consumer of a queue, never blocks */
+static void wake(int evt_fd)
+{
+	uint64_t one = 1;
+
+	write(evt_fd, &one, sizeof(one));
+}
+
+/* Consume pending wake ups */
+static void drain(int evt_fd)
+{
+	uint64_t count;
+
+	read(evt_fd, &count, sizeof(count));
+}
+
+/*
+ * Producer thread. Take a buffer off screen, render next frame into it
+ * and hand it over to display thread. Doesn't touch drm fd.
+ */
+static void *producer_thread(void *arg)
+{
+	struct test_data *t_data = arg;
+	struct kms_buffer *buffer;
+	unsigned int idx, frame;
+
+	while (!atomic_load(&t_data->quit)) {
+		if (spsc_pop(&t_data->free_queue, &idx)) {
+			drain(t_data->free_evt_fd);
+			continue;
+		}
+
+		buffer = &t_data->buffer[idx];
+		frame = ++t_data->frames_rendered;
+		kms_fill_frame(buffer, KMS_FILL_TILES, frame);
+
+		spsc_push(&t_data->ready_queue, idx);
+		wake(t_data->ready_evt_fd);
+	}
+
+	return NULL;
+}
+
+/* Give a buffer back to producer */
+static void release_buffer(struct test_data *t_data, int idx)
+{
+	spsc_push(&t_data->free_queue, idx);
+	wake(t_data->free_evt_fd);
+}
+
+/*
+ * Flip to next ready frame unless a flip is already pending. In mailbox
+ * mode frames older than the newest ready one are dropped.
+ */
+static void try_flip(struct test_data *t_data)
+{
+	uint32_t crtc_id = t_data->output.crtc->crtc_id;
+	unsigned int idx, newer;
+
+	if (t_data->pending >= 0 || spsc_pop(&t_data->ready_queue, &idx))
+		return;
+
+	while (t_data->mailbox && !spsc_pop(&t_data->ready_queue, &newer)) {
+		release_buffer(t_data, idx);
+		t_data->frames_dropped++;
+		idx = newer;
+	}
+
+	t_data->pending = idx;
+	kms_legacy_page_flip(&t_data->dev, crtc_id,
+		t_data->buffer[idx].buf_id, DRM_MODE_PAGE_FLIP_EVENT, t_data);
+}
+
+static void
+page_flip_handler(int fd, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+	struct test_data *t_data = user_data;
+
+	/* Pending buffer is on screen, previous one can be rendered into */
+	release_buffer(t_data, t_data->scanout);
+	t_data->scanout = t_data->pending;
+	t_data->pending = -1;
+	t_data->frames_shown++;
+
+	try_flip(t_data);
+}
+
+/*
+ * Display thread. Owns drm fd: flips ready frames and handles page flip
+ * events. Only ever waits in poll(), never on rendering.
+ */
+static void *display_thread(void *arg)
+{
+	struct test_data *t_data = arg;
+	drmEventContext evt_ctx;
+	struct pollfd fds[2];
+
+	memset(&evt_ctx, 0, sizeof(drmEventContext));
+	evt_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evt_ctx.page_flip_handler = page_flip_handler;
+
+	fds[0].fd = t_data->dev.fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = t_data->ready_evt_fd;
+	fds[1].events = POLLIN;
+
+	while (!atomic_load(&t_data->quit)) {
+		if (poll(fds, 2, -1) < 0)
+			continue;
+
+		if (fds[0].revents & POLLIN)
+			kms_handle_event(t_data->dev.fd, &evt_ctx);
+
+		if (fds[1].revents & POLLIN) {
+			drain(t_data->ready_evt_fd);
+			try_flip(t_data);
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_data t_data;
+	int i;
+	int fd;
+	drmModeConnectorPtr active_con;
+	drmModeCrtcPtr active_crtc;
+	struct kms_buffer *buffer;
+	struct kms_warmup warmup;
+	pthread_t producer, display;
+	long faults;
+
+	/* Check if drm driver name is provided by user */
+	if (argc < 2) {
+		printf("usage: %s <drm driver> [fifo|mailbox]\n", argv[0]);
+		return -1;
+	}
+
+	memset(&t_data, 0, sizeof(struct test_data));
+	t_data.mailbox = argc > 2 && !strcmp(argv[2], "mailbox");
+	t_data.pending = -1;
+
+	/*
+	 * Open drm device node /dev/dri/cardX, and discover its resources
+	 * and properties.
+	 */
+	if (kms_open(&t_data.dev, argv[1], 0))
+		return -1;
+	fd = t_data.dev.fd;
+
+	/* Find a connector, encoder and crtc */
+	if (kms_get_output(&t_data.dev, &t_data.output, 0))
+		return -1;
+	active_con = t_data.output.con;
+	active_crtc = t_data.output.crtc;
+
+	/* Report footprint of discovered metadata */
+	kms_arena_report(&t_data.dev.arena);
+
+	/* Acquire render pool, shadowed if write-combined, and add it to drm */
+	for (i = 0; i < N_BUFFERS; i++) {
+		t_data.buffer[i].flags = KMS_BUFFER_SHADOW;
+		kms_add_buffer(fd, &t_data.buffer[i],
+			active_con->modes[0].hdisplay,
+			active_con->modes[0].vdisplay, DRM_FORMAT_XRGB8888);
+	}
+
+	/*
+	 * Prefault the rest of the pool in background while 1st frame is
+	 * drawn and mode is set, so producer doesn't fault on them later.
+	 */
+	kms_warmup_start(&warmup, &t_data.buffer[1], N_BUFFERS - 1);
+
+	/* Set mode with 1st buffer, the rest of the pool is free */
+	buffer = &t_data.buffer[0];
+	faults = kms_fault_count();
+	kms_fill_frame(buffer, KMS_FILL_TILES, 0);
+	faults = kms_fault_count() - faults;
+	drmModeSetCrtc(fd, active_crtc->crtc_id, buffer->buf_id, 0, 0, &active_con->connector_id, 1, &active_con->modes[0]);
+	t_data.scanout = 0;
+
+	kms_warmup_wait(&warmup);
+	printf("1st frame: %ld faults, warmup: %d buffers %zu KiB in %.2f ms, "
+		"%ld faults\n", faults, warmup.count, warmup.bytes >> 10,
+		warmup.ms, warmup.faults);
+
+	t_data.ready_evt_fd = eventfd(0, EFD_CLOEXEC);
+	t_data.free_evt_fd = eventfd(0, EFD_CLOEXEC);
+	for (i = 1; i < N_BUFFERS; i++)
+		spsc_push(&t_data.free_queue, i);
+
+	/* Start display and producer threads */
+	pthread_create(&display, NULL, display_thread, &t_data);
+	pthread_create(&producer, NULL, producer_thread, &t_data);
+
+	/* Exit if user presses a key */
+	getchar();
+
+	atomic_store(&t_data.quit, 1);
+	wake(t_data.ready_evt_fd);
+	wake(t_data.free_evt_fd);
+	pthread_join(producer, NULL);
+	pthread_join(display, NULL);
+
+	printf("%s: frames rendered %u shown %u dropped %u\n",
+		t_data.mailbox ? "mailbox" : "fifo", t_data.frames_rendered,
+		t_data.frames_shown, t_data.frames_dropped);
+
+	/* Release all discovered metadata at once */
+	kms_close(&t_data.dev);
+
+	return 0;
+}
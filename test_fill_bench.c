@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+
+/* Iterations per benchmark case */
+#define N_ITERATIONS 20
+
+/* Alignment of kernel matrix rows */
+#define CACHE_LINE 64
+
+static const char *const page_names[] = {
+	[KMS_PAGES_BASE] = "base pages",
+	[KMS_PAGES_TRANSPARENT] = "transparent huge pages",
+	[KMS_PAGES_EXPLICIT] = "hugetlb pages",
+};
+
+/* main data structure to store info retrieved from drm drivers */
+struct test_data {
+	struct kms_device dev;
+	drmModeConnectorPtr active_con;
+
+	struct kms_buffer buffer;
+};
+
+#define MAKE_RGBA(r, g, b, a) \
+	((((r) >> 0) << 16) | \
+	 (((g) >> 0) << 8) | \
+	 (((b) >> 0) << 0) | \
+	 (((a) >> 8) << 0))
+
+/* Generic per pixel tiles loop, baseline for the generated kernels */
+static void fill_pattern(void *mem_base,
+			     unsigned int width, unsigned int height,
+			     unsigned int stride)
+{
+	unsigned int x, y;
+
+	for (y = 0; y < height; ++y) {
+		for (x = 0; x < width; ++x) {
+			div_t d = div(x + y, width);
+			uint32_t rgb32 = 0x00130502 * (d.quot >> 6)
+				       + 0x000a1120 * (d.rem >> 6);
+			uint32_t alpha = ((y < height/2) && (x < width/2)) ? 127 : 255;
+			uint32_t color =
+				MAKE_RGBA((rgb32 >> 16) & 0xff,
+					  (rgb32 >> 8) & 0xff, rgb32 & 0xff,
+					  alpha);
+
+			((uint32_t *)mem_base)[x] = color;
+		}
+		mem_base += stride;
+	}
+}
+
+/* 50% blend of a color against existing content, read-modify-write */
+static void blend_plain(void *mem_base,
+			unsigned int width, unsigned int height,
+			unsigned int stride, uint32_t color)
+{
+	uint32_t half = (color >> 1) & 0x7f7f7f7f;
+	unsigned int x, y;
+
+	for (y = 0; y < height; ++y) {
+		uint32_t *row = mem_base;
+
+		for (x = 0; x < width; ++x)
+			row[x] = ((row[x] >> 1) & 0x7f7f7f7f) + half;
+		mem_base += stride;
+	}
+}
+
+static void
+report(const char *name, double total_ms, unsigned int rows,
+	struct kms_buffer *buffer)
+{
+	double ms = total_ms / N_ITERATIONS;
+	double mb = (double)rows * buffer->dumb_buf.width * 4 / (1 << 20);
+
+	printf("%-24s %8.3f ms/frame %9.1f MiB/s\n", name, ms,
+		ms > 0 ? mb * 1e3 / ms : 0);
+}
+
+/*
+ * 1st fill of a fresh dumb buffer faults on every page. Compare it with a
+ * buffer prefaulted by a warmup, whose cost is reported separately.
+ */
+static void run_first_fill(int fd, struct kms_buffer *like)
+{
+	struct kms_buffer cold, warm;
+	struct kms_warmup warmup;
+	unsigned int width = like->dumb_buf.width;
+	unsigned int height = like->dumb_buf.height;
+	long faults;
+	double start;
+
+	memset(&cold, 0, sizeof(cold));
+	memset(&warm, 0, sizeof(warm));
+	cold.hsize = warm.hsize = like->hsize;
+	cold.vsize = warm.vsize = like->vsize;
+	if (kms_get_dumb_buffer(fd, &cold) || kms_get_dumb_buffer(fd, &warm)) {
+		printf("can't allocate first fill buffers\n");
+		return;
+	}
+
+	faults = kms_fault_count();
+	start = kms_now_ns() / 1e6;
+	cold.fill[KMS_FILL_TILES]->fill(cold.buf_ptr, width, height,
+		cold.dumb_buf.pitch, 0);
+	printf("%-24s %8.3f ms %8ld faults\n", "first fill cold",
+		kms_now_ns() / 1e6 - start, kms_fault_count() - faults);
+
+	kms_warmup_start(&warmup, &warm, 1);
+	kms_warmup_wait(&warmup);
+	printf("%-24s %8.3f ms %8ld faults\n", "warmup", warmup.ms,
+		warmup.faults);
+
+	faults = kms_fault_count();
+	start = kms_now_ns() / 1e6;
+	warm.fill[KMS_FILL_TILES]->fill(warm.buf_ptr, width, height,
+		warm.dumb_buf.pitch, 0);
+	printf("%-24s %8.3f ms %8ld faults\n", "first fill prefaulted",
+		kms_now_ns() / 1e6 - start, kms_fault_count() - faults);
+
+	kms_put_buffer(fd, &cold);
+	kms_put_buffer(fd, &warm);
+}
+
+/*
+ * Time generic tiles loop and every specialized kernel on cached memory,
+ * so that fill cost isn't hidden behind frame buffer write bandwidth.
+ */
+static int run_kernel_matrix(unsigned int width, unsigned int height)
+{
+	unsigned int stride = (width * 4 + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+	double mpix = (double)width * height / 1e6;
+	double start, ms;
+	void *mem;
+	int i, k;
+
+	if (posix_memalign(&mem, CACHE_LINE, (size_t)stride * height))
+		return -1;
+
+	start = kms_now_ns() / 1e6;
+	for (i = 0; i < N_ITERATIONS; i++)
+		fill_pattern(mem, width, height, stride);
+	ms = (kms_now_ns() / 1e6 - start) / N_ITERATIONS;
+	printf("%-24s %8.3f ms/frame %9.1f Mpix/s\n", "generic XRGB8888 tiles",
+		ms, ms > 0 ? mpix * 1e3 / ms : 0);
+
+	for (k = 0; k < kms_n_fill_kernels; k++) {
+		const struct kms_fill_kernel *kernel = &kms_fill_kernels[k];
+		unsigned int kernel_stride = (width * kernel->bpp / 8 +
+			CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+
+		start = kms_now_ns() / 1e6;
+		for (i = 0; i < N_ITERATIONS; i++)
+			kernel->fill(mem, width, height, kernel_stride, 0);
+		ms = (kms_now_ns() / 1e6 - start) / N_ITERATIONS;
+		printf("%-24s %8.3f ms/frame %9.1f Mpix/s\n", kernel->name,
+			ms, ms > 0 ? mpix * 1e3 / ms : 0);
+	}
+
+	free(mem);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_data t_data;
+	int i;
+	int fd;
+	drmModeResPtr res_ptr;
+	drmModeConnectorPtr active_con;
+	drmVersionPtr version;
+	struct kms_buffer *buffer;
+	uint8_t *shadow;
+	kms_fill_func fill;
+	unsigned int width, height, pitch, band, y;
+	double start;
+
+	/* Check if drm driver name is provided by user */
+	if (argc < 2) {
+		printf("missing drm driver name\n");
+		return -1;
+	}
+
+	memset(&t_data, 0, sizeof(struct test_data));
+
+	/* Open drm device node /dev/dri/cardX */
+	if (kms_open(&t_data.dev, argv[1], 0))
+		return -1;
+	fd = t_data.dev.fd;
+
+	/* Size buffer like 1st connector mode */
+	res_ptr = t_data.dev.res_ptr;
+	active_con = kms_get_connector(fd, &t_data.dev.arena,
+		res_ptr->connectors, res_ptr->count_connectors);
+	if (!active_con) {
+		printf("no connector with valid mode found\n");
+		return -1;
+	}
+	t_data.active_con = active_con;
+
+	/* Acquire a frame buffer, shadowed whatever its mapping */
+	buffer = &t_data.buffer;
+	buffer->hsize = active_con->modes[0].hdisplay;
+	buffer->vsize = active_con->modes[0].vdisplay;
+	buffer->flags = KMS_BUFFER_SHADOW_ALWAYS;
+	if (kms_get_dumb_buffer(fd, buffer)) {
+		printf("can't allocate frame buffer\n");
+		return -1;
+	}
+	if (!buffer->shadow) {
+		printf("can't allocate shadow buffer\n");
+		kms_put_buffer(fd, buffer);
+		return -1;
+	}
+	shadow = buffer->shadow;
+	fill = buffer->fill[KMS_FILL_TILES]->fill;
+
+	width = buffer->dumb_buf.width;
+	height = buffer->dumb_buf.height;
+	pitch = buffer->dumb_buf.pitch;
+	band = height / 8;
+
+	version = drmGetVersion(fd);
+	printf("driver %s, %ux%u pitch %u, mapping %s, shadow on %s\n",
+		version ? version->name : argv[1], width, height, pitch,
+		kms_mapping_is_wc(buffer) ?
+		"write-combined/uncached" : "cached",
+		page_names[buffer->shadow_pages]);
+	drmFreeVersion(version);
+
+	/* Page fault cost of 1st fill, cold and after warmup */
+	run_first_fill(fd, buffer);
+
+	/* Full frame fill, with a generated kernel to be bound by writes */
+	start = kms_now_ns() / 1e6;
+	for (i = 0; i < N_ITERATIONS; i++)
+		fill(buffer->buf_ptr, width, height, pitch, 0);
+	report("fill direct", kms_now_ns() / 1e6 - start, height, buffer);
+
+	start = kms_now_ns() / 1e6;
+	for (i = 0; i < N_ITERATIONS; i++) {
+		fill(shadow, width, height, pitch, 0);
+		kms_buffer_damage(buffer, 0, height);
+		kms_buffer_flush(buffer);
+	}
+	report("fill shadowed", kms_now_ns() / 1e6 - start, height, buffer);
+
+	/* Full frame read-modify-write */
+	start = kms_now_ns() / 1e6;
+	for (i = 0; i < N_ITERATIONS; i++)
+		blend_plain(buffer->buf_ptr, width, height, pitch, 0x00ff0000);
+	report("blend direct", kms_now_ns() / 1e6 - start, height, buffer);
+
+	start = kms_now_ns() / 1e6;
+	for (i = 0; i < N_ITERATIONS; i++) {
+		blend_plain(shadow, width, height, pitch, 0x00ff0000);
+		kms_buffer_damage(buffer, 0, height);
+		kms_buffer_flush(buffer);
+	}
+	report("blend shadowed", kms_now_ns() / 1e6 - start, height, buffer);
+
+	/* Partial update of a moving band of rows */
+	start = kms_now_ns() / 1e6;
+	for (i = 0; i < N_ITERATIONS; i++) {
+		y = (i * band) % (height - band + 1);
+		blend_plain((uint8_t *)buffer->buf_ptr + (size_t)y * pitch,
+			width, band, pitch, 0x0000ff00);
+	}
+	report("blend band direct", kms_now_ns() / 1e6 - start, band, buffer);
+
+	start = kms_now_ns() / 1e6;
+	for (i = 0; i < N_ITERATIONS; i++) {
+		y = (i * band) % (height - band + 1);
+		blend_plain(shadow + (size_t)y * pitch, width, band, pitch,
+			0x0000ff00);
+		kms_buffer_damage(buffer, y, band);
+		kms_buffer_flush(buffer);
+	}
+	report("blend band shadowed", kms_now_ns() / 1e6 - start, band, buffer);
+
+	/* Specialized fill kernels for each format and pattern */
+	if (run_kernel_matrix(width, height))
+		printf("can't allocate kernel matrix buffer\n");
+
+	kms_put_buffer(fd, buffer);
+
+	/* Release all discovered metadata at once */
+	kms_close(&t_data.dev);
+
+	return 0;
+}
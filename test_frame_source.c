@@ -0,0 +1,776 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+#include "kms_convert.h"
+
+/* Number of frame buffers in swapchain */
+#define N_BUFFERS 3
+
+/* Number of source frames to read ahead of the one being converted */
+#define READAHEAD_FRAMES 4
+
+enum buffer_state {
+	BUF_FREE,	/* available to frame source worker */
+	BUF_READY,	/* filled with a frame, waiting to be flipped */
+	BUF_PENDING,	/* flip issued, waiting for page flip event */
+	BUF_SCANOUT,	/* being scanned out */
+};
+
+struct test_buffer {
+	struct kms_buffer kms;
+	enum buffer_state state;
+	unsigned int frame;
+	unsigned int sequence;
+	int held;	/* being read back by capture worker */
+};
+
+/* Raw frames from a single file or from a directory with a file per frame */
+struct frame_source {
+	uint32_t format;
+	unsigned int width, height;
+	size_t frame_size;
+	unsigned int n_frames;
+
+	/* single file: whole file is mapped once */
+	uint8_t *map;
+	size_t map_size;
+
+	/* directory: a file is mapped per frame */
+	const char *dir;
+	struct dirent **names;
+	uint8_t *frame_map;
+};
+
+/* Readback of scanned out frames for output verification */
+struct frame_capture {
+	FILE *file;
+	unsigned int every;	/* capture every Nth frame, 0: on SIGUSR1 only */
+	int writeback;		/* driver exposes writeback connectors */
+
+	/* Buffer handed over to capture worker, NULL if worker is idle */
+	struct test_buffer *buffer;
+	unsigned int last_frame;
+	pthread_cond_t cond;
+	pthread_t thread;
+
+	unsigned int captured;
+	unsigned int skipped;
+};
+
+/* main data structure to store info retrieved from drm drivers */
+struct test_data {
+	struct kms_device dev;
+	struct kms_output output;
+
+	struct test_buffer buffer[N_BUFFERS];
+	struct frame_source source;
+	struct frame_capture capture;
+
+	/* Protects buffer states and frame counters */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int quit;
+
+	unsigned int frames_shown;
+	unsigned int frames_dropped;
+	struct timespec start;
+};
+
+static int skip_dot_files(const struct dirent *entry)
+{
+	return entry->d_name[0] != '.';
+}
+
+/* Return 0 on success, -1 if source can't be opened */
+static int
+open_frame_source(struct frame_source *src, const char *path)
+{
+	struct stat st;
+	int fd;
+	int n;
+
+	if (src->format == DRM_FORMAT_NV12)
+		src->frame_size = (size_t)src->width * src->height * 3 / 2;
+	else
+		src->frame_size = (size_t)src->width * src->height * 4;
+
+	if (stat(path, &st))
+		return -1;
+
+	/* Directory: one file per frame, sorted by name */
+	if (S_ISDIR(st.st_mode)) {
+		n = scandir(path, &src->names, skip_dot_files, alphasort);
+		if (n <= 0)
+			return -1;
+		src->dir = path;
+		src->n_frames = n;
+		return 0;
+	}
+
+	/* Single file: back to back frames */
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	src->map_size = st.st_size;
+	src->n_frames = src->map_size / src->frame_size;
+	if (!src->n_frames) {
+		close(fd);
+		return -1;
+	}
+
+	src->map = mmap(NULL, src->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (src->map == MAP_FAILED)
+		return -1;
+
+	madvise(src->map, src->map_size, MADV_SEQUENTIAL);
+
+	return 0;
+}
+
+/* Apply madvise() advice to [offset, offset + len) of a file mapping */
+static void
+advise_range(uint8_t *map, size_t map_size, size_t offset, size_t len,
+	int advice)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = offset & ~(page - 1);
+
+	if (start >= map_size)
+		return;
+	if (offset + len > map_size)
+		len = map_size - offset;
+
+	madvise(map + start, offset + len - start, advice);
+}
+
+/* Start reading a frame file in background */
+static void
+readahead_frame_file(struct frame_source *src, unsigned int frame)
+{
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", src->dir,
+		src->names[frame % src->n_frames]->d_name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	posix_fadvise(fd, 0, src->frame_size, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+/* Return mapping of a source frame, NULL on error */
+static uint8_t *
+map_frame(struct frame_source *src, unsigned int frame)
+{
+	char path[4096];
+	struct stat st;
+	size_t offset;
+	int fd;
+	int i;
+
+	frame %= src->n_frames;
+
+	if (src->map) {
+		offset = frame * src->frame_size;
+
+		/* Read ahead upcoming frames and drop frames already shown */
+		advise_range(src->map, src->map_size, offset + src->frame_size,
+			READAHEAD_FRAMES * src->frame_size, MADV_WILLNEED);
+		if (frame)
+			advise_range(src->map, src->map_size,
+				offset - src->frame_size, src->frame_size,
+				MADV_DONTNEED);
+
+		return src->map + offset;
+	}
+
+	for (i = 1; i <= READAHEAD_FRAMES; i++)
+		readahead_frame_file(src, frame + i);
+
+	snprintf(path, sizeof(path), "%s/%s", src->dir,
+		src->names[frame]->d_name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	/* Short files would fault when read past their end */
+	if (fstat(fd, &st) || st.st_size < (off_t)src->frame_size) {
+		close(fd);
+		return NULL;
+	}
+
+	src->frame_map = mmap(NULL, src->frame_size, PROT_READ,
+		MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (src->frame_map == MAP_FAILED) {
+		src->frame_map = NULL;
+		return NULL;
+	}
+
+	return src->frame_map;
+}
+
+static void unmap_frame(struct frame_source *src)
+{
+	if (!src->frame_map)
+		return;
+
+	munmap(src->frame_map, src->frame_size);
+	src->frame_map = NULL;
+}
+
+/* Copy XRGB8888 rows honoring source and destination strides */
+static void
+copy_xrgb8888(uint8_t *dst, unsigned int dst_stride,
+	const uint8_t *src, unsigned int src_stride,
+	unsigned int width, unsigned int height)
+{
+	unsigned int y;
+
+	for (y = 0; y < height; y++) {
+		memcpy(dst, src, width * 4);
+		dst += dst_stride;
+		src += src_stride;
+	}
+}
+
+/* Copy or convert a source frame into a frame buffer */
+static void
+fill_frame(struct frame_source *src, const uint8_t *frame,
+	struct test_buffer *buffer)
+{
+	unsigned int width = src->width < buffer->kms.dumb_buf.width ?
+		src->width : buffer->kms.dumb_buf.width;
+	unsigned int height = src->height < buffer->kms.dumb_buf.height ?
+		src->height : buffer->kms.dumb_buf.height;
+	struct kms_yuv_frame yuv = {
+		.format = DRM_FORMAT_NV12,
+		.width = width,
+		.height = height,
+		.plane = { (uint8_t *)frame,
+			(uint8_t *)frame + src->width * src->height },
+		.stride = { src->width, src->width },
+	};
+
+	/* Limited range BT.601 */
+	if (src->format == DRM_FORMAT_NV12)
+		kms_yuv_to_xrgb(&yuv, buffer->kms.buf_ptr,
+			buffer->kms.dumb_buf.pitch, 0, height,
+			KMS_COLOR_BT601, KMS_RANGE_LIMITED);
+	else
+		copy_xrgb8888(buffer->kms.buf_ptr, buffer->kms.dumb_buf.pitch,
+			frame, src->width * 4, width, height);
+}
+
+/*
+ * Frame source worker. Fill free frame buffers with upcoming source
+ * frames while the display side scans out and flips.
+ */
+static void *frame_source_worker(void *arg)
+{
+	struct test_data *t_data = arg;
+	struct test_buffer *buffer;
+	unsigned int frame = 0;
+	uint8_t *map;
+	int i;
+
+	while (1) {
+		/* Wait for a free buffer */
+		pthread_mutex_lock(&t_data->lock);
+		buffer = NULL;
+		while (!t_data->quit && !buffer) {
+			for (i = 0; i < N_BUFFERS; i++) {
+				if (t_data->buffer[i].state == BUF_FREE &&
+					!t_data->buffer[i].held) {
+					buffer = &t_data->buffer[i];
+					break;
+				}
+			}
+			if (!buffer)
+				pthread_cond_wait(&t_data->cond, &t_data->lock);
+		}
+		pthread_mutex_unlock(&t_data->lock);
+
+		if (!buffer)
+			break;
+
+		/* I/O and conversion happen outside of the lock */
+		map = map_frame(&t_data->source, frame);
+		if (map)
+			fill_frame(&t_data->source, map, buffer);
+		unmap_frame(&t_data->source);
+
+		pthread_mutex_lock(&t_data->lock);
+		buffer->frame = frame++;
+		buffer->state = BUF_READY;
+		pthread_cond_signal(&t_data->cond);
+		pthread_mutex_unlock(&t_data->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Return 1 if the device exposes writeback connectors. Exposing them
+ * takes atomic commit, so the probe sets client caps on a separate fd
+ * rather than on the legacy client's own.
+ */
+static int probe_writeback(int fd)
+{
+#ifdef DRM_CLIENT_CAP_WRITEBACK_CONNECTORS
+	char *name = drmGetDeviceNameFromFd(fd);
+	int probe_fd;
+	int ret;
+
+	if (!name)
+		return 0;
+	probe_fd = open(name, O_RDWR | O_CLOEXEC);
+	free(name);
+	if (probe_fd < 0)
+		return 0;
+
+	ret = !drmSetClientCap(probe_fd, DRM_CLIENT_CAP_ATOMIC, 1) &&
+		!drmSetClientCap(probe_fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1);
+	close(probe_fd);
+
+	return ret;
+#else
+	/* libdrm predates writeback connectors */
+	return 0;
+#endif
+}
+
+static volatile sig_atomic_t capture_requested;
+
+static void request_capture(int sig)
+{
+	capture_requested = 1;
+}
+
+/* CRC32C (Castagnoli) of a byte range */
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+
+static uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len)
+{
+	while (len && ((uintptr_t)data & 7)) {
+		crc = _mm_crc32_u8(crc, *data++);
+		len--;
+	}
+	for (; len >= 8; len -= 8, data += 8)
+		crc = _mm_crc32_u64(crc, *(const uint64_t *)data);
+	while (len--)
+		crc = _mm_crc32_u8(crc, *data++);
+
+	return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+static uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len)
+{
+	while (len && ((uintptr_t)data & 7)) {
+		crc = __crc32cb(crc, *data++);
+		len--;
+	}
+	for (; len >= 8; len -= 8, data += 8)
+		crc = __crc32cd(crc, *(const uint64_t *)data);
+	while (len--)
+		crc = __crc32cb(crc, *data++);
+
+	return crc;
+}
+#else
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = crc32c_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+}
+
+/* Slicing-by-8, little endian */
+static uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	uint64_t word;
+
+	pthread_once(&once, crc32c_init);
+
+	for (; len >= 8; len -= 8, data += 8) {
+		memcpy(&word, data, 8);
+		word ^= crc;
+		crc = crc32c_table[7][word & 0xff] ^
+		      crc32c_table[6][(word >> 8) & 0xff] ^
+		      crc32c_table[5][(word >> 16) & 0xff] ^
+		      crc32c_table[4][(word >> 24) & 0xff] ^
+		      crc32c_table[3][(word >> 32) & 0xff] ^
+		      crc32c_table[2][(word >> 40) & 0xff] ^
+		      crc32c_table[1][(word >> 48) & 0xff] ^
+		      crc32c_table[0][word >> 56];
+	}
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+#endif
+
+/* Checksum visible pixels of a frame buffer, stride padding excluded */
+static uint32_t hash_buffer(struct test_buffer *buffer)
+{
+	const uint8_t *row = buffer->kms.buf_ptr;
+	uint32_t crc = ~0u;
+	unsigned int y;
+
+	for (y = 0; y < buffer->kms.dumb_buf.height; y++) {
+		crc = crc32c(crc, row, buffer->kms.dumb_buf.width * 4);
+		row += buffer->kms.dumb_buf.pitch;
+	}
+
+	return ~crc;
+}
+
+/*
+ * Capture worker. Checksum buffers handed over by page flip handler and
+ * log the result. A buffer stays held, i.e. isn't refilled by frame source
+ * worker, until it has been checksummed.
+ */
+static void *frame_capture_worker(void *arg)
+{
+	struct test_data *t_data = arg;
+	struct frame_capture *capture = &t_data->capture;
+	struct test_buffer *buffer;
+	uint32_t crc;
+
+	while (1) {
+		pthread_mutex_lock(&t_data->lock);
+		while (!t_data->quit && !capture->buffer)
+			pthread_cond_wait(&capture->cond, &t_data->lock);
+		buffer = capture->buffer;
+		pthread_mutex_unlock(&t_data->lock);
+
+		if (!buffer)
+			break;
+
+		crc = hash_buffer(buffer);
+		fprintf(capture->file, "frame %u sequence %u crc32c %08x\n",
+			buffer->frame, buffer->sequence, crc);
+
+		pthread_mutex_lock(&t_data->lock);
+		buffer->held = 0;
+		capture->buffer = NULL;
+		capture->captured++;
+		pthread_cond_signal(&t_data->cond);
+		pthread_mutex_unlock(&t_data->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Hand a buffer which just went on screen over to capture worker, if it's
+ * due for capture. Never waits: if worker is still busy, capture is skipped.
+ * Called with t_data->lock held.
+ */
+static void
+queue_capture(struct test_data *t_data, struct test_buffer *buffer)
+{
+	struct frame_capture *capture = &t_data->capture;
+	int due;
+
+	if (!capture->file || buffer->frame == capture->last_frame)
+		return;
+
+	due = capture_requested ||
+		(capture->every && buffer->frame % capture->every == 0);
+	if (!due)
+		return;
+
+	if (capture->buffer) {
+		capture->skipped++;
+		return;
+	}
+
+	capture_requested = 0;
+	capture->last_frame = buffer->frame;
+	capture->buffer = buffer;
+	buffer->held = 1;
+	pthread_cond_signal(&capture->cond);
+}
+
+/* Return oldest ready buffer, NULL if worker hasn't filled any yet */
+static struct test_buffer *
+get_ready_buffer(struct test_data *t_data)
+{
+	struct test_buffer *ready = NULL;
+	int i;
+
+	for (i = 0; i < N_BUFFERS; i++) {
+		struct test_buffer *buffer = &t_data->buffer[i];
+
+		if (buffer->state == BUF_READY &&
+			(!ready || buffer->frame < ready->frame))
+			ready = buffer;
+	}
+
+	return ready;
+}
+
+static void
+page_flip_handler(int fd, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+	struct test_data *t_data = user_data;
+	struct test_buffer *flip_buffer;
+	int i;
+
+	pthread_mutex_lock(&t_data->lock);
+
+	/* Previous scanout buffer is free now, pending one is on screen */
+	for (i = 0; i < N_BUFFERS; i++) {
+		if (t_data->buffer[i].state == BUF_SCANOUT)
+			t_data->buffer[i].state = BUF_FREE;
+	}
+	for (i = 0; i < N_BUFFERS; i++) {
+		if (t_data->buffer[i].state == BUF_PENDING) {
+			t_data->buffer[i].state = BUF_SCANOUT;
+			t_data->buffer[i].sequence = sequence;
+			queue_capture(t_data, &t_data->buffer[i]);
+		}
+	}
+	pthread_cond_signal(&t_data->cond);
+
+	/* Issue flip on next frame, repeat current one if none is ready */
+	flip_buffer = get_ready_buffer(t_data);
+	if (flip_buffer) {
+		t_data->frames_shown++;
+	} else {
+		t_data->frames_dropped++;
+		for (i = 0; i < N_BUFFERS; i++) {
+			if (t_data->buffer[i].state == BUF_SCANOUT)
+				flip_buffer = &t_data->buffer[i];
+		}
+	}
+	flip_buffer->state = BUF_PENDING;
+
+	pthread_mutex_unlock(&t_data->lock);
+
+	kms_legacy_page_flip(&t_data->dev, t_data->output.crtc->crtc_id,
+		flip_buffer->kms.buf_id, DRM_MODE_PAGE_FLIP_EVENT, t_data);
+}
+
+static void print_stats(struct test_data *t_data)
+{
+	drmModeModeInfoPtr mode = &t_data->output.con->modes[0];
+	struct timespec end;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - t_data->start.tv_sec) +
+		(end.tv_nsec - t_data->start.tv_nsec) / 1e9;
+
+	printf("mode %dx%d@%d source %ux%u %s\n",
+		mode->hdisplay, mode->vdisplay, mode->vrefresh,
+		t_data->source.width, t_data->source.height,
+		t_data->source.format == DRM_FORMAT_NV12 ? "NV12" : "XRGB8888");
+	printf("frames shown %u dropped %u in %.2f s: %.2f fps\n",
+		t_data->frames_shown, t_data->frames_dropped, elapsed,
+		elapsed > 0 ? t_data->frames_shown / elapsed : 0);
+	if (t_data->capture.file)
+		printf("frames captured %u skipped %u\n",
+			t_data->capture.captured, t_data->capture.skipped);
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_data t_data;
+	int i;
+	int fd;
+	drmModeConnectorPtr active_con;
+	drmModeCrtcPtr active_crtc;
+	struct test_buffer *buffer;
+	drmEventContext evt_ctx;
+	pthread_t worker;
+	struct frame_capture *capture;
+	int width, height;
+	struct sigaction sa;
+
+	/* Check if drm driver name and frame source are provided by user */
+	if (argc < 6) {
+		printf("usage: %s <drm driver> <file|dir> <XR24|NV12> "
+			"<width> <height> [capture file] [capture every N]\n",
+			argv[0]);
+		return -1;
+	}
+
+	memset(&t_data, 0, sizeof(struct test_data));
+	t_data.source.format = strcmp(argv[3], "NV12") ?
+		DRM_FORMAT_XRGB8888 : DRM_FORMAT_NV12;
+	width = atoi(argv[4]);
+	height = atoi(argv[5]);
+
+	/* NV12 chroma is subsampled 2x2, its frames need even sizes */
+	if (width <= 0 || height <= 0 || (t_data.source.format ==
+		DRM_FORMAT_NV12 && (width & 1 || height & 1))) {
+		printf("invalid frame size %sx%s\n", argv[4], argv[5]);
+		return -1;
+	}
+	t_data.source.width = width;
+	t_data.source.height = height;
+	if (open_frame_source(&t_data.source, argv[2])) {
+		printf("can't open frame source %s\n", argv[2]);
+		return -1;
+	}
+
+	/*
+	 * Optional capture log. Frames are checksummed every N frames, or
+	 * on SIGUSR1 if N is 0.
+	 */
+	capture = &t_data.capture;
+	capture->last_frame = ~0u;
+	if (argc > 6) {
+		capture->file = fopen(argv[6], "w");
+		if (!capture->file) {
+			printf("can't open capture file %s\n", argv[6]);
+			return -1;
+		}
+		capture->every = argc > 7 ? atoi(argv[7]) : 1;
+		memset(&sa, 0, sizeof(struct sigaction));
+		sa.sa_handler = request_capture;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+
+	/*
+	 * Open drm device node /dev/dri/cardX, and discover its resources
+	 * and properties.
+	 */
+	if (kms_open(&t_data.dev, argv[1], 0))
+		return -1;
+	fd = t_data.dev.fd;
+
+	/*
+	 * Readback of the scanned out buffer is used for capture. Writeback
+	 * connectors need an atomic commit per captured frame, so they are
+	 * only reported here.
+	 */
+	if (capture->file) {
+		capture->writeback = probe_writeback(fd);
+		printf("writeback connectors %savailable, capturing by readback\n",
+			capture->writeback ? "" : "not ");
+	}
+
+	/* Find a connector, encoder and crtc */
+	if (kms_get_output(&t_data.dev, &t_data.output, 0))
+		return -1;
+	active_con = t_data.output.con;
+	active_crtc = t_data.output.crtc;
+
+	/* Report footprint of discovered metadata */
+	kms_arena_report(&t_data.dev.arena);
+
+	/* Acquire frame buffers and add them to drm */
+	for (i = 0; i < N_BUFFERS; i++) {
+		buffer = &t_data.buffer[i];
+		if (kms_add_buffer(fd, &buffer->kms,
+			active_con->modes[0].hdisplay,
+			active_con->modes[0].vdisplay, DRM_FORMAT_XRGB8888)) {
+			printf("failed to allocate frame buffer\n");
+			return -1;
+		}
+		buffer->state = BUF_FREE;
+	}
+
+	/* Start frame source worker */
+	pthread_mutex_init(&t_data.lock, NULL);
+	pthread_cond_init(&t_data.cond, NULL);
+	pthread_create(&worker, NULL, frame_source_worker, &t_data);
+
+	/* Start capture worker */
+	if (capture->file) {
+		pthread_cond_init(&capture->cond, NULL);
+		pthread_create(&capture->thread, NULL, frame_capture_worker,
+			&t_data);
+	}
+
+	/* Wait for 1st frame */
+	pthread_mutex_lock(&t_data.lock);
+	while (!(buffer = get_ready_buffer(&t_data)))
+		pthread_cond_wait(&t_data.cond, &t_data.lock);
+	buffer->state = BUF_SCANOUT;
+	pthread_mutex_unlock(&t_data.lock);
+
+	/* Set mode */
+	drmModeSetCrtc(fd, active_crtc->crtc_id, buffer->kms.buf_id, 0, 0, &active_con->connector_id, 1, &active_con->modes[0]);
+	clock_gettime(CLOCK_MONOTONIC, &t_data.start);
+
+	/* 1st page flip, repeat 1st frame to get the flip loop going */
+	pthread_mutex_lock(&t_data.lock);
+	buffer->state = BUF_PENDING;
+	pthread_mutex_unlock(&t_data.lock);
+	kms_legacy_page_flip(&t_data.dev, active_crtc->crtc_id,
+		buffer->kms.buf_id, DRM_MODE_PAGE_FLIP_EVENT, &t_data);
+
+	/* Setup page flip event handler  */
+	memset(&evt_ctx, 0, sizeof(drmEventContext));
+	evt_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evt_ctx.page_flip_handler = page_flip_handler;
+
+	/* Wait for page flip event. Exit if user presses a key. */
+	while (kms_wait_events(fd, &evt_ctx, -1, 1) > 0)
+		;
+
+	/* Stop frame source worker */
+	pthread_mutex_lock(&t_data.lock);
+	t_data.quit = 1;
+	pthread_cond_signal(&t_data.cond);
+	if (capture->file)
+		pthread_cond_signal(&capture->cond);
+	pthread_mutex_unlock(&t_data.lock);
+	pthread_join(worker, NULL);
+	if (capture->file) {
+		pthread_join(capture->thread, NULL);
+		fclose(capture->file);
+	}
+
+	print_stats(&t_data);
+
+	/* Release all discovered metadata at once */
+	kms_close(&t_data.dev);
+
+	return 0;
+}
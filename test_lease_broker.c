@@ -0,0 +1,649 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+
+/* Default rendezvous of broker and clients */
+#define LEASE_SOCKET "/tmp/drm_lease_broker.sock"
+
+/* Upper bound of simultaneously connected clients */
+#define MAX_CLIENTS 8
+
+/*
+ * Broker to client message. With lessee_id set it comes with the lease
+ * fd attached, lessee_id 0 tells the lease was revoked.
+ */
+struct lease_msg {
+	uint32_t lessee_id;
+	uint32_t connector_id;
+	uint32_t crtc_id;
+	uint32_t plane_id;
+};
+
+struct lease_client {
+	int sock;		/* -1: slot unused */
+	struct lease_msg lease;	/* lease.lessee_id 0: waiting for a head */
+};
+
+/* main data structure of broker mode */
+struct broker {
+	struct kms_device dev;
+	int listen_fd;
+	int uevent_fd;
+	struct lease_client client[MAX_CLIENTS];
+
+	unsigned int leases_created;
+	unsigned int leases_revoked;
+};
+
+/* main data structure of client mode */
+struct test_data {
+	struct kms_device dev;
+	struct kms_output output;
+	struct kms_buffer buffer[2];
+	int front;
+	unsigned int frames;
+};
+
+/* Send msg, with fd attached unless it's negative */
+static int send_msg(int sock, struct lease_msg *msg, int fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (fd >= 0) {
+		memset(cbuf, 0, sizeof(cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	return sendmsg(sock, &mh, MSG_NOSIGNAL) == sizeof(*msg) ? 0 : -1;
+}
+
+/*
+ * Receive a message and the fd attached to it, -1 in *fd if there is
+ * none. Return 0 on success, -1 if broker hung up.
+ */
+static int recv_msg(int sock, struct lease_msg *msg, int *fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	*fd = -1;
+	if (recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) != sizeof(*msg))
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+		cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	return 0;
+}
+
+/* Return 1 if a connector, crtc or plane is leased to some client */
+static int is_leased(struct broker *broker, uint32_t obj_id)
+{
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		struct lease_msg *lease = &broker->client[i].lease;
+
+		if (broker->client[i].sock < 0 || !lease->lessee_id)
+			continue;
+		if (lease->connector_id == obj_id || lease->crtc_id == obj_id ||
+			lease->plane_id == obj_id)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Return a primary plane of crtc crtc_idx not leased yet, 0 if none */
+static uint32_t get_free_plane(struct broker *broker, int crtc_idx)
+{
+	struct kms_device *dev = &broker->dev;
+	drmModePlaneResPtr plane_res_ptr = dev->plane_res_ptr;
+	uint32_t plane_id = 0;
+	int i;
+
+	for (i = 0; plane_res_ptr && i < plane_res_ptr->count_planes &&
+		!plane_id; i++) {
+		uint32_t id = plane_res_ptr->planes[i];
+		drmModePlanePtr plane_ptr;
+
+		if (is_leased(broker, id) ||
+			kms_get_prop_value(dev->prop_ptr, DRM_MODE_OBJECT_PLANE,
+			id, "type", DRM_PLANE_TYPE_OVERLAY) !=
+			DRM_PLANE_TYPE_PRIMARY)
+			continue;
+
+		plane_ptr = drmModeGetPlane(dev->fd, id);
+		if (!plane_ptr)
+			continue;
+		if (plane_ptr->possible_crtcs & (1 << crtc_idx))
+			plane_id = id;
+		drmModeFreePlane(plane_ptr);
+	}
+
+	return plane_id;
+}
+
+/*
+ * Pick a connected connector, a crtc and a primary plane none of which
+ * is leased yet. Return 0 on success, -1 if no such head is left.
+ */
+static int get_free_head(struct broker *broker, struct lease_msg *lease)
+{
+	struct kms_device *dev = &broker->dev;
+	drmModeResPtr res_ptr = dev->res_ptr;
+	int i, j, k;
+
+	for (i = 0; i < res_ptr->count_connectors; i++) {
+		drmModeConnectorPtr con_ptr;
+
+		if (is_leased(broker, res_ptr->connectors[i]))
+			continue;
+
+		/* Kernel probes connectors before a hotplug uevent */
+		con_ptr = drmModeGetConnectorCurrent(dev->fd,
+			res_ptr->connectors[i]);
+		if (!con_ptr || con_ptr->connection != DRM_MODE_CONNECTED) {
+			drmModeFreeConnector(con_ptr);
+			continue;
+		}
+
+		for (j = 0; j < con_ptr->count_encoders; j++) {
+			drmModeEncoderPtr enc_ptr =
+				drmModeGetEncoder(dev->fd, con_ptr->encoders[j]);
+			uint32_t possible_crtcs;
+
+			if (!enc_ptr)
+				continue;
+			possible_crtcs = enc_ptr->possible_crtcs;
+			drmModeFreeEncoder(enc_ptr);
+
+			for (k = 0; k < res_ptr->count_crtcs; k++) {
+				if (!(possible_crtcs & (1 << k)) ||
+					is_leased(broker, res_ptr->crtcs[k]))
+					continue;
+
+				lease->plane_id = get_free_plane(broker, k);
+				if (!lease->plane_id)
+					continue;
+
+				lease->connector_id = con_ptr->connector_id;
+				lease->crtc_id = res_ptr->crtcs[k];
+				drmModeFreeConnector(con_ptr);
+				return 0;
+			}
+		}
+		drmModeFreeConnector(con_ptr);
+	}
+
+	return -1;
+}
+
+/* Lease a free head to a waiting client. Return 0 on success. */
+static int grant_lease(struct broker *broker, struct lease_client *client)
+{
+	struct lease_msg lease;
+	uint32_t objects[3];
+	int lease_fd;
+	int ret;
+
+	memset(&lease, 0, sizeof(lease));
+	if (get_free_head(broker, &lease))
+		return -1;
+
+	objects[0] = lease.connector_id;
+	objects[1] = lease.crtc_id;
+	objects[2] = lease.plane_id;
+	lease_fd = drmModeCreateLease(broker->dev.fd, objects, 3, O_CLOEXEC,
+		&lease.lessee_id);
+	if (lease_fd < 0) {
+		printf("failed to lease connector %u crtc %u plane %u\n",
+			lease.connector_id, lease.crtc_id, lease.plane_id);
+		return -1;
+	}
+
+	/* Lease lives as long as the client keeps its copy of the fd */
+	ret = send_msg(client->sock, &lease, lease_fd);
+	close(lease_fd);
+	if (ret) {
+		drmModeRevokeLease(broker->dev.fd, lease.lessee_id);
+		return -1;
+	}
+
+	client->lease = lease;
+	broker->leases_created++;
+	printf("lessee %u: connector %u crtc %u plane %u\n", lease.lessee_id,
+		lease.connector_id, lease.crtc_id, lease.plane_id);
+
+	return 0;
+}
+
+/* Revoke client's lease and, if still connected, tell it so */
+static void revoke_lease(struct broker *broker, struct lease_client *client)
+{
+	struct lease_msg revoked;
+
+	if (!client->lease.lessee_id)
+		return;
+
+	drmModeRevokeLease(broker->dev.fd, client->lease.lessee_id);
+	printf("lessee %u revoked\n", client->lease.lessee_id);
+	broker->leases_revoked++;
+
+	memset(&client->lease, 0, sizeof(client->lease));
+	if (client->sock >= 0) {
+		memset(&revoked, 0, sizeof(revoked));
+		send_msg(client->sock, &revoked, -1);
+	}
+}
+
+/* Hand free heads to waiting clients, in slot order */
+static void grant_leases(struct broker *broker)
+{
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		struct lease_client *client = &broker->client[i];
+
+		if (client->sock >= 0 && !client->lease.lessee_id &&
+			grant_lease(broker, client))
+			break;
+	}
+}
+
+/*
+ * Hotplug: rediscover topology, revoke leases whose connector went away
+ * and hand out heads which became available.
+ */
+static void handle_hotplug(struct broker *broker)
+{
+	struct kms_device *dev = &broker->dev;
+	int i;
+
+	kms_rediscover(dev);
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		struct lease_client *client = &broker->client[i];
+		drmModeConnectorPtr con_ptr;
+
+		if (client->sock < 0 || !client->lease.lessee_id)
+			continue;
+
+		/* Kernel probed it before sending the uevent */
+		con_ptr = drmModeGetConnectorCurrent(dev->fd,
+			client->lease.connector_id);
+		if (!con_ptr || con_ptr->connection != DRM_MODE_CONNECTED)
+			revoke_lease(broker, client);
+		drmModeFreeConnector(con_ptr);
+	}
+
+	grant_leases(broker);
+}
+
+static int open_uevent_socket(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+		NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+
+	/* Group 1: kernel uevents */
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Return 1 if next uevent is a drm hotplug */
+static int read_hotplug(int fd)
+{
+	char buf[4096];
+	int subsystem = 0, hotplug = 0;
+	ssize_t len;
+	char *p;
+
+	len = recv(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	/* "action@devpath" followed by NUL separated KEY=value pairs */
+	for (p = buf; p < buf + len; p += strlen(p) + 1) {
+		if (!strcmp(p, "SUBSYSTEM=drm"))
+			subsystem = 1;
+		else if (!strcmp(p, "HOTPLUG=1"))
+			hotplug = 1;
+	}
+
+	return subsystem && hotplug;
+}
+
+static int open_listen_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+		listen(fd, MAX_CLIENTS)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void accept_client(struct broker *broker)
+{
+	int sock = accept4(broker->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	int i;
+
+	if (sock < 0)
+		return;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		struct lease_client *client = &broker->client[i];
+
+		if (client->sock < 0) {
+			client->sock = sock;
+			memset(&client->lease, 0, sizeof(client->lease));
+			if (grant_lease(broker, client))
+				printf("client %d waits for a free head\n", i);
+			return;
+		}
+	}
+
+	printf("too many clients\n");
+	close(sock);
+}
+
+/*
+ * Broker mode. Holds drm master, leases a connector, crtc and primary
+ * plane to each client and keeps nothing on screen itself, so clients
+ * commit and flip independently of each other and of the broker.
+ */
+static int run_broker(const char *name, const char *path)
+{
+	struct broker broker;
+	struct pollfd fds[MAX_CLIENTS + 3];
+	int i, n;
+
+	memset(&broker, 0, sizeof(struct broker));
+	for (i = 0; i < MAX_CLIENTS; i++)
+		broker.client[i].sock = -1;
+
+	/*
+	 * Open drm device node /dev/dri/cardX. Atomic exposes every plane,
+	 * so primary planes can be leased along with their crtcs.
+	 */
+	if (kms_open(&broker.dev, name, KMS_OPEN_ATOMIC))
+		return -1;
+
+	broker.listen_fd = open_listen_socket(path);
+	if (broker.listen_fd < 0) {
+		printf("can't listen on %s\n", path);
+		return -1;
+	}
+
+	broker.uevent_fd = open_uevent_socket();
+	if (broker.uevent_fd < 0)
+		printf("no uevent socket, hotplug won't be tracked\n");
+
+	printf("leasing outputs of %s on %s\n", name, path);
+
+	/* Serve until user presses a key */
+	while (1) {
+		fds[0].fd = 0;
+		fds[0].events = POLLIN;
+		fds[1].fd = broker.listen_fd;
+		fds[1].events = POLLIN;
+		fds[2].fd = broker.uevent_fd;
+		fds[2].events = POLLIN;
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			fds[3 + i].fd = broker.client[i].sock;
+			fds[3 + i].events = POLLIN;
+		}
+
+		n = poll(fds, MAX_CLIENTS + 3, -1);
+		if (n < 0 || (fds[0].revents & POLLIN))
+			break;
+
+		/* Hung up clients release their heads for waiting ones */
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			struct lease_client *client = &broker.client[i];
+
+			if (!fds[3 + i].revents)
+				continue;
+
+			close(client->sock);
+			client->sock = -1;
+			revoke_lease(&broker, client);
+			grant_leases(&broker);
+		}
+
+		if ((fds[2].revents & POLLIN) && read_hotplug(broker.uevent_fd))
+			handle_hotplug(&broker);
+
+		if (fds[1].revents & POLLIN)
+			accept_client(&broker);
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		revoke_lease(&broker, &broker.client[i]);
+		if (broker.client[i].sock >= 0)
+			close(broker.client[i].sock);
+	}
+	printf("leases created %u revoked %u\n", broker.leases_created,
+		broker.leases_revoked);
+
+	close(broker.listen_fd);
+	unlink(path);
+	if (broker.uevent_fd >= 0)
+		close(broker.uevent_fd);
+
+	/* Release all discovered metadata at once */
+	kms_close(&broker.dev);
+
+	return 0;
+}
+
+static void
+page_flip_handler(int fd, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+	struct test_data *t_data = user_data;
+
+	/* Issue flip on the other buffer */
+	t_data->front = !t_data->front;
+	t_data->frames++;
+	kms_legacy_page_flip(&t_data->dev, t_data->output.crtc->crtc_id,
+		t_data->buffer[!t_data->front].buf_id,
+		DRM_MODE_PAGE_FLIP_EVENT, t_data);
+}
+
+/*
+ * Show frames on a leased head until the lease is revoked or user presses
+ * a key. Return 0 on key press, 1 on revocation, -1 on error.
+ */
+static int run_lease(struct test_data *t_data, int sock, int lease_fd)
+{
+	drmModeConnectorPtr active_con;
+	drmEventContext evt_ctx;
+	struct lease_msg msg;
+	struct pollfd fds[3];
+	int ret = 1;
+	int fd;
+	int i;
+
+	/* Lessee sees only leased objects, so 1st output is the leased one */
+	if (kms_open_fd(&t_data->dev, lease_fd, KMS_OPEN_TRY_ATOMIC))
+		return -1;
+	if (kms_get_output(&t_data->dev, &t_data->output, 0)) {
+		kms_close(&t_data->dev);
+		return -1;
+	}
+	fd = t_data->dev.fd;
+	active_con = t_data->output.con;
+
+	for (i = 0; i < 2; i++) {
+		kms_add_buffer(fd, &t_data->buffer[i],
+			active_con->modes[0].hdisplay,
+			active_con->modes[0].vdisplay, DRM_FORMAT_XRGB8888);
+		kms_fill_buffer(&t_data->buffer[i],
+			i ? KMS_FILL_PLAIN : KMS_FILL_TILES);
+	}
+
+	/* Set mode and flip, we're master of the leased objects */
+	drmModeSetCrtc(fd, t_data->output.crtc->crtc_id,
+		t_data->buffer[0].buf_id, 0, 0, &active_con->connector_id, 1,
+		&active_con->modes[0]);
+	t_data->front = 0;
+	kms_legacy_page_flip(&t_data->dev, t_data->output.crtc->crtc_id,
+		t_data->buffer[1].buf_id, DRM_MODE_PAGE_FLIP_EVENT, t_data);
+
+	memset(&evt_ctx, 0, sizeof(drmEventContext));
+	evt_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evt_ctx.page_flip_handler = page_flip_handler;
+
+	fds[0].fd = 0;
+	fds[0].events = POLLIN;
+	fds[1].fd = sock;
+	fds[1].events = POLLIN;
+	fds[2].fd = fd;
+	fds[2].events = POLLIN;
+	while (poll(fds, 3, -1) >= 0) {
+		if (fds[0].revents & POLLIN) {
+			ret = 0;
+			break;
+		}
+
+		/* Any broker message or hang up ends this lease */
+		if (fds[1].revents) {
+			if (recv_msg(sock, &msg, &lease_fd) || lease_fd >= 0) {
+				if (lease_fd >= 0)
+					close(lease_fd);
+				ret = -1;
+			}
+			break;
+		}
+
+		if (fds[2].revents & POLLIN)
+			kms_handle_event(fd, &evt_ctx);
+	}
+
+	printf("%u frames on lease\n", t_data->frames);
+
+	for (i = 0; i < 2; i++)
+		kms_put_buffer(fd, &t_data->buffer[i]);
+
+	/* Closing lease fd gives up the lease */
+	kms_close(&t_data->dev);
+
+	return ret;
+}
+
+/* Client mode. Drive whatever head broker leases, for as long as it does. */
+static int run_client(const char *path)
+{
+	struct test_data t_data;
+	struct sockaddr_un addr;
+	struct lease_msg msg;
+	int sock, lease_fd;
+	int ret = 1;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		printf("can't connect to broker on %s\n", path);
+		return -1;
+	}
+
+	do {
+		/* Wait for a lease */
+		if (recv_msg(sock, &msg, &lease_fd)) {
+			printf("broker hung up\n");
+			break;
+		}
+		if (lease_fd < 0)
+			continue;
+
+		printf("lessee %u: connector %u crtc %u plane %u\n",
+			msg.lessee_id, msg.connector_id, msg.crtc_id,
+			msg.plane_id);
+
+		memset(&t_data, 0, sizeof(struct test_data));
+		ret = run_lease(&t_data, sock, lease_fd);
+	} while (ret > 0);
+
+	close(sock);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	/* Check if drm driver name or client mode is provided by user */
+	if (argc < 2) {
+		printf("usage: %s <drm driver> [socket]\n"
+			"       %s client [socket]\n", argv[0], argv[0]);
+		return -1;
+	}
+
+	if (!strcmp(argv[1], "client"))
+		return run_client(argc > 2 ? argv[2] : LEASE_SOCKET);
+
+	return run_broker(argv[1], argc > 2 ? argv[2] : LEASE_SOCKET);
+}
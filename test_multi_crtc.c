@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+
+/* Upper bound of simultaneously driven heads */
+#define MAX_HEADS 8
+
+/*
+ * One active crtc with its own swapchain and worker thread. Worker renders
+ * and flips its head only, so a slow head doesn't hold back the others.
+ */
+struct head {
+	struct test_data *t_data;
+	struct kms_device *dev;
+	uint32_t crtc_id;
+	drmModeConnectorPtr con;
+
+	struct kms_buffer buffer[2];
+	int front;		/* buffer being scanned out */
+
+	int cpu;		/* cpu worker is pinned to, -1: not pinned */
+	int evt_fd;		/* coordinator signals page flip completion */
+	atomic_int *quit;
+	pthread_t worker;
+
+	unsigned int frames;
+	double start_ms, end_ms;
+};
+
+/* main data structure to store info retrieved from drm drivers */
+struct test_data {
+	struct kms_device dev;
+
+	struct head head[MAX_HEADS];
+	int n_heads;
+
+	atomic_int quit;
+};
+
+/*
+ * Assign a free crtc to every connector with a valid mode. Return number
+ * of heads set up.
+ */
+static int get_heads(struct test_data *t_data)
+{
+	struct kms_device *dev = &t_data->dev;
+	drmModeResPtr res_ptr = dev->res_ptr;
+	uint32_t used_crtcs = 0;
+	int i, j, k;
+
+	for (i = 0; i < res_ptr->count_connectors &&
+		t_data->n_heads < MAX_HEADS; i++) {
+		struct head *head = &t_data->head[t_data->n_heads];
+		drmModeConnectorPtr con_ptr;
+
+		con_ptr = kms_get_connector(dev->fd, &dev->arena,
+			&res_ptr->connectors[i], 1);
+		if (!con_ptr || con_ptr->connection != DRM_MODE_CONNECTED)
+			continue;
+
+		for (j = 0; j < con_ptr->count_encoders && !head->crtc_id; j++) {
+			drmModeEncoderPtr enc_ptr =
+				drmModeGetEncoder(dev->fd, con_ptr->encoders[j]);
+
+			if (!enc_ptr)
+				continue;
+
+			for (k = 0; k < res_ptr->count_crtcs; k++) {
+				if ((enc_ptr->possible_crtcs & (1 << k)) &&
+					!(used_crtcs & (1 << k))) {
+					used_crtcs |= 1 << k;
+					head->crtc_id = res_ptr->crtcs[k];
+					break;
+				}
+			}
+			drmModeFreeEncoder(enc_ptr);
+		}
+
+		if (!head->crtc_id)
+			continue;
+
+		head->t_data = t_data;
+		head->dev = dev;
+		head->con = con_ptr;
+		t_data->n_heads++;
+	}
+
+	return t_data->n_heads;
+}
+
+/* Render next frame into back buffer and flip to it */
+static void flip_head(struct head *head)
+{
+	struct kms_buffer *back = &head->buffer[!head->front];
+
+	kms_fill_frame(back, KMS_FILL_TILES, head->frames);
+
+	kms_legacy_page_flip(head->dev, head->crtc_id, back->buf_id,
+		DRM_MODE_PAGE_FLIP_EVENT, head->t_data);
+}
+
+/*
+ * Per crtc worker. Renders and flips its own head each time coordinator
+ * reports the previous flip done. Shared drm fd is only used for ioctls,
+ * events are read by coordinator.
+ */
+static void *head_worker(void *arg)
+{
+	struct head *head = arg;
+	uint64_t count;
+
+	if (head->cpu >= 0) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(head->cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+	}
+
+	head->start_ms = kms_now_ns() / 1e6;
+	flip_head(head);
+
+	while (read(head->evt_fd, &count, sizeof(count)) == sizeof(count) &&
+		!atomic_load(head->quit)) {
+		head->front = !head->front;
+		head->frames++;
+		flip_head(head);
+	}
+	head->end_ms = kms_now_ns() / 1e6;
+
+	return NULL;
+}
+
+/* Hand page flip event over to worker of the crtc it completed on */
+static void
+page_flip_handler2(int fd, unsigned int sequence, unsigned int tv_sec,
+	unsigned int tv_usec, unsigned int crtc_id, void *user_data)
+{
+	struct test_data *t_data = user_data;
+	uint64_t one = 1;
+	int i;
+
+	for (i = 0; i < t_data->n_heads; i++) {
+		if (t_data->head[i].crtc_id == crtc_id) {
+			write(t_data->head[i].evt_fd, &one, sizeof(one));
+			break;
+		}
+	}
+}
+
+/* Parse comma separated cpu list into heads, in head order */
+static void set_head_cpus(struct test_data *t_data, const char *cpu_list)
+{
+	const char *p = cpu_list;
+	int i;
+
+	for (i = 0; i < t_data->n_heads; i++) {
+		t_data->head[i].cpu = -1;
+		if (p && *p) {
+			t_data->head[i].cpu = atoi(p);
+			p = strchr(p, ',');
+			if (p)
+				p++;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_data t_data;
+	int i, j;
+	int fd;
+	drmEventContext evt_ctx;
+	uint64_t cap = 0;
+	uint64_t one = 1;
+
+	/* Check if drm driver name is provided by user */
+	if (argc < 2) {
+		printf("usage: %s <drm driver> [cpu,cpu,...]\n", argv[0]);
+		return -1;
+	}
+
+	memset(&t_data, 0, sizeof(struct test_data));
+
+	/*
+	 * Open drm device node /dev/dri/cardX, and discover its resources
+	 * and properties.
+	 */
+	if (kms_open(&t_data.dev, argv[1], 0))
+		return -1;
+	fd = t_data.dev.fd;
+
+	/* page_flip_handler2 needs crtc id in page flip events */
+	if (drmGetCap(fd, DRM_CAP_CRTC_IN_VBLANK_EVENT, &cap) || !cap) {
+		printf("drm driver doesn't report crtc in page flip events\n");
+		return -1;
+	}
+
+	/* Find a crtc for every connected connector */
+	if (!get_heads(&t_data)) {
+		printf("no connector with valid mode found\n");
+		return -1;
+	}
+	set_head_cpus(&t_data, argc > 2 ? argv[2] : NULL);
+
+	/* Report footprint of discovered metadata */
+	kms_arena_report(&t_data.dev.arena);
+
+	/* Acquire a swapchain per head and set modes */
+	for (i = 0; i < t_data.n_heads; i++) {
+		struct head *head = &t_data.head[i];
+
+		for (j = 0; j < 2; j++)
+			kms_add_buffer(fd, &head->buffer[j],
+				head->con->modes[0].hdisplay,
+				head->con->modes[0].vdisplay, DRM_FORMAT_XRGB8888);
+
+		drmModeSetCrtc(fd, head->crtc_id, head->buffer[0].buf_id, 0, 0,
+			&head->con->connector_id, 1, &head->con->modes[0]);
+
+		head->evt_fd = eventfd(0, EFD_CLOEXEC);
+		head->quit = &t_data.quit;
+	}
+
+	/* Start one worker per head */
+	for (i = 0; i < t_data.n_heads; i++)
+		pthread_create(&t_data.head[i].worker, NULL, head_worker,
+			&t_data.head[i]);
+
+	/* Setup page flip event handler, demultiplexed by crtc id */
+	memset(&evt_ctx, 0, sizeof(drmEventContext));
+	evt_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evt_ctx.page_flip_handler2 = page_flip_handler2;
+
+	/* Coordinate page flip events. Exit if user presses a key. */
+	while (kms_wait_events(fd, &evt_ctx, -1, 1) > 0)
+		;
+
+	/* Stop workers */
+	atomic_store(&t_data.quit, 1);
+	for (i = 0; i < t_data.n_heads; i++) {
+		write(t_data.head[i].evt_fd, &one, sizeof(one));
+		pthread_join(t_data.head[i].worker, NULL);
+	}
+
+	for (i = 0; i < t_data.n_heads; i++) {
+		struct head *head = &t_data.head[i];
+		double secs = (head->end_ms - head->start_ms) / 1e3;
+
+		printf("crtc %u cpu %d %dx%d@%d: %u frames, %.2f fps\n",
+			head->crtc_id, head->cpu,
+			head->con->modes[0].hdisplay,
+			head->con->modes[0].vdisplay,
+			head->con->modes[0].vrefresh, head->frames,
+			secs > 0 ? head->frames / secs : 0);
+	}
+
+	/* Release all discovered metadata at once */
+	kms_close(&t_data.dev);
+
+	return 0;
+}
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+
+/* Upper bound of simultaneously driven devices */
+#define MAX_DEVICES 8
+
+/* Number of frame buffers in shared pool */
+#define N_BUFFERS 2
+
+struct test_data;
+
+/*
+ * One device with the display it drives. The shared pool lives on 1st
+ * device. Other devices scan out the same memory imported through PRIME,
+ * or, if they can't, a copy in their own buffers.
+ */
+struct display {
+	struct test_data *t_data;
+	struct kms_device *dev;
+	struct kms_output output;
+	int prime;
+
+	/* buffer[i] shows pool buffer i on this device */
+	struct kms_buffer buffer[N_BUFFERS];
+
+	unsigned int frames;
+};
+
+/* main data structure to store info retrieved from drm drivers */
+struct test_data {
+	struct kms_device dev[MAX_DEVICES];
+	struct display display[MAX_DEVICES];
+	int n_devs;
+
+	struct kms_buffer_pool pool;
+	int front;		/* pool buffer being scanned out */
+	int pending;		/* flips not completed yet */
+	unsigned int frames;
+	double start_ms, end_ms;
+};
+
+/* Copy a pool buffer into a device's own buffer, clipped to both */
+static void copy_buffer(struct kms_buffer *dst, struct kms_buffer *src)
+{
+	unsigned int width = src->dumb_buf.width < dst->dumb_buf.width ?
+		src->dumb_buf.width : dst->dumb_buf.width;
+	unsigned int height = src->dumb_buf.height < dst->dumb_buf.height ?
+		src->dumb_buf.height : dst->dumb_buf.height;
+	const uint8_t *s = src->buf_ptr;
+	uint8_t *d = dst->buf_ptr;
+	unsigned int y;
+
+	for (y = 0; y < height; y++) {
+		memcpy(d, s, width * 4);
+		d += dst->dumb_buf.pitch;
+		s += src->dumb_buf.pitch;
+	}
+}
+
+/*
+ * Render next frame once into the back buffer of the pool, copy it where
+ * PRIME isn't available and flip every device to it.
+ */
+static void flip_all(struct test_data *t_data)
+{
+	int back = !t_data->front;
+	struct kms_buffer *buffer = &t_data->pool.buffer[back];
+	int i;
+
+	kms_fill_buffer(buffer, t_data->frames & 1 ?
+		KMS_FILL_PLAIN : KMS_FILL_TILES);
+
+	for (i = 0; i < t_data->n_devs; i++) {
+		struct display *disp = &t_data->display[i];
+
+		if (i && !disp->prime)
+			copy_buffer(&disp->buffer[back], buffer);
+	}
+
+	for (i = 0; i < t_data->n_devs; i++) {
+		struct display *disp = &t_data->display[i];
+
+		if (!kms_legacy_page_flip(disp->dev,
+			disp->output.crtc->crtc_id, disp->buffer[back].buf_id,
+			DRM_MODE_PAGE_FLIP_EVENT, disp))
+			t_data->pending++;
+	}
+	t_data->front = back;
+}
+
+/*
+ * Devices flip in lockstep: next frame is rendered once the flip has
+ * completed on every device, so the slowest display sets the pace.
+ */
+static void
+page_flip_handler(int fd, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+	struct display *disp = user_data;
+	struct test_data *t_data = disp->t_data;
+
+	disp->frames++;
+	if (--t_data->pending)
+		return;
+
+	t_data->frames++;
+	flip_all(t_data);
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_data t_data;
+	int i, j;
+	int min_planes = 0;
+	unsigned int flags = KMS_OPEN_TRY_ATOMIC;
+	uint16_t hsize = 0, vsize = 0;
+	drmEventContext evt_ctx;
+	double secs;
+
+	/*
+	 * Devices are picked by capability, not by name: dumb buffers
+	 * always, optionally a minimum plane count and atomic commit.
+	 */
+	if (argc > 1)
+		min_planes = atoi(argv[1]);
+	if (argc > 2 && !strcmp(argv[2], "atomic"))
+		flags = KMS_OPEN_ATOMIC;
+
+	memset(&t_data, 0, sizeof(struct test_data));
+
+	/* Open every capable device, discover resources and properties */
+	t_data.n_devs = kms_open_devices(t_data.dev, MAX_DEVICES, flags,
+		min_planes);
+
+	/* Find a connector, encoder and crtc on each, drop devices without */
+	for (i = 0, j = 0; i < t_data.n_devs; i++) {
+		struct display *disp = &t_data.display[j];
+
+		if (i != j)
+			t_data.dev[j] = t_data.dev[i];
+		disp->t_data = &t_data;
+		disp->dev = &t_data.dev[j];
+		if (kms_get_output(disp->dev, &disp->output, 0)) {
+			kms_close(disp->dev);
+			continue;
+		}
+		j++;
+	}
+	t_data.n_devs = j;
+	if (!t_data.n_devs) {
+		printf("usage: %s [min planes] [atomic]\n", argv[0]);
+		printf("no capable device with a display found\n");
+		return -1;
+	}
+
+	/* Shared pool is large enough for every mode */
+	for (i = 0; i < t_data.n_devs; i++) {
+		drmModeModeInfoPtr mode = &t_data.display[i].output.con->modes[0];
+
+		if (mode->hdisplay > hsize)
+			hsize = mode->hdisplay;
+		if (mode->vdisplay > vsize)
+			vsize = mode->vdisplay;
+	}
+
+	/* Acquire shared pool on 1st device and add it to drm */
+	if (kms_pool_init(t_data.dev[0].fd, &t_data.pool, N_BUFFERS, hsize,
+		vsize, DRM_FORMAT_XRGB8888)) {
+		printf("failed to allocate frame buffers\n");
+		return -1;
+	}
+	for (j = 0; j < N_BUFFERS; j++)
+		t_data.display[0].buffer[j] = t_data.pool.buffer[j];
+	t_data.display[0].prime = 1;
+
+	/* Import pool into other devices, fall back to own buffers */
+	for (i = 1; i < t_data.n_devs; i++) {
+		struct display *disp = &t_data.display[i];
+		drmModeModeInfoPtr mode = &disp->output.con->modes[0];
+
+		disp->prime = 1;
+		for (j = 0; j < N_BUFFERS && disp->prime; j++) {
+			if (kms_import_buffer(disp->dev, &disp->buffer[j],
+				&t_data.dev[0], &t_data.pool.buffer[j])) {
+				disp->prime = 0;
+				while (j--)
+					kms_put_buffer(disp->dev->fd,
+						&disp->buffer[j]);
+			}
+		}
+
+		for (j = 0; j < N_BUFFERS && !disp->prime; j++)
+			kms_add_buffer(disp->dev->fd, &disp->buffer[j],
+				mode->hdisplay, mode->vdisplay,
+				DRM_FORMAT_XRGB8888);
+	}
+
+	for (i = 0; i < t_data.n_devs; i++) {
+		struct display *disp = &t_data.display[i];
+		drmModeModeInfoPtr mode = &disp->output.con->modes[0];
+
+		printf("device %d: %dx%d@%d crtc %u, %s\n", i, mode->hdisplay,
+			mode->vdisplay, mode->vrefresh,
+			disp->output.crtc->crtc_id, !i ? "renders" :
+			disp->prime ? "PRIME import" : "copy");
+	}
+
+	/* Set modes with 1st frame */
+	kms_fill_buffer(&t_data.pool.buffer[0], KMS_FILL_TILES);
+	for (i = 1; i < t_data.n_devs; i++) {
+		if (!t_data.display[i].prime)
+			copy_buffer(&t_data.display[i].buffer[0],
+				&t_data.pool.buffer[0]);
+	}
+	for (i = 0; i < t_data.n_devs; i++) {
+		struct display *disp = &t_data.display[i];
+
+		drmModeSetCrtc(disp->dev->fd, disp->output.crtc->crtc_id,
+			disp->buffer[0].buf_id, 0, 0,
+			&disp->output.con->connector_id, 1,
+			&disp->output.con->modes[0]);
+	}
+	t_data.front = 0;
+
+	/* Setup page flip event handler, user data tells devices apart */
+	memset(&evt_ctx, 0, sizeof(drmEventContext));
+	evt_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evt_ctx.page_flip_handler = page_flip_handler;
+
+	/* 1st page flip on every device */
+	t_data.start_ms = kms_now_ns() / 1e6;
+	flip_all(&t_data);
+
+	/* One event loop across all device fds. Exit if user presses a key. */
+	while (t_data.pending &&
+		kms_wait_devices(t_data.dev, t_data.n_devs, &evt_ctx, -1, 1) > 0)
+		;
+	t_data.end_ms = kms_now_ns() / 1e6;
+
+	secs = (t_data.end_ms - t_data.start_ms) / 1e3;
+	printf("%u frames rendered once for %d devices, %.2f fps\n",
+		t_data.frames, t_data.n_devs,
+		secs > 0 ? t_data.frames / secs : 0);
+
+	/* Release imported and own buffers, then the shared pool */
+	for (i = 1; i < t_data.n_devs; i++) {
+		for (j = 0; j < N_BUFFERS; j++)
+			kms_put_buffer(t_data.dev[i].fd,
+				&t_data.display[i].buffer[j]);
+	}
+	kms_pool_fini(t_data.dev[0].fd, &t_data.pool);
+
+	/* Release all discovered metadata at once */
+	for (i = 0; i < t_data.n_devs; i++)
+		kms_close(&t_data.dev[i]);
+
+	return 0;
+}
@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+
+/*
+ * Scrolling content, e.g. a ticker. In ring mode each frame buffer is
+ * twice the mode along the scroll axis and holds every visible line
+ * twice, at position p and p + mode size, p = world position modulo mode
+ * size. The window at p is then always contiguous, and panning is an
+ * update of plane SRC_X/SRC_Y. A buffer is only written while off screen,
+ * with the lines exposed since it was last shown, so CPU work follows
+ * the scroll delta. Without ring mode every frame is redrawn.
+ */
+
+/* main data structure to store info retrieved from drm drivers */
+struct test_data {
+	struct kms_device dev;
+	struct kms_output output;
+	struct kms_buffer buffer[2];
+	drmModeAtomicReqPtr atomic_ptr;
+
+	int vertical;		/* scroll rows, else columns */
+	int ring;		/* pan oversized buffers, else redraw */
+	unsigned int width, height;	/* mode size */
+	unsigned int length;	/* mode size along scroll axis */
+	unsigned int speed;	/* pixels scrolled per frame */
+
+	unsigned int offset;	/* world position of visible window */
+	unsigned int valid_end[2];	/* world position rendered up to */
+	int front;
+
+	unsigned int frames;
+	double render_ms;
+	unsigned long long pixels;
+};
+
+/* Content at world coordinates (x, y), tiles that move with the scroll */
+static inline uint32_t world_pixel(unsigned int x, unsigned int y)
+{
+	return (0x00130502 * ((x >> 6) & 0xff) +
+		0x000a1120 * ((y >> 6) & 0xff)) & 0x00ffffff;
+}
+
+/* Draw w x h world pixels from (wx, wy) at (bx, by) of buffer */
+static void draw_world(struct kms_buffer *buffer, unsigned int bx,
+	unsigned int by, unsigned int wx, unsigned int wy, unsigned int w,
+	unsigned int h)
+{
+	uint8_t *row = (uint8_t *)buffer->buf_ptr +
+		(size_t)by * buffer->dumb_buf.pitch + bx * 4;
+	unsigned int x, y;
+
+	for (y = 0; y < h; y++) {
+		uint32_t *pixel = (uint32_t *)row;
+
+		for (x = 0; x < w; x++)
+			pixel[x] = world_pixel(wx + x, wy + y);
+		row += buffer->dumb_buf.pitch;
+	}
+}
+
+/* Draw world lines [start, end) along scroll axis into both ring copies */
+static void draw_lines(struct test_data *t_data, struct kms_buffer *buffer,
+	unsigned int start, unsigned int end)
+{
+	unsigned int len = t_data->length;
+
+	while (start < end) {
+		unsigned int pos = start % len;
+		unsigned int n = end - start < len - pos ?
+			end - start : len - pos;
+
+		if (t_data->vertical) {
+			draw_world(buffer, 0, pos, 0, start, t_data->width, n);
+			draw_world(buffer, 0, pos + len, 0, start,
+				t_data->width, n);
+		} else {
+			draw_world(buffer, pos, 0, start, 0, n, t_data->height);
+			draw_world(buffer, pos + len, 0, start, 0, n,
+				t_data->height);
+		}
+		t_data->pixels += 2ULL * n * (t_data->vertical ?
+			t_data->width : t_data->height);
+		start += n;
+	}
+}
+
+/* Bring buffer idx up to date for window at current offset */
+static void render(struct test_data *t_data, int idx)
+{
+	struct kms_buffer *buffer = &t_data->buffer[idx];
+	unsigned int end = t_data->offset + t_data->length;
+	unsigned int start = t_data->valid_end[idx];
+	double start_ms = kms_now_ns() / 1e6;
+
+	if (!t_data->ring) {
+		draw_world(buffer, 0, 0, t_data->vertical ? 0 : t_data->offset,
+			t_data->vertical ? t_data->offset : 0, t_data->width,
+			t_data->height);
+		t_data->pixels += (unsigned long long)t_data->width *
+			t_data->height;
+	} else {
+		/* Only lines exposed since buffer was last brought up to date */
+		if (end - start > t_data->length)
+			start = t_data->offset;
+		draw_lines(t_data, buffer, start, end);
+		t_data->valid_end[idx] = end;
+	}
+
+	t_data->render_ms += kms_now_ns() / 1e6 - start_ms;
+}
+
+/*
+ * Start a request showing buffer idx with the window at current offset.
+ * Plane src rect is mode size, at the window position in ring mode.
+ */
+static void add_window(struct test_data *t_data, int idx)
+{
+	uint32_t pos = t_data->ring ? t_data->offset % t_data->length : 0;
+
+	drmModeAtomicSetCursor(t_data->atomic_ptr, 0);
+	kms_add_plane(&t_data->dev, t_data->atomic_ptr,
+		t_data->output.plane->plane_id, t_data->output.crtc->crtc_id,
+		t_data->buffer[idx].buf_id, 0, 0, t_data->width,
+		t_data->height, t_data->vertical ? 0 : pos << 16,
+		t_data->vertical ? pos << 16 : 0, t_data->width << 16,
+		t_data->height << 16);
+}
+
+static void
+page_flip_handler(int fd, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+	struct test_data *t_data = user_data;
+	int back = !t_data->front;
+
+	t_data->frames++;
+
+	/* Scroll on, render into the buffer off screen and flip to it */
+	t_data->offset += t_data->speed;
+	render(t_data, back);
+	add_window(t_data, back);
+	drmModeAtomicCommit(fd, t_data->atomic_ptr,
+		DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, t_data);
+	t_data->front = back;
+}
+
+/* Return 0 on success, -1 if frame buffers can't be allocated */
+static int add_buffers(struct test_data *t_data)
+{
+	unsigned int w = t_data->width, h = t_data->height;
+	int i;
+
+	if (t_data->ring) {
+		if (t_data->vertical)
+			h *= 2;
+		else
+			w *= 2;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (kms_add_buffer(t_data->dev.fd, &t_data->buffer[i], w, h,
+			DRM_FORMAT_XRGB8888))
+			return -1;
+		t_data->valid_end[i] = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Set mode with 1st frame. In ring mode, probe first whether the plane
+ * takes an oversized buffer panned half way. Return 0 on success.
+ */
+static int set_mode(struct test_data *t_data)
+{
+	drmModeConnectorPtr active_con = t_data->output.con;
+	drmModeCrtcPtr active_crtc = t_data->output.crtc;
+	struct kms_device *dev = &t_data->dev;
+	uint32_t mode_blob_id;
+	uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+	mode_blob_id = kms_blob_get(dev->fd, &dev->blobs, active_con->modes,
+		sizeof(drmModeModeInfo));
+
+	for (;;) {
+		if (t_data->ring)
+			t_data->offset = t_data->length / 2;
+		render(t_data, 0);
+		t_data->pixels = 0;
+		t_data->render_ms = 0;
+
+		/* Plane, crtc and connector state */
+		add_window(t_data, 0);
+		kms_add_property(dev, t_data->atomic_ptr, DRM_MODE_OBJECT_CRTC,
+			active_crtc->crtc_id, "MODE_ID", mode_blob_id);
+		kms_add_property(dev, t_data->atomic_ptr, DRM_MODE_OBJECT_CRTC,
+			active_crtc->crtc_id, "ACTIVE", 1);
+		kms_add_property(dev, t_data->atomic_ptr,
+			DRM_MODE_OBJECT_CONNECTOR, active_con->connector_id,
+			"CRTC_ID", active_crtc->crtc_id);
+
+		if (!t_data->ring || !drmModeAtomicCommit(dev->fd,
+			t_data->atomic_ptr, flags | DRM_MODE_ATOMIC_TEST_ONLY,
+			NULL))
+			break;
+
+		/* Plane can't pan an oversized buffer, redraw every frame */
+		printf("panning rejected, redrawing every frame\n");
+		kms_put_buffer(dev->fd, &t_data->buffer[0]);
+		kms_put_buffer(dev->fd, &t_data->buffer[1]);
+		t_data->ring = 0;
+		if (add_buffers(t_data))
+			return -1;
+	}
+
+	return drmModeAtomicCommit(dev->fd, t_data->atomic_ptr, flags, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_data t_data;
+	int i;
+	drmModeConnectorPtr active_con;
+	drmEventContext evt_ctx;
+	unsigned long long area;
+
+	/* Check if drm driver name is provided by user */
+	if (argc < 2) {
+		printf("usage: %s <drm driver> [speed] [vertical] [redraw]\n",
+			argv[0]);
+		return -1;
+	}
+
+	memset(&t_data, 0, sizeof(struct test_data));
+	t_data.ring = 1;
+	t_data.speed = 4;
+	if (argc > 2)
+		t_data.speed = atoi(argv[2]);
+	for (i = 3; i < argc; i++) {
+		if (!strcmp(argv[i], "vertical"))
+			t_data.vertical = 1;
+		else if (!strcmp(argv[i], "redraw"))
+			t_data.ring = 0;
+	}
+
+	/*
+	 * Open drm device node /dev/dri/cardX with atomic commit enabled,
+	 * and discover its resources and properties.
+	 */
+	if (kms_open(&t_data.dev, argv[1], KMS_OPEN_ATOMIC))
+		return -1;
+
+	/* Allocate drm atomic structure */
+	t_data.atomic_ptr = drmModeAtomicAlloc();
+
+	/* Find a connector, encoder, crtc and plane */
+	if (kms_get_output(&t_data.dev, &t_data.output, 1))
+		return -1;
+	active_con = t_data.output.con;
+	t_data.width = active_con->modes[0].hdisplay;
+	t_data.height = active_con->modes[0].vdisplay;
+	t_data.length = t_data.vertical ? t_data.height : t_data.width;
+	if (t_data.speed > t_data.length)
+		t_data.speed = t_data.length;
+
+	/* Oversized buffers must fit frame buffer limits of the device */
+	if (t_data.ring && 2 * t_data.length > (t_data.vertical ?
+		t_data.dev.res_ptr->max_height : t_data.dev.res_ptr->max_width)) {
+		printf("ring buffer exceeds frame buffer limits, "
+			"redrawing every frame\n");
+		t_data.ring = 0;
+	}
+
+	/* Acquire 2 frame buffers and add them to drm */
+	if (add_buffers(&t_data) || set_mode(&t_data)) {
+		printf("failed to set mode\n");
+		return -1;
+	}
+	t_data.front = 0;
+
+	/* Setup page flip event handler */
+	memset(&evt_ctx, 0, sizeof(drmEventContext));
+	evt_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evt_ctx.page_flip_handler = page_flip_handler;
+
+	/* 1st page flip */
+	page_flip_handler(t_data.dev.fd, 0, 0, 0, &t_data);
+	t_data.frames = 0;
+
+	/* Wait for page flip event. Exit if user presses a key. */
+	while (kms_wait_events(t_data.dev.fd, &evt_ctx, -1, 1) > 0)
+		;
+
+	area = (unsigned long long)t_data.width * t_data.height;
+	if (t_data.frames)
+		printf("%s, %u px/frame %s: %u frames, %.3f ms and %.1f%% "
+			"of screen rendered per frame\n",
+			t_data.ring ? "ring panning" : "full redraw",
+			t_data.speed, t_data.vertical ? "vertical" :
+			"horizontal", t_data.frames,
+			t_data.render_ms / (t_data.frames + 1),
+			100.0 * t_data.pixels / (t_data.frames + 1) / area);
+
+	kms_put_buffer(t_data.dev.fd, &t_data.buffer[0]);
+	kms_put_buffer(t_data.dev.fd, &t_data.buffer[1]);
+
+	/* Release blobs and all discovered metadata at once */
+	kms_close(&t_data.dev);
+	drmModeAtomicFree(t_data.atomic_ptr);
+
+	return 0;
+}
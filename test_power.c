@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+
+/* main data structure to store info retrieved from drm drivers */
+struct test_data {
+	struct kms_device dev;
+	struct kms_output output;
+	struct kms_buffer_pool pool;
+	drmModeAtomicReqPtr atomic_ptr;
+	int front;		/* pool buffer being scanned out */
+
+	double frame_ms;	/* time 1st frame was shown, 0 until then */
+};
+
+static void
+page_flip_handler(int fd, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+	struct test_data *t_data = user_data;
+
+	t_data->frame_ms = kms_now_ns() / 1e6;
+}
+
+/* Return 0 once frame_ms is set, -1 on timeout or key press */
+static int wait_frame(struct test_data *t_data, drmEventContext *evt_ctx)
+{
+	while (!t_data->frame_ms) {
+		if (kms_wait_events(t_data->dev.fd, evt_ctx, 1000, 1) <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Flip to the other pool buffer with an event, merged with pending updates */
+static void flip(struct test_data *t_data)
+{
+	t_data->front = !t_data->front;
+	kms_legacy_page_flip(&t_data->dev, t_data->output.crtc->crtc_id,
+		t_data->pool.buffer[t_data->front].buf_id,
+		DRM_MODE_PAGE_FLIP_EVENT, t_data);
+	kms_legacy_commit(&t_data->dev);
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_data t_data;
+	int i;
+	int fd;
+	int cycles = 5;
+	int blank_ms = 1000;
+	unsigned int flags = KMS_OPEN_TRY_ATOMIC;
+	drmModeConnectorPtr active_con;
+	drmModeCrtcPtr active_crtc;
+	drmEventContext evt_ctx;
+	double start, cold_ms, ms;
+	double min_ms = 0, max_ms = 0, total_ms = 0;
+	int wakes = 0;
+
+	/* Check if drm driver name is provided by user */
+	if (argc < 2) {
+		printf("usage: %s <drm driver> [cycles] [blank ms] [legacy]\n",
+			argv[0]);
+		return -1;
+	}
+	if (argc > 2)
+		cycles = atoi(argv[2]);
+	if (argc > 3)
+		blank_ms = atoi(argv[3]);
+	if (argc > 4 && !strcmp(argv[4], "legacy"))
+		flags = 0;
+
+	memset(&t_data, 0, sizeof(struct test_data));
+
+	/* Setup page flip event handler */
+	memset(&evt_ctx, 0, sizeof(drmEventContext));
+	evt_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evt_ctx.page_flip_handler = page_flip_handler;
+
+	/*
+	 * Cold start, the sequence a wake would otherwise repeat: open and
+	 * discover, allocate and draw buffers, set mode and flip.
+	 */
+	start = kms_now_ns() / 1e6;
+	if (kms_open(&t_data.dev, argv[1], flags))
+		return -1;
+	fd = t_data.dev.fd;
+	if (t_data.dev.atomic)
+		t_data.atomic_ptr = drmModeAtomicAlloc();
+
+	/* Find a connector, encoder and crtc */
+	if (kms_get_output(&t_data.dev, &t_data.output, 0))
+		return -1;
+	active_con = t_data.output.con;
+	active_crtc = t_data.output.crtc;
+
+	/* Setup legacy to atomic translation */
+	kms_legacy_init(&t_data.dev, t_data.atomic_ptr);
+
+	/* Acquire 2 frame buffers, draw something different in each */
+	if (kms_pool_init(fd, &t_data.pool, 2, active_con->modes[0].hdisplay,
+		active_con->modes[0].vdisplay, DRM_FORMAT_XRGB8888)) {
+		printf("failed to allocate frame buffers\n");
+		return -1;
+	}
+	kms_fill_buffer(&t_data.pool.buffer[0], KMS_FILL_TILES);
+	kms_fill_buffer(&t_data.pool.buffer[1], KMS_FILL_PLAIN);
+
+	/* Set mode and flip, a single commit with atomic */
+	kms_legacy_set_crtc(&t_data.dev, active_crtc->crtc_id,
+		t_data.pool.buffer[0].buf_id, 0, 0, &active_con->connector_id,
+		1, &active_con->modes[0]);
+	flip(&t_data);
+	if (wait_frame(&t_data, &evt_ctx)) {
+		printf("no page flip event after mode set\n");
+		kms_close(&t_data.dev);
+		return -1;
+	}
+	cold_ms = t_data.frame_ms - start;
+
+	/*
+	 * Blank and wake. Mode, frame buffers and plane state stay
+	 * resident, a wake with atomic is one commit toggling ACTIVE.
+	 */
+	for (i = 0; i < cycles; i++) {
+		if (kms_set_power(&t_data.dev, &t_data.output, 0, NULL)) {
+			printf("failed to blank\n");
+			break;
+		}
+		usleep(blank_ms * 1000);
+
+		t_data.frame_ms = 0;
+		start = kms_now_ns() / 1e6;
+		if (kms_set_power(&t_data.dev, &t_data.output, 1,
+			t_data.dev.atomic ? &t_data : NULL)) {
+			printf("failed to wake\n");
+			break;
+		}
+		if (!t_data.dev.atomic)
+			flip(&t_data);
+		if (wait_frame(&t_data, &evt_ctx))
+			break;
+
+		ms = t_data.frame_ms - start;
+		if (!wakes || ms < min_ms)
+			min_ms = ms;
+		if (ms > max_ms)
+			max_ms = ms;
+		total_ms += ms;
+		wakes++;
+	}
+
+	printf("cold start to 1st frame: %.2f ms\n", cold_ms);
+	if (wakes)
+		printf("wake to 1st frame (%s): min %.2f avg %.2f max %.2f ms "
+			"over %d wakes\n", t_data.dev.atomic ? "ACTIVE" : "DPMS",
+			min_ms, total_ms / wakes, max_ms, wakes);
+
+	kms_pool_fini(fd, &t_data.pool);
+
+	/* Release blobs and all discovered metadata at once */
+	kms_close(&t_data.dev);
+	if (t_data.atomic_ptr)
+		drmModeAtomicFree(t_data.atomic_ptr);
+
+	return 0;
+}
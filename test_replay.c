@@ -0,0 +1,682 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+#include "kms_record.h"
+
+/*
+ * Re-issue a trace written by the kms_record recorder against a device,
+ * at recorded pace or as fast as flips complete, and compare latency from
+ * submit to flip with the recorded one. Object ids are taken to be the
+ * same as when recording, i.e. same device and driver.
+ */
+
+#define MAX_PENDING 64
+#define MAX_CRTCS 16
+
+/* Latency samples, in ms */
+struct samples {
+	double *ms;
+	unsigned int n, size;
+};
+
+/*
+ * Submit times of flips waiting for their event on one crtc, oldest
+ * first. Crtc 0 holds submits whose crtc isn't known.
+ */
+struct submit_fifo {
+	uint32_t crtc_id;
+	uint64_t ns[MAX_PENDING];
+	unsigned int head, count;
+	uint64_t last_vblank_ns;
+};
+
+/* Recorded id and the one replay created in its place */
+struct id_map {
+	uint32_t from, to;
+	struct kms_buffer buffer;	/* frame buffers only */
+};
+
+/* main data structure to store info retrieved from drm drivers */
+struct test_data {
+	struct kms_device dev;
+	drmModeAtomicReqPtr atomic_ptr;
+
+	uint8_t *trace;
+	size_t trace_size;
+
+	const struct kms_rec_property **prop;
+	unsigned int n_props;
+	struct id_map *fb, *blob;
+	unsigned int n_fbs, n_blobs;
+
+	struct submit_fifo fifo[MAX_CRTCS];
+	unsigned int n_fifos, pending;
+	struct samples latency, interval;
+	unsigned int failed;
+};
+
+static void add_sample(struct samples *s, double ms)
+{
+	if (s->n == s->size) {
+		unsigned int size = s->size ? 2 * s->size : 256;
+		double *p = realloc(s->ms, size * sizeof(double));
+
+		if (!p)
+			return;
+		s->ms = p;
+		s->size = size;
+	}
+	s->ms[s->n++] = ms;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_samples(const char *name, struct samples *s)
+{
+	double *ms = s->ms;
+	unsigned int n = s->n;
+
+	if (!n) {
+		printf("  %-14s no samples\n", name);
+		return;
+	}
+
+	qsort(ms, n, sizeof(double), compare_double);
+	printf("  %-14s %6u samples, p50 %.3f p90 %.3f p99 %.3f max %.3f ms\n",
+		name, n, ms[n / 2], ms[(n * 90) / 100], ms[(n * 99) / 100],
+		ms[n - 1]);
+}
+
+/* Return submit fifo of crtc_id, added if new, NULL if out of room */
+static struct submit_fifo *get_fifo(struct test_data *t_data,
+	uint32_t crtc_id)
+{
+	struct submit_fifo *fifo;
+	unsigned int i;
+
+	for (i = 0; i < t_data->n_fifos; i++) {
+		if (t_data->fifo[i].crtc_id == crtc_id)
+			return &t_data->fifo[i];
+	}
+	if (t_data->n_fifos == MAX_CRTCS)
+		return NULL;
+
+	fifo = &t_data->fifo[t_data->n_fifos++];
+	memset(fifo, 0, sizeof(struct submit_fifo));
+	fifo->crtc_id = crtc_id;
+
+	return fifo;
+}
+
+static void push_submit(struct test_data *t_data, uint32_t crtc_id,
+	uint64_t ns)
+{
+	struct submit_fifo *fifo = get_fifo(t_data, crtc_id);
+
+	if (!fifo || fifo->count == MAX_PENDING)
+		return;
+	fifo->ns[(fifo->head + fifo->count++) % MAX_PENDING] = ns;
+	t_data->pending++;
+}
+
+/*
+ * Return fifo a flip event of crtc_id completes: the crtc's own, or the
+ * one with the oldest pending submit if the crtc has none or the event
+ * didn't tell its crtc. NULL if no flip is pending.
+ */
+static struct submit_fifo *event_fifo(struct test_data *t_data,
+	uint32_t crtc_id)
+{
+	struct submit_fifo *oldest = NULL;
+	unsigned int i;
+
+	for (i = 0; i < t_data->n_fifos; i++) {
+		struct submit_fifo *fifo = &t_data->fifo[i];
+
+		if (!fifo->count)
+			continue;
+		if (crtc_id && fifo->crtc_id == crtc_id)
+			return fifo;
+		if (!oldest || fifo->ns[fifo->head] < oldest->ns[oldest->head])
+			oldest = fifo;
+	}
+
+	return oldest;
+}
+
+/* Account a flip of crtc_id completed at vblank_ns to its pending submit */
+static void complete_flip(struct test_data *t_data, uint32_t crtc_id,
+	uint64_t vblank_ns)
+{
+	struct submit_fifo *fifo = event_fifo(t_data, crtc_id);
+
+	if (!fifo)
+		return;
+
+	add_sample(&t_data->latency, (vblank_ns - fifo->ns[fifo->head]) / 1e6);
+	fifo->head = (fifo->head + 1) % MAX_PENDING;
+	fifo->count--;
+	t_data->pending--;
+
+	if (fifo->last_vblank_ns)
+		add_sample(&t_data->interval,
+			(vblank_ns - fifo->last_vblank_ns) / 1e6);
+	fifo->last_vblank_ns = vblank_ns;
+}
+
+/* Return next record at *pos and advance past it, NULL at the end */
+static const struct kms_rec_header *
+next_record(struct test_data *t_data, size_t *pos, const void **payload)
+{
+	const struct kms_rec_header *header;
+
+	if (*pos + sizeof(struct kms_rec_header) > t_data->trace_size)
+		return NULL;
+
+	header = (const void *)(t_data->trace + *pos);
+	if (header->size > t_data->trace_size - *pos -
+		sizeof(struct kms_rec_header))
+		return NULL;
+
+	*payload = header + 1;
+	*pos += sizeof(struct kms_rec_header) + header->size;
+
+	return header;
+}
+
+static const struct kms_rec_property *
+find_property(struct test_data *t_data, uint32_t prop_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < t_data->n_props; i++) {
+		if (t_data->prop[i]->prop_id == prop_id)
+			return t_data->prop[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Push a submit for every crtc an atomic request drives, as each gets
+ * its own flip event. Crtcs are those planes and connectors are set to.
+ */
+static void push_commit(struct test_data *t_data,
+	const struct kms_rec_commit *rec, uint64_t ns)
+{
+	const struct kms_rec_value *value = (const void *)(rec + 1);
+	uint32_t crtcs[MAX_CRTCS];
+	unsigned int i, j, n = 0;
+
+	for (i = 0; i < rec->count; i++) {
+		const struct kms_rec_property *prop =
+			find_property(t_data, value[i].prop_id);
+
+		if (!prop || strcmp(prop->name, "CRTC_ID") || !value[i].value)
+			continue;
+		for (j = 0; j < n && crtcs[j] != value[i].value; j++)
+			;
+		if (j == n && n < MAX_CRTCS)
+			crtcs[n++] = value[i].value;
+	}
+
+	if (!n)
+		push_submit(t_data, 0, ns);
+	for (i = 0; i < n; i++)
+		push_submit(t_data, crtcs[i], ns);
+}
+
+/* Return 1 if a submit asks for a page flip event and was accepted */
+static int wants_event(uint32_t flags, int32_t ret)
+{
+	return !ret && (flags & DRM_MODE_PAGE_FLIP_EVENT) &&
+		!(flags & DRM_MODE_ATOMIC_TEST_ONLY);
+}
+
+/*
+ * Pass over the trace: index property descriptions and measure latency
+ * the recorded process saw, from the time of each submit asking for an
+ * event to the kernel timestamp of its flip.
+ */
+static int scan_trace(struct test_data *t_data)
+{
+	const struct kms_rec_header *header;
+	const void *payload;
+	size_t pos = 8;
+
+	while ((header = next_record(t_data, &pos, &payload))) {
+		switch (header->type) {
+		case KMS_REC_PROPERTY: {
+			const struct kms_rec_property **prop =
+				realloc(t_data->prop, (t_data->n_props + 1) *
+				sizeof(*prop));
+
+			if (!prop)
+				return -1;
+			t_data->prop = prop;
+			t_data->prop[t_data->n_props++] = payload;
+			break;
+		}
+		case KMS_REC_COMMIT: {
+			const struct kms_rec_commit *rec = payload;
+
+			if (wants_event(rec->flags, rec->ret))
+				push_commit(t_data, rec, header->time_ns);
+			break;
+		}
+		case KMS_REC_PAGE_FLIP: {
+			const struct kms_rec_page_flip *rec = payload;
+
+			if (wants_event(rec->flags, rec->ret))
+				push_submit(t_data, rec->crtc_id,
+					header->time_ns);
+			break;
+		}
+		case KMS_REC_EVENT: {
+			const struct kms_rec_event *rec = payload;
+
+			complete_flip(t_data, rec->crtc_id, rec->vblank_ns);
+			break;
+		}
+		}
+	}
+
+	return pos == t_data->trace_size ? 0 : -1;
+}
+
+static struct id_map *find_id(struct id_map *map, unsigned int n, uint32_t id)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (map[i].from == id)
+			return &map[i];
+	}
+
+	return NULL;
+}
+
+/* Return replayed id of recorded id, unmapped ids pass through */
+static uint32_t map_id(struct id_map *map, unsigned int n, uint32_t id)
+{
+	struct id_map *entry = find_id(map, n, id);
+
+	return entry ? entry->to : id;
+}
+
+static struct id_map *add_id(struct id_map **map, unsigned int *n,
+	uint32_t from)
+{
+	struct id_map *entry = find_id(*map, *n, from);
+
+	if (entry)
+		return entry;
+
+	entry = realloc(*map, (*n + 1) * sizeof(struct id_map));
+	if (!entry)
+		return NULL;
+	*map = entry;
+	entry = &entry[(*n)++];
+	memset(entry, 0, sizeof(struct id_map));
+	entry->from = from;
+
+	return entry;
+}
+
+/* Recreate a recorded frame buffer as a dumb buffer of same size, format */
+static void replay_add_fb(struct test_data *t_data,
+	const struct kms_rec_fb *rec)
+{
+	struct id_map *entry = add_id(&t_data->fb, &t_data->n_fbs, rec->fb_id);
+
+	if (!entry)
+		return;
+
+	/* Dumb buffers hold a single plane */
+	if (rec->offsets[1] || rec->pitches[1]) {
+		printf("can't recreate multi-planar frame buffer\n");
+		return;
+	}
+	if (kms_add_buffer(t_data->dev.fd, &entry->buffer, rec->width,
+		rec->height, rec->format)) {
+		printf("can't recreate %ux%u frame buffer of format %.4s\n",
+			rec->width, rec->height, (const char *)&rec->format);
+		kms_put_buffer(t_data->dev.fd, &entry->buffer);
+		memset(&entry->buffer, 0, sizeof(struct kms_buffer));
+		return;
+	}
+	kms_fill_buffer(&entry->buffer, KMS_FILL_TILES);
+	entry->to = entry->buffer.buf_id;
+}
+
+static void replay_rm_fb(struct test_data *t_data, uint32_t fb_id)
+{
+	struct id_map *entry = find_id(t_data->fb, t_data->n_fbs, fb_id);
+
+	if (!entry)
+		return;
+	kms_put_buffer(t_data->dev.fd, &entry->buffer);
+	*entry = t_data->fb[--t_data->n_fbs];
+}
+
+static void replay_blob(struct test_data *t_data,
+	const struct kms_rec_blob *rec)
+{
+	struct id_map *entry = add_id(&t_data->blob, &t_data->n_blobs,
+		rec->blob_id);
+
+	if (entry && drmModeCreatePropertyBlob(t_data->dev.fd, rec + 1,
+		rec->length, &entry->to))
+		entry->to = 0;
+}
+
+static void replay_destroy_blob(struct test_data *t_data, uint32_t blob_id)
+{
+	struct id_map *entry = find_id(t_data->blob, t_data->n_blobs, blob_id);
+
+	if (!entry)
+		return;
+	if (entry->to)
+		drmModeDestroyPropertyBlob(t_data->dev.fd, entry->to);
+	*entry = t_data->blob[--t_data->n_blobs];
+}
+
+/*
+ * Rebuild a recorded atomic request. Property ids are looked up by name
+ * on the same object, frame buffer and blob values are mapped. Fences
+ * were the recorded process's own and are left out.
+ */
+static void build_request(struct test_data *t_data,
+	const struct kms_rec_commit *rec)
+{
+	const struct kms_rec_value *value = (const void *)(rec + 1);
+	uint32_t i;
+
+	drmModeAtomicSetCursor(t_data->atomic_ptr, 0);
+
+	for (i = 0; i < rec->count; i++) {
+		const struct kms_rec_property *prop =
+			find_property(t_data, value[i].prop_id);
+		uint64_t v = value[i].value;
+		uint32_t prop_id;
+
+		if (!prop || !strcmp(prop->name, "IN_FENCE_FD") ||
+			!strcmp(prop->name, "OUT_FENCE_PTR"))
+			continue;
+
+		prop_id = kms_get_prop_id(t_data->dev.prop_ptr,
+			DRM_MODE_OBJECT_ANY, value[i].obj_id, prop->name);
+		if (!prop_id)
+			continue;
+
+		if (!strcmp(prop->name, "FB_ID"))
+			v = map_id(t_data->fb, t_data->n_fbs, v);
+		else if (prop->flags & DRM_MODE_PROP_BLOB)
+			v = map_id(t_data->blob, t_data->n_blobs, v);
+
+		drmModeAtomicAddProperty(t_data->atomic_ptr, value[i].obj_id,
+			prop_id, v);
+	}
+}
+
+static void
+page_flip_handler2(int fd, unsigned int sequence, unsigned int tv_sec,
+	unsigned int tv_usec, unsigned int crtc_id, void *user_data)
+{
+	struct test_data *t_data = user_data;
+
+	complete_flip(t_data, crtc_id,
+		tv_sec * 1000000000ull + tv_usec * 1000ull);
+}
+
+/* Dispatch events until no flip is pending, -1 if one never completes */
+static int wait_idle(struct test_data *t_data, drmEventContext *evt_ctx)
+{
+	while (t_data->pending) {
+		if (kms_wait_events(t_data->dev.fd, evt_ctx, 1000, 0) <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Dispatch events until time target_ns */
+static void wait_until(struct test_data *t_data, drmEventContext *evt_ctx,
+	uint64_t target_ns)
+{
+	uint64_t now;
+
+	while ((now = kms_now_ns()) < target_ns) {
+		int ms = (target_ns - now + 999999) / 1000000;
+
+		if (!t_data->pending) {
+			usleep((target_ns - now) / 1000);
+			break;
+		}
+		if (kms_wait_events(t_data->dev.fd, evt_ctx, ms, 0) < 0)
+			break;
+	}
+}
+
+/* Submit a recorded call, return 0 if it was skipped or succeeded */
+static int replay_submit(struct test_data *t_data,
+	const struct kms_rec_header *header, const void *payload)
+{
+	int fd = t_data->dev.fd;
+	uint32_t flags;
+	uint64_t start;
+	int ret;
+
+	if (header->type == KMS_REC_COMMIT) {
+		const struct kms_rec_commit *rec = payload;
+
+		/* Requests rejected when recorded are only worth a test */
+		if (rec->ret && !(rec->flags & DRM_MODE_ATOMIC_TEST_ONLY))
+			return 0;
+		if (!t_data->atomic_ptr)
+			return -1;
+
+		build_request(t_data, rec);
+		flags = rec->flags;
+		start = kms_now_ns();
+		ret = drmModeAtomicCommit(fd, t_data->atomic_ptr, flags,
+			t_data);
+		if (rec->flags & DRM_MODE_ATOMIC_TEST_ONLY)
+			return !ret != !rec->ret;
+	} else if (header->type == KMS_REC_SET_CRTC) {
+		const struct kms_rec_set_crtc *rec = payload;
+
+		if (rec->ret)
+			return 0;
+		return drmModeSetCrtc(fd, rec->crtc_id,
+			map_id(t_data->fb, t_data->n_fbs, rec->fb_id), rec->x,
+			rec->y, (uint32_t *)(rec + 1), rec->count,
+			rec->has_mode ? (drmModeModeInfoPtr)&rec->mode : NULL);
+	} else {
+		const struct kms_rec_page_flip *rec = payload;
+
+		if (rec->ret)
+			return 0;
+		flags = rec->flags;
+		start = kms_now_ns();
+		ret = drmModePageFlip(fd, rec->crtc_id,
+			map_id(t_data->fb, t_data->n_fbs, rec->fb_id), flags,
+			t_data);
+	}
+
+	if (wants_event(flags, ret)) {
+		if (header->type == KMS_REC_COMMIT)
+			push_commit(t_data, payload, start);
+		else
+			push_submit(t_data, ((const struct kms_rec_page_flip *)
+				payload)->crtc_id, start);
+	}
+
+	return ret;
+}
+
+/*
+ * Re-issue the trace. Paced, each call goes out at its recorded offset
+ * from the 1st one. Either way a submit waits for flips still pending,
+ * as the kernel would reject it otherwise.
+ */
+static void replay_trace(struct test_data *t_data, int paced)
+{
+	const struct kms_rec_header *header;
+	const void *payload;
+	drmEventContext evt_ctx;
+	uint64_t first_ns = 0, base_ns = kms_now_ns();
+	size_t pos = 8;
+
+	memset(&evt_ctx, 0, sizeof(drmEventContext));
+	evt_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evt_ctx.page_flip_handler2 = page_flip_handler2;
+
+	while ((header = next_record(t_data, &pos, &payload))) {
+		if (!first_ns)
+			first_ns = header->time_ns;
+		if (paced)
+			wait_until(t_data, &evt_ctx,
+				base_ns + header->time_ns - first_ns);
+
+		switch (header->type) {
+		case KMS_REC_BLOB:
+			replay_blob(t_data, payload);
+			break;
+		case KMS_REC_DESTROY_BLOB:
+			replay_destroy_blob(t_data,
+				((const struct kms_rec_id *)payload)->id);
+			break;
+		case KMS_REC_ADD_FB:
+			replay_add_fb(t_data, payload);
+			break;
+		case KMS_REC_RM_FB:
+			replay_rm_fb(t_data,
+				((const struct kms_rec_id *)payload)->id);
+			break;
+		case KMS_REC_COMMIT:
+		case KMS_REC_SET_CRTC:
+		case KMS_REC_PAGE_FLIP:
+			if (wait_idle(t_data, &evt_ctx)) {
+				printf("flip event timeout\n");
+				return;
+			}
+			if (replay_submit(t_data, header, payload))
+				t_data->failed++;
+			break;
+		}
+	}
+
+	if (wait_idle(t_data, &evt_ctx))
+		printf("flip event timeout\n");
+}
+
+/* Read whole trace into memory, return 0 if it's a trace */
+static int load_trace(struct test_data *t_data, const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	long size;
+
+	if (!file) {
+		printf("can't open %s\n", path);
+		return -1;
+	}
+
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	t_data->trace = malloc(size > 0 ? size : 1);
+	if (size < 8 || !t_data->trace ||
+		fread(t_data->trace, 1, size, file) != (size_t)size ||
+		memcmp(t_data->trace, KMS_RECORD_MAGIC, 8)) {
+		printf("%s is not a kms_record trace\n", path);
+		fclose(file);
+		return -1;
+	}
+	t_data->trace_size = size;
+	fclose(file);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_data t_data;
+	unsigned int i;
+	int paced = 1;
+
+	/* Check if drm driver name and trace are provided by user */
+	if (argc < 3) {
+		printf("usage: %s <drm driver> <trace> [fast]\n", argv[0]);
+		return -1;
+	}
+	if (argc > 3 && !strcmp(argv[3], "fast"))
+		paced = 0;
+
+	memset(&t_data, 0, sizeof(struct test_data));
+
+	/* Load trace and measure what the recorded process saw */
+	if (load_trace(&t_data, argv[2]))
+		return -1;
+	if (scan_trace(&t_data))
+		printf("trace truncated, replaying complete records\n");
+	printf("recorded:\n");
+	print_samples("flip latency", &t_data.latency);
+	print_samples("flip interval", &t_data.interval);
+
+	t_data.n_fifos = 0;
+	t_data.pending = 0;
+	memset(&t_data.latency, 0, sizeof(struct samples));
+	memset(&t_data.interval, 0, sizeof(struct samples));
+
+	/*
+	 * Open drm device node /dev/dri/cardX with atomic commit enabled if
+	 * supported, and discover its resources and properties.
+	 */
+	if (kms_open(&t_data.dev, argv[1], KMS_OPEN_TRY_ATOMIC))
+		return -1;
+	if (t_data.dev.atomic)
+		t_data.atomic_ptr = drmModeAtomicAlloc();
+
+	replay_trace(&t_data, paced);
+
+	printf("replayed (%s), %u calls failed:\n", paced ? "paced" : "fast",
+		t_data.failed);
+	print_samples("flip latency", &t_data.latency);
+	print_samples("flip interval", &t_data.interval);
+
+	/* Release what the trace left behind */
+	for (i = 0; i < t_data.n_fbs; i++)
+		kms_put_buffer(t_data.dev.fd, &t_data.fb[i].buffer);
+	for (i = 0; i < t_data.n_blobs; i++) {
+		if (t_data.blob[i].to)
+			drmModeDestroyPropertyBlob(t_data.dev.fd,
+				t_data.blob[i].to);
+	}
+	free(t_data.fb);
+	free(t_data.blob);
+	free(t_data.prop);
+	free(t_data.trace);
+	free(t_data.latency.ms);
+	free(t_data.interval.ms);
+
+	/* Release blobs and all discovered metadata at once */
+	kms_close(&t_data.dev);
+	if (t_data.atomic_ptr)
+		drmModeAtomicFree(t_data.atomic_ptr);
+
+	return 0;
+}
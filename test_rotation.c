@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "kms_client.h"
+#include "kms_convert.h"
+
+/* main data structure to store info retrieved from drm drivers */
+struct test_data {
+	struct kms_device dev;
+	struct kms_output output;
+	struct kms_buffer buffer;
+	drmModeAtomicReqPtr atomic_ptr;
+
+	/* Content as the application renders it, before rotation */
+	uint16_t content_w, content_h;
+	uint32_t rotation;
+};
+
+/*
+ * Fill atomic request with the full modeset of the output and the plane
+ * rotation. With plane_rotation the display engine rotates the frame
+ * buffer, src rect is in frame buffer coordinates before rotation.
+ */
+static void
+add_atomic_properties(struct test_data *t_data, uint32_t mode_blob_id,
+	uint32_t plane_rotation)
+{
+	kms_add_modeset(&t_data->dev, t_data->atomic_ptr, &t_data->output,
+		&t_data->buffer, mode_blob_id);
+	kms_add_property(&t_data->dev, t_data->atomic_ptr,
+		DRM_MODE_OBJECT_PLANE, t_data->output.plane->plane_id,
+		"rotation", plane_rotation);
+}
+
+/*
+ * Render content straight into a frame buffer of content size, for the
+ * display engine to rotate. Return 0 if the plane accepts the rotation.
+ */
+static int
+setup_plane_rotation(struct test_data *t_data, uint32_t mode_blob_id)
+{
+	struct kms_device *dev = &t_data->dev;
+	struct kms_buffer *buffer = &t_data->buffer;
+	uint32_t rotations;
+
+	rotations = kms_get_rotations(dev, t_data->output.plane->plane_id);
+	if ((rotations & t_data->rotation) != t_data->rotation)
+		return -1;
+
+	if (kms_add_buffer(dev->fd, buffer, t_data->content_w,
+		t_data->content_h, DRM_FORMAT_XRGB8888))
+		return -1;
+	kms_fill_buffer(buffer, KMS_FILL_TILES);
+
+	add_atomic_properties(t_data, mode_blob_id, t_data->rotation);
+	if (!drmModeAtomicCommit(dev->fd, t_data->atomic_ptr,
+		DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET,
+		NULL))
+		return 0;
+
+	drmModeAtomicSetCursor(t_data->atomic_ptr, 0);
+	kms_put_buffer(dev->fd, buffer);
+
+	return -1;
+}
+
+/*
+ * Render content into staging memory, then rotate it on the CPU into a
+ * frame buffer of mode size. Return 0 on success.
+ */
+static int
+setup_cpu_rotation(struct test_data *t_data, uint32_t mode_blob_id)
+{
+	const struct kms_fill_kernel *kernel =
+		kms_get_fill_kernel(DRM_FORMAT_XRGB8888, KMS_FILL_TILES);
+	drmModeConnectorPtr active_con = t_data->output.con;
+	struct kms_buffer *buffer = &t_data->buffer;
+	unsigned int stride = t_data->content_w * 4;
+	size_t size = (size_t)stride * t_data->content_h;
+	enum kms_page_type page_type;
+	void *staging;
+	double start;
+
+	staging = kms_alloc_huge(size, &page_type);
+	if (!staging)
+		return -1;
+	kernel->fill(staging, t_data->content_w, t_data->content_h, stride, 0);
+
+	if (kms_add_buffer(t_data->dev.fd, buffer,
+		active_con->modes[0].hdisplay, active_con->modes[0].vdisplay,
+		DRM_FORMAT_XRGB8888)) {
+		kms_free_huge(staging, size);
+		return -1;
+	}
+
+	start = kms_now_ns() / 1e6;
+	kms_rotate_xrgb(buffer->buf_ptr, buffer->dumb_buf.pitch, staging,
+		stride, t_data->content_w, t_data->content_h, t_data->rotation);
+	printf("CPU rotation: %.3f ms per frame\n", kms_now_ns() / 1e6 - start);
+
+	kms_free_huge(staging, size);
+
+	add_atomic_properties(t_data, mode_blob_id, DRM_MODE_ROTATE_0);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_data t_data;
+	int i;
+	int fd;
+	int degrees = 90;
+	int force_cpu = 0;
+	uint32_t mode_blob_id;
+	drmModeConnectorPtr active_con;
+
+	/* Check if drm driver name is provided by user */
+	if (argc < 2) {
+		printf("usage: %s <drm driver> [0|90|180|270] [reflect-x] "
+			"[reflect-y] [cpu]\n", argv[0]);
+		return -1;
+	}
+
+	memset(&t_data, 0, sizeof(struct test_data));
+
+	/* Counter-clockwise rotation, reflections apply before it */
+	if (argc > 2)
+		degrees = atoi(argv[2]);
+	switch (degrees) {
+	case 0:
+		t_data.rotation = DRM_MODE_ROTATE_0;
+		break;
+	case 90:
+		t_data.rotation = DRM_MODE_ROTATE_90;
+		break;
+	case 180:
+		t_data.rotation = DRM_MODE_ROTATE_180;
+		break;
+	case 270:
+		t_data.rotation = DRM_MODE_ROTATE_270;
+		break;
+	default:
+		printf("invalid rotation %s\n", argv[2]);
+		return -1;
+	}
+	for (i = 3; i < argc; i++) {
+		if (!strcmp(argv[i], "reflect-x"))
+			t_data.rotation |= DRM_MODE_REFLECT_X;
+		else if (!strcmp(argv[i], "reflect-y"))
+			t_data.rotation |= DRM_MODE_REFLECT_Y;
+		else if (!strcmp(argv[i], "cpu"))
+			force_cpu = 1;
+	}
+
+	/*
+	 * Open drm device node /dev/dri/cardX with atomic commit enabled,
+	 * and discover its resources and properties.
+	 */
+	if (kms_open(&t_data.dev, argv[1], KMS_OPEN_ATOMIC))
+		return -1;
+	fd = t_data.dev.fd;
+
+	/* Allocate drm atomic structure */
+	t_data.atomic_ptr = drmModeAtomicAlloc();
+
+	/* Find a connector, encoder, crtc and plane */
+	if (kms_get_output(&t_data.dev, &t_data.output, 1))
+		return -1;
+	active_con = t_data.output.con;
+
+	/* Content is laid out so that it fills the mode once rotated */
+	if (t_data.rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270)) {
+		t_data.content_w = active_con->modes[0].vdisplay;
+		t_data.content_h = active_con->modes[0].hdisplay;
+	} else {
+		t_data.content_w = active_con->modes[0].hdisplay;
+		t_data.content_h = active_con->modes[0].vdisplay;
+	}
+
+	/* Get mode blob, referenced by crtc state from now on */
+	mode_blob_id = kms_blob_get(fd, &t_data.dev.blobs, active_con->modes,
+		sizeof(drmModeModeInfo));
+
+	/*
+	 * Probe whether the plane rotates for free. If not, rotate on the
+	 * CPU, an extra pass over the frame.
+	 */
+	if (!force_cpu && !setup_plane_rotation(&t_data, mode_blob_id)) {
+		printf("%ux%u content rotated by plane\n", t_data.content_w,
+			t_data.content_h);
+	} else if (setup_cpu_rotation(&t_data, mode_blob_id)) {
+		printf("failed to allocate frame buffer\n");
+		return -1;
+	}
+
+	/* Atomic commit and mode set */
+	drmModeAtomicCommit(fd, t_data.atomic_ptr,
+		DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+
+	getchar();
+
+	kms_put_buffer(fd, &t_data.buffer);
+
+	/* Release blobs and all discovered metadata at once */
+	kms_close(&t_data.dev);
+	drmModeAtomicFree(t_data.atomic_ptr);
+
+	return 0;
+}